@@ -9,8 +9,17 @@
 
 #pragma once
 
+#include "stdbool.h"
 #include "stdint.h"
 
 typedef int32_t (* esp_a2d_source_data_cb_t)(uint8_t *buf, int32_t len);
 
-void ysw_alsa_initialize(esp_a2d_source_data_cb_t data_cb);
+// Returns true if the buffer most recently returned by data_cb was silent
+typedef bool (*ysw_alsa_silence_cb_t)();
+
+// If is_silent is not NULL and idle_millis is not zero, the stream is stopped after
+// idle_millis of silence. data_cb continues to be called once per period while the stream
+// is stopped, and the stream is restarted with the first buffer that is not silent.
+
+void ysw_alsa_initialize(esp_a2d_source_data_cb_t data_cb, uint32_t sample_rate,
+        ysw_alsa_silence_cb_t is_silent, uint32_t idle_millis);
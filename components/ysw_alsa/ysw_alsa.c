@@ -15,17 +15,18 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #define TAG "YSW_ALSA"
 
 #define ALSA_DEVICE "default"
 #define ALSA_CHANNELS 2
-#define ALSA_RATE 44100
 
 // See https://www.alsa-project.org/alsa-doc/alsa-lib/index.html
 // See https://www.alsa-project.org/alsa-doc/alsa-lib/_2test_2pcm_8c-example.html
 
-void ysw_alsa_initialize(esp_a2d_source_data_cb_t data_cb)
+void ysw_alsa_initialize(esp_a2d_source_data_cb_t data_cb, uint32_t sample_rate,
+        ysw_alsa_silence_cb_t is_silent, uint32_t idle_millis)
 {
     snd_pcm_t *alsa;
     // int rc = snd_pcm_open(&alsa, ALSA_DEVICE, SND_PCM_STREAM_PLAYBACK, 0);
@@ -65,9 +66,9 @@ void ysw_alsa_initialize(esp_a2d_source_data_cb_t data_cb)
         abort();
     }
 
-    rc = snd_pcm_hw_params_set_rate(alsa, params, ALSA_RATE, 0);
+    rc = snd_pcm_hw_params_set_rate(alsa, params, sample_rate, 0);
     if (rc < 0) {
-        ESP_LOGE(TAG, "snd_pcm_hw_params_set_rate_near failed, error=%s", snd_strerror(rc));
+        ESP_LOGE(TAG, "snd_pcm_hw_params_set_rate failed, sample_rate=%d, error=%s", sample_rate, snd_strerror(rc));
         abort();
     }
 
@@ -89,12 +90,35 @@ void ysw_alsa_initialize(esp_a2d_source_data_cb_t data_cb)
     int buf_size = period_size * ALSA_CHANNELS * 2;
     uint8_t *buf = ysw_heap_allocate(buf_size);
 
+    uint32_t period_micros = (period_size * 1000000) / sample_rate;
+    uint32_t idle_periods = is_silent ? (idle_millis * 1000) / period_micros : 0;
+    uint32_t silent_periods = 0;
+    bool is_stopped = false;
+
 #ifdef DISPLAY_LATENCY
     uint64_t samples_generated = 0;
     int start_time = ysw_system_get_reference_time_in_millis();
 #endif
 
     while (data_cb(buf, buf_size) > 0) {
+        if (idle_periods) {
+            if (!is_silent()) {
+                silent_periods = 0;
+                if (is_stopped) {
+                    ESP_LOGD(TAG, "restarting stream");
+                    snd_pcm_prepare(alsa);
+                    is_stopped = false;
+                }
+            } else if (is_stopped) {
+                usleep(period_micros);
+                continue;
+            } else if (++silent_periods == idle_periods) {
+                ESP_LOGD(TAG, "stopping idle stream");
+                snd_pcm_drain(alsa);
+                is_stopped = true;
+                continue;
+            }
+        }
         rc = snd_pcm_writei(alsa, buf, period_size);
         if (rc < 0) {
             ESP_LOGE(TAG, "snd_pcm_writei failed, error=%s", snd_strerror(rc));
@@ -104,7 +128,7 @@ void ysw_alsa_initialize(esp_a2d_source_data_cb_t data_cb)
         samples_generated += period_size;
         int current_time = ysw_system_get_reference_time_in_millis();
         if (((current_time - start_time) / 1000) > 10) {
-            int millis_generated = (samples_generated * 1000) / 44100;
+            int millis_generated = (samples_generated * 1000) / sample_rate;
             int elapsed_millis = current_time - start_time;
             int latency = millis_generated - elapsed_millis;
             ESP_LOGI(TAG, "samples_generated=%d, millis_generated=%ld, elapsed_millis=%d, latency=%d", samples_generated, millis_generated, elapsed_millis, latency);
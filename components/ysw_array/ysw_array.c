@@ -217,13 +217,12 @@ int32_t ysw_array_search(ysw_array_t *array, void *needle, ysw_array_comparator
     assert(array);
     assert(comparator);
 
-    int16_t found = -1;
-    uint16_t bottom = 0;
-    int16_t middle = -1;
-    uint16_t top = array->count;
+    int32_t found = -1;
+    uint32_t bottom = 0;
+    uint32_t top = array->count;
 
     while (found == -1 && bottom != top) {
-        middle = bottom + ((top - bottom) / 2);
+        uint32_t middle = bottom + ((top - bottom) / 2);
         int relationship = comparator(&needle, &array->data[middle]);
         if (relationship < 0) {
             top = middle;
@@ -240,13 +239,14 @@ int32_t ysw_array_search(ysw_array_t *array, void *needle, ysw_array_comparator
         }
     }
 
-    if (!found) {
-        if ((match_type & YSW_ARRAY_MATCH_FLOOR) &&
-                (middle > 0 && comparator(&array->data[middle], &needle) < 0)) {
-            found = middle - 1;
-        } else if ((match_type & YSW_ARRAY_MATCH_CEIL) &&
-                (middle + 1 < array->count && comparator(&needle, &array->data[middle+1]) < 0)) {
-            found = middle + 1;
+    // If there is no match, bottom is where needle would be inserted, i.e. the index of
+    // the first element greater than needle
+
+    if (found == -1) {
+        if ((match_type & YSW_ARRAY_MATCH_FLOOR) && bottom > 0) {
+            found = bottom - 1;
+        } else if ((match_type & YSW_ARRAY_MATCH_CEIL) && bottom < array->count) {
+            found = bottom;
         }
     }
 
@@ -19,6 +19,7 @@ extern "C" {
 }
 
 typedef struct {
+    ysw_bus_t *bus;
     BLECharacteristic *pCharacteristic;
     bool deviceConnected = false;
     uint8_t midiPacket[5];
@@ -105,6 +106,25 @@ static inline void on_note_off(ysw_bt_synth_t *ysw_bt_synth, ysw_event_note_off_
     }
 }
 
+static void on_note_batch(ysw_bt_synth_t *ysw_bt_synth, ysw_event_note_batch_t *m)
+{
+    for (uint8_t i = 0; i < m->count; i++) {
+        ysw_event_batch_note_t *note = &m->notes[i];
+        if (note->velocity) {
+            ysw_event_note_on_t note_on = {};
+            note_on.channel = note->channel;
+            note_on.midi_note = note->midi_note;
+            note_on.velocity = note->velocity;
+            on_note_on(ysw_bt_synth, &note_on);
+        } else {
+            ysw_event_note_off_t note_off = {};
+            note_off.channel = note->channel;
+            note_off.midi_note = note->midi_note;
+            on_note_off(ysw_bt_synth, &note_off);
+        }
+    }
+}
+
 static inline void on_program_change(ysw_bt_synth_t *ysw_bt_synth, ysw_event_program_change_t *m)
 {
     if (ysw_bt_synth->deviceConnected) {
@@ -121,6 +141,13 @@ static inline void on_program_change(ysw_bt_synth_t *ysw_bt_synth, ysw_event_pro
     }
 }
 
+// MIDI over Bluetooth has no program loading to wait for
+
+static inline void on_preload(ysw_bt_synth_t *ysw_bt_synth, ysw_event_preload_t *m)
+{
+    ysw_event_fire_preload_done(ysw_bt_synth->bus, m->token);
+}
+
 static void process_event(void *context, ysw_event_t *event) {
     ysw_bt_synth_t *ysw_bt_synth = (ysw_bt_synth_t*)context;
     switch (event->header.type) {
@@ -130,9 +157,15 @@ static void process_event(void *context, ysw_event_t *event) {
         case YSW_EVENT_NOTE_OFF:
             on_note_off(ysw_bt_synth, &event->note_off);
             break;
+        case YSW_EVENT_NOTE_BATCH:
+            on_note_batch(ysw_bt_synth, &event->note_batch);
+            break;
         case YSW_EVENT_PROGRAM_CHANGE:
             on_program_change(ysw_bt_synth, &event->program_change);
             break;
+        case YSW_EVENT_PRELOAD:
+            on_preload(ysw_bt_synth, &event->preload);
+            break;
         default:
             break;
     }
@@ -141,6 +174,7 @@ static void process_event(void *context, ysw_event_t *event) {
 void ysw_bt_synth_create_task(ysw_bus_t *bus)
 {
     ysw_bt_synth_t *ysw_bt_synth = (ysw_bt_synth_t*)ysw_heap_allocate(sizeof(ysw_bt_synth_t));
+    ysw_bt_synth->bus = bus;
     initialize_synthesizer(ysw_bt_synth);
 
     ysw_task_config_t config = ysw_task_default_config;
@@ -47,6 +47,11 @@
 #define BACKGROUND_CHORD (BACKGROUND_BASE+1)
 #define BACKGROUND_RHYTHM (BACKGROUND_BASE+2)
 
+// sequencer tracks, so previews of individual steps do not stop the section
+
+#define SECTION_TRACK 0
+#define PREVIEW_TRACK 1
+
 typedef enum {
     YSW_EDITOR_MODE_MELODY,
     YSW_EDITOR_MODE_CHORD,
@@ -192,19 +197,28 @@ static zm_step_t *get_closest_step(ysw_editor_t *editor)
 static void save_undo_action(ysw_editor_t *editor)
 {
     editor->modified = true;
+    zm_invalidate_section(editor->section);
     // TODO: add undo/redo support
 }
 
-static void recalculate(ysw_editor_t *editor)
+// Steps first_step through unchanged_step - 1 were changed, inserted or removed
+
+static void recalculate(ysw_editor_t *editor, zm_step_x first_step, zm_step_x unchanged_step)
 {
-    zm_recalculate_section(editor->section);
+    zm_recalculate_section_from(editor->section, first_step, unchanged_step);
     ysw_staff_invalidate(editor->staff);
 }
 
+static void recalculate_step(ysw_editor_t *editor)
+{
+    zm_step_x step_index = editor->position / 2;
+    recalculate(editor, step_index, step_index + 1);
+}
+
 static void play_step(ysw_editor_t *editor, zm_step_t *step)
 {
-    ysw_array_t *notes = zm_render_step(editor->music, editor->section, step, BASE_CHANNEL);
-    ysw_event_fire_play(editor->bus, notes, editor->section->tempo);
+    ysw_notes_t *notes = zm_render_step(editor->music, editor->section, step, BASE_CHANNEL);
+    ysw_event_fire_play(editor->bus, PREVIEW_TRACK, notes, editor->section->tempo);
 }
 
 static void play_position(ysw_editor_t *editor)
@@ -418,6 +432,7 @@ static void set_program(ysw_editor_t *editor, ysw_editor_mode_t mode, zm_program
             // no program change for rhythm channel
             break;
     }
+    zm_invalidate_section(editor->section);
     display_program(editor);
     //play_position(editor);
 }
@@ -447,7 +462,7 @@ static void set_time_signature(ysw_editor_t *editor, zm_time_signature_x time)
 {
     editor->section->time = time;
     ysw_footer_set_time(editor->footer, editor->section->time);
-    recalculate(editor);
+    recalculate(editor, 0, ysw_array_get_count(editor->section->steps));
     save_undo_action(editor);
 }
 
@@ -473,7 +488,7 @@ static void set_default_note_duration(ysw_editor_t *editor, zm_duration_t durati
     if (step) {
         step->melody.duration = editor->duration;
         display_mode(editor);
-        recalculate(editor);
+        recalculate_step(editor);
         save_undo_action(editor);
     }
 }
@@ -525,6 +540,7 @@ static void set_chord_style(ysw_editor_t *editor, zm_chord_style_x chord_style_x
     }
     if (step) {
         step->chord.style = editor->chord_style;
+        zm_invalidate_section(editor->section);
     }
     display_mode(editor);
     play_position(editor);
@@ -542,23 +558,23 @@ static inline zm_time_x ysw_abs_time(zm_time_x left, zm_time_x right)
     return left > right ? left - right : right - left;
 }
 
-static zm_step_t *find_closest_step(ysw_array_t *steps, zm_step_x step_index, zm_time_x start)
+static zm_step_x find_closest_step(ysw_array_t *steps, zm_step_x step_index, zm_time_x start)
 {
     bool done = false;
     zm_time_x shortest_delta = INT_MAX;
-    zm_step_t *shortest_step = NULL;
+    zm_step_x shortest_index = step_index;
     zm_step_x step_count = ysw_array_get_count(steps);
     for (zm_step_x i = step_index; i < step_count && !done; i++) {
         zm_step_t *step = ysw_array_get(steps, i);
         zm_time_x this_delta = ysw_abs_time(step->start, start);
         if (this_delta < shortest_delta) {
             shortest_delta = this_delta;
-            shortest_step = step;
+            shortest_index = i;
         } else {
             done = true;
         }
     }
-    return shortest_step;
+    return shortest_index;
 }
 
 static zm_step_t *realize_step(ysw_editor_t *editor, zm_step_x *step_index_p, zm_time_x start)
@@ -571,10 +587,9 @@ static zm_step_t *realize_step(ysw_editor_t *editor, zm_step_x *step_index_p, zm
         ysw_array_insert(editor->section->steps, step_index, step);
     } else {
         if (start) {
-            step = find_closest_step(editor->section->steps, step_index, start);
-        } else {
-            step = ysw_array_get(editor->section->steps, step_index);
+            step_index = find_closest_step(editor->section->steps, step_index, start);
         }
+        step = ysw_array_get(editor->section->steps, step_index);
     }
     if (step_index_p) {
         *step_index_p = step_index;
@@ -582,7 +597,7 @@ static zm_step_t *realize_step(ysw_editor_t *editor, zm_step_x *step_index_p, zm
     return step;
 }
 
-static void finalize_step(ysw_editor_t *editor, zm_step_x step_index)
+static void finalize_step(ysw_editor_t *editor, zm_step_x first_step, zm_step_x step_index)
 {
     zm_step_x step_count = ysw_array_get_count(editor->section->steps);
 #if 0
@@ -593,19 +608,19 @@ static void finalize_step(ysw_editor_t *editor, zm_step_x step_index)
     uint32_t position = min(editor->position + 2, step_count * 2);
 #endif
     set_position(editor, position);
-    recalculate(editor);
+    recalculate(editor, first_step, step_index + 1);
     save_undo_action(editor);
 }
 
-static zm_step_t *find_previous_melody_step(ysw_editor_t *editor, int32_t step_index)
+static int32_t find_previous_melody_step(ysw_editor_t *editor, int32_t step_index)
 {
     while (--step_index > 0) {
         zm_step_t *previous_step = ysw_array_get(editor->section->steps, step_index);
         if (previous_step->melody.note) {
-            return previous_step;
+            return step_index;
         }
     }
-    return NULL;
+    return -1;
 }
 
 static void realize_note(ysw_editor_t *editor, zm_note_t midi_note, zm_time_x duration_millis)
@@ -618,13 +633,16 @@ static void realize_note(ysw_editor_t *editor, zm_note_t midi_note, zm_time_x du
         duration = ysw_millis_to_ticks(duration_millis, editor->section->tempo);
     }
 
-    zm_step_t *previous_step = find_previous_melody_step(editor, step_index);
-    if (previous_step) {
+    zm_step_x first_step = step_index;
+    int32_t previous_index = find_previous_melody_step(editor, step_index);
+    if (previous_index != -1) {
+        zm_step_t *previous_step = ysw_array_get(editor->section->steps, previous_index);
         start = previous_step->start + previous_step->melody.duration;
         zm_time_x articulation = ysw_millis_to_ticks(editor->delta, editor->section->tempo);
         if (articulation < ZM_WHOLE && editor->duration == ZM_AS_PLAYED) {
             if (is_space_position(editor)) {
                 previous_step->melody.duration += articulation;
+                first_step = previous_index;
             }
         } else {
             articulation = 0;
@@ -637,7 +655,7 @@ static void realize_note(ysw_editor_t *editor, zm_note_t midi_note, zm_time_x du
     step->melody.note = midi_note; // rest == 0
     step->melody.duration = duration;
 
-    finalize_step(editor, step_index);
+    finalize_step(editor, first_step, step_index);
 }
 
 static void realize_chord(ysw_editor_t *editor, zm_chord_t *chord)
@@ -651,7 +669,7 @@ static void realize_chord(ysw_editor_t *editor, zm_chord_t *chord)
     step->chord.frequency = chord->frequency;
     step->chord.duration = 0; // set by recalculate
 
-    finalize_step(editor, step_index);
+    finalize_step(editor, step_index, step_index);
 }
 
 static void realize_stroke(ysw_editor_t *editor, zm_note_t surface)
@@ -662,7 +680,7 @@ static void realize_stroke(ysw_editor_t *editor, zm_note_t surface)
     step->rhythm.surface = surface;
     step->rhythm.cadence = editor->drum_cadence;
 
-    finalize_step(editor, step_index);
+    finalize_step(editor, step_index, step_index);
 }
 
 static void realize_beat(ysw_editor_t *editor, zm_beat_t *beat)
@@ -672,7 +690,7 @@ static void realize_beat(ysw_editor_t *editor, zm_beat_t *beat)
 
     step->rhythm.beat = beat;
 
-    finalize_step(editor, step_index);
+    finalize_step(editor, step_index, step_index);
 }
 
 static void realize_rest(ysw_editor_t *editor, zm_time_x duration_ticks)
@@ -683,7 +701,7 @@ static void realize_rest(ysw_editor_t *editor, zm_time_x duration_ticks)
     step->melody.note = 0;
     step->melody.duration = duration_ticks;
 
-    finalize_step(editor, step_index);
+    finalize_step(editor, step_index, step_index);
 }
 
 static void press_note(ysw_editor_t *editor, zm_note_t midi_note, uint32_t down_at)
@@ -744,7 +762,7 @@ static void delete_step(ysw_editor_t *editor)
         zm_step_t *step = ysw_array_remove(editor->section->steps, step_index);
         ysw_heap_free(step);
         set_position(editor, editor->position); // will adjust if necessary
-        recalculate(editor);
+        recalculate(editor, step_index, step_index);
         save_undo_action(editor);
     }
 }
@@ -1102,8 +1120,22 @@ static void on_delete(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t *ite
 static void on_play(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t *item)
 {
     ysw_editor_t *editor = menu->context;
-    ysw_array_t *notes = zm_render_section(editor->music, editor->section, BACKGROUND_BASE);
-    ysw_event_fire_play(editor->bus, notes, editor->section->tempo);
+    ysw_notes_t *notes = zm_render_section(editor->music, editor->section, BACKGROUND_BASE);
+    ysw_event_fire_play(editor->bus, SECTION_TRACK, notes, editor->section->tempo);
+}
+
+// The sequencer seeks with a binary search of the rendered notes and restarts any notes
+// that are still sounding at the step, e.g. a tied melody note or background chord.
+
+static void on_play_from_position(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t *item)
+{
+    ysw_editor_t *editor = menu->context;
+    ysw_notes_t *notes = zm_render_section(editor->music, editor->section, BACKGROUND_BASE);
+    ysw_event_fire_play(editor->bus, SECTION_TRACK, notes, editor->section->tempo);
+    zm_step_t *step = get_closest_step(editor);
+    if (step) {
+        ysw_event_fire_seek(editor->bus, SECTION_TRACK, step->start);
+    }
 }
 
 static void on_headphone_volume(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t *item)
@@ -1139,21 +1171,32 @@ static void on_demo(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t *item)
 {
     ysw_editor_t *editor = menu->context;
     zm_composition_t *composition = ysw_array_get(editor->music->compositions, 0);
-    ysw_array_t *notes = zm_render_composition(editor->music, composition, BACKGROUND_BASE);
-    ysw_event_fire_play(editor->bus, notes, composition->bpm);
+    ysw_array_t *tempos = zm_get_composition_tempos(editor->music, composition);
+    if (tempos) {
+        // A streamed clip cannot change tempo, so the whole composition is rendered up front
+        ysw_event_clip_t clip = {
+            .notes = zm_render_composition(editor->music, composition, BACKGROUND_BASE),
+            .tempos = tempos,
+            .bpm = composition->bpm,
+        };
+        ysw_event_fire_play_clip(editor->bus, SECTION_TRACK, &clip);
+    } else {
+        ysw_note_source_t *source = zm_stream_composition(editor->music, composition, BACKGROUND_BASE);
+        ysw_event_fire_play_source(editor->bus, SECTION_TRACK, source, composition->bpm);
+    }
 }
 
 static void on_stop(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t *item)
 {
     ysw_editor_t *editor = menu->context;
-    ysw_event_fire_stop(editor->bus);
+    ysw_event_fire_stop(editor->bus, SECTION_TRACK);
 }
 
 static void on_loop(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t *item)
 {
     ysw_editor_t *editor = menu->context;
     editor->loop = !editor->loop;
-    ysw_event_fire_loop(editor->bus, editor->loop);
+    ysw_event_fire_loop(editor->bus, SECTION_TRACK, editor->loop);
 }
 
 static void on_left(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t *item)
@@ -1208,7 +1251,7 @@ static void on_edit_length(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t
         }
         play_position(editor);
         display_mode(editor);
-        recalculate(editor);
+        recalculate(editor, range.first, range.last + 1);
         save_undo_action(editor);
     }
 }
@@ -1257,7 +1300,7 @@ static void on_edit_to_clipboard(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_
 
     if (item->value == EDIT_CUT) {
         set_position(editor, ysw_staff_get_anchor(editor->staff)); // will be adjusted as necessary
-        recalculate(editor);
+        recalculate(editor, range.first, range.first);
         save_undo_action(editor);
     }
 
@@ -1268,6 +1311,7 @@ static void on_edit_paste(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t
 {
     ysw_editor_t *editor = menu->context;
     uint32_t new_position = editor->position;
+    zm_step_x first_step = new_position / 2;
     uint32_t clipboard_count = ysw_array_get_count(clipboard);
     for (uint32_t i = 0; i < clipboard_count; i++) {
         zm_step_t *step = ysw_array_get(clipboard, i);
@@ -1278,7 +1322,7 @@ static void on_edit_paste(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t
     }
     
     set_position(editor, new_position);
-    recalculate(editor);
+    recalculate(editor, first_step, first_step + clipboard_count);
     save_undo_action(editor);
 }
 
@@ -1311,7 +1355,8 @@ static void on_chord_style(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t
 
 static void close_editor(ysw_editor_t *editor)
 {
-    ysw_event_fire_stop(editor->bus);
+    ysw_event_fire_stop(editor->bus, SECTION_TRACK);
+    ysw_event_fire_stop(editor->bus, PREVIEW_TRACK);
     ysw_app_terminate();
 }
 
@@ -1457,7 +1502,7 @@ static void on_remove_beat(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t
     zm_step_t *step = get_step(editor);
     if (step) {
         step->rhythm.beat = NULL;
-        recalculate(editor);
+        recalculate_step(editor);
         save_undo_action(editor);
     }
 }
@@ -1472,7 +1517,7 @@ static void on_remove_chord(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_
         step->chord.style = NULL;
         step->chord.duration = 0;
         step->chord.frequency = 0;
-        recalculate(editor);
+        recalculate_step(editor);
         save_undo_action(editor);
     }
 }
@@ -1485,7 +1530,7 @@ static void on_remove_note(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t
         step->melody.note = 0;
         step->melody.duration = 0;
         step->melody.tie = 0;
-        recalculate(editor);
+        recalculate_step(editor);
         save_undo_action(editor);
     }
 }
@@ -1498,7 +1543,7 @@ static void on_remove_rest(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t
         step->melody.note = 0;
         step->melody.duration = 0;
         step->melody.tie = 0;
-        recalculate(editor);
+        recalculate_step(editor);
         save_undo_action(editor);
     }
 }
@@ -1509,7 +1554,7 @@ static void on_remove_stroke(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item
     zm_step_t *step = get_step(editor);
     if (step) {
         step->rhythm.surface = 0;
-        recalculate(editor);
+        recalculate_step(editor);
         save_undo_action(editor);
     }
 }
@@ -1714,6 +1759,7 @@ static const ysw_menu_item_t listen_menu[] = {
     { YSW_R2_C3, "Speaker\nVolume", YSW_MF_PLUS, ysw_menu_nop, 0, speaker_volume_menu },
 
     { YSW_R3_C1, "Loop", YSW_MF_COMMAND, on_loop, 0, NULL },
+    { YSW_R3_C2, "Play\nFrom Here", YSW_MF_COMMAND, on_play_from_position, 0, NULL },
     { YSW_R3_C3, "Synth\nGain", YSW_MF_PLUS, ysw_menu_nop, 0, synth_gain_menu },
 
     { YSW_R4_C1, "Back", YSW_MF_MINUS, ysw_menu_nop, 0, NULL },
@@ -2095,6 +2141,7 @@ void ysw_editor_edit_section(ysw_bus_t *bus, zm_music_t *music, zm_section_t *se
     editor->bus = bus;
     editor->music = music;
     editor->original_section = section;
+    zm_load_section(music, section);
     editor->section = zm_create_duplicate_section(section);
 
     if (!clipboard) {
@@ -34,6 +34,7 @@
 #define DEFAULT_CHORD_TYPE 0
 #define DEFAULT_CHORD_STYLE 0
 #define DEFAULT_BEAT 0
+#define DEFAULT_TEMPO 100
 
 // channels
 
@@ -42,11 +43,16 @@
 #define CHORD_CHANNEL (BASE_CHANNEL+1)
 #define RHYTHM_CHANNEL (BASE_CHANNEL+2)
 
-#define BACKGROUND_BASE (BASE_CHANNEL+3)
+// The backing has a sequencer track and channels of its own, apart from the editor's
+// section and preview tracks, so that they can play at the same time
+
+#define BACKGROUND_BASE (BASE_CHANNEL+6)
 #define BACKGROUND_MELODY (BACKGROUND_BASE+0)
 #define BACKGROUND_CHORD (BACKGROUND_BASE+1)
 #define BACKGROUND_RHYTHM (BACKGROUND_BASE+2)
 
+#define BACKGROUND_TRACK 2
+
 typedef enum {
     YSW_PERFORMER_MODE_MELODY,
     YSW_PERFORMER_MODE_CHORD,
@@ -136,6 +142,31 @@ static void set_program(ysw_performer_t *performer, ysw_performer_mode_t mode, z
     }
 }
 
+// In harp mode, a beat loops on the background track for the notes to be played against
+
+static void start_backing(ysw_performer_t *performer)
+{
+    if (!ysw_array_get_count(performer->music->beats)) {
+        return;
+    }
+    zm_beat_t *beat = ysw_array_get(performer->music->beats, DEFAULT_BEAT);
+    ysw_notes_t *notes = ysw_notes_create(ysw_array_get_count(beat->strokes));
+    zm_render_beat(notes, beat, 0, BACKGROUND_RHYTHM, YSW_MIDI_DRUM_PROGRAM);
+    ysw_notes_sort(notes, zm_note_compare);
+    ysw_event_fire_loop(performer->bus, BACKGROUND_TRACK, true);
+    ysw_event_fire_play(performer->bus, BACKGROUND_TRACK, notes, DEFAULT_TEMPO);
+}
+
+static void set_mode(ysw_performer_t *performer, ysw_performer_mode_t mode)
+{
+    if (mode == YSW_PERFORMER_MODE_HARP && performer->mode != YSW_PERFORMER_MODE_HARP) {
+        start_backing(performer);
+    } else if (mode != YSW_PERFORMER_MODE_HARP && performer->mode == YSW_PERFORMER_MODE_HARP) {
+        ysw_event_fire_stop(performer->bus, BACKGROUND_TRACK);
+    }
+    performer->mode = mode;
+}
+
 static void set_chord_type(ysw_performer_t *performer, zm_chord_type_x chord_type_x)
 {
     performer->chord_type = ysw_array_get(performer->music->chord_types, chord_type_x);
@@ -271,25 +302,25 @@ static void generate_program_menu(ysw_performer_t *performer, ysw_menu_cb_t cb,
 static void on_mode_melody(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t *item)
 {
     ysw_performer_t *performer = menu->context;
-    performer->mode = YSW_PERFORMER_MODE_MELODY;
+    set_mode(performer, YSW_PERFORMER_MODE_MELODY);
 }
 
 static void on_mode_chord(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t *item)
 {
     ysw_performer_t *performer = menu->context;
-    performer->mode = YSW_PERFORMER_MODE_CHORD;
+    set_mode(performer, YSW_PERFORMER_MODE_CHORD);
 }
 
 static void on_mode_rhythm(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t *item)
 {
     ysw_performer_t *performer = menu->context;
-    performer->mode = YSW_PERFORMER_MODE_RHYTHM;
+    set_mode(performer, YSW_PERFORMER_MODE_RHYTHM);
 }
 
 static void on_mode_harp(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t *item)
 {
     ysw_performer_t *performer = menu->context;
-    performer->mode = YSW_PERFORMER_MODE_HARP;
+    set_mode(performer, YSW_PERFORMER_MODE_HARP);
 }
 
 static ysw_menu_item_t program_template[YSW_APP_SOFTKEY_SZ + 1];
@@ -361,7 +392,7 @@ static void on_synth_gain(ysw_menu_t *menu, ysw_event_t *event, ysw_menu_item_t
 
 static void close_performer(ysw_performer_t *performer)
 {
-    ysw_event_fire_stop(performer->bus);
+    ysw_event_fire_stop(performer->bus, BACKGROUND_TRACK);
     ysw_app_terminate();
 }
 
@@ -679,6 +710,8 @@ void ysw_performer_create(ysw_bus_t *bus, zm_music_t *music)
     fire_program_change(performer, MELODY_CHANNEL, performer->melody_program);
     fire_program_change(performer, CHORD_CHANNEL, performer->chord_program);
 
+    start_backing(performer);
+
     performer->container = lv_obj_create(lv_scr_act(), NULL);
     assert(performer->container);
 
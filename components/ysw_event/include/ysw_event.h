@@ -24,10 +24,15 @@ typedef enum {
     YSW_EVENT_TEMPO,
     YSW_EVENT_LOOP,
     YSW_EVENT_SPEED,
+    YSW_EVENT_SEEK,
     YSW_EVENT_NOTE_ON,
     YSW_EVENT_NOTE_OFF,
+    YSW_EVENT_NOTE_BATCH,
     YSW_EVENT_BANK_SELECT,
     YSW_EVENT_PROGRAM_CHANGE,
+    YSW_EVENT_PREFETCH,
+    YSW_EVENT_PRELOAD,
+    YSW_EVENT_PRELOAD_DONE,
     YSW_EVENT_AMP_VOLUME,
     YSW_EVENT_SYNTH_GAIN,
     YSW_EVENT_SAMPLE_LOAD,
@@ -52,8 +57,10 @@ typedef struct {
 } ysw_event_header_t;
 
 typedef struct {
-    ysw_array_t *notes; // must remain accessible for duration of playback
-    uint8_t bpm;
+    ysw_notes_t *notes; // freed by the sequencer when it is done with the clip
+    ysw_array_t *tempos; // ysw_tempo_t changes after tick zero, sorted by start, NULL if none
+    ysw_note_source_t *source; // if not NULL, supplies the notes a piece at a time, in place of notes
+    uint8_t bpm; // tempo at tick zero
 } ysw_event_clip_t;
 
 typedef enum {
@@ -62,34 +69,73 @@ typedef enum {
     YSW_EVENT_PLAY_QUEUE, // play now if nothing playing, otherwise add to play list
 } ysw_event_play_type_t;
 
+// The sequencer plays a clip (and its play list) on each of several tracks at the same
+// time. Playback events name the track they apply to.
+
 typedef struct {
     ysw_event_play_type_t type;
+    uint8_t track;
+    uint8_t channel_offset; // added to each note's channel, set when track starts playing
     ysw_event_clip_t clip;
 } ysw_event_play_t;
 
 typedef struct {
+    uint8_t track;
+} ysw_event_transport_t;
+
+typedef struct {
+    uint8_t track;
     uint8_t bpm;
 } ysw_event_tempo_t;
 
 typedef struct {
+    uint8_t track;
     bool loop;
 } ysw_event_loop_t;
 
 typedef struct {
+    uint8_t track;
     uint8_t percent;
 } ysw_event_speed_t;
 
+typedef struct {
+    uint8_t track;
+    uint32_t tick; // position in clip, notes that are sounding at this tick are restarted
+} ysw_event_seek_t;
+
+// Notes may be stamped with the audio frame at which they should take effect, as given
+// by the synthesizer's frame clock. A frame of zero means as soon as possible.
+
 typedef struct {
     uint8_t channel;
     uint8_t midi_note;
     uint8_t velocity;
+    uint32_t frame;
 } ysw_event_note_on_t;
 
 typedef struct {
     uint8_t channel;
     uint8_t midi_note;
+    uint32_t frame;
 } ysw_event_note_off_t;
 
+// A batch carries note ons and note offs that take effect at the same time, in order, so
+// that a chord is one message per subscriber rather than one per note.
+
+#define YSW_EVENT_MAX_BATCH 10
+
+typedef struct {
+    uint8_t channel;
+    uint8_t midi_note;
+    uint8_t velocity; // zero for note off
+} ysw_event_batch_note_t;
+
+typedef struct {
+    uint32_t frame;
+    uint8_t count;
+    ysw_event_batch_note_t notes[YSW_EVENT_MAX_BATCH];
+} ysw_event_note_batch_t;
+
 typedef struct {
     uint8_t channel;
     uint8_t bank;
@@ -101,6 +147,39 @@ typedef struct {
     bool preload;
 } ysw_event_program_change_t;
 
+#define YSW_EVENT_MAX_PREFETCH 16
+
+typedef struct {
+    uint8_t bank;
+    uint8_t program;
+} ysw_event_preset_t;
+
+typedef struct {
+    uint8_t count;
+    ysw_event_preset_t presets[YSW_EVENT_MAX_PREFETCH];
+} ysw_event_prefetch_t;
+
+// A preload asks synthesizers to load the program for each channel, using the channel's
+// current bank, and to reply with a preload done event with the same token once they can
+// play it without delay. Synthesizers that load programs synchronously reply immediately.
+
+#define YSW_EVENT_MAX_PRELOAD 16
+
+typedef struct {
+    uint8_t channel;
+    uint8_t program;
+} ysw_event_channel_program_t;
+
+typedef struct {
+    uint16_t token;
+    uint8_t count;
+    ysw_event_channel_program_t programs[YSW_EVENT_MAX_PRELOAD];
+} ysw_event_preload_t;
+
+typedef struct {
+    uint16_t token;
+} ysw_event_preload_done_t;
+
 typedef struct {
     uint16_t percent_volume;
 } ysw_event_amp_volume_t;
@@ -180,14 +259,20 @@ typedef struct {
     ysw_event_header_t header;
     union {
         ysw_event_play_t play;
+        ysw_event_transport_t transport;
         ysw_event_tempo_t tempo;
         ysw_event_loop_t loop;
         ysw_event_speed_t speed;
+        ysw_event_seek_t seek;
         ysw_event_note_status_t note_status;
         ysw_event_note_on_t note_on;
         ysw_event_note_off_t note_off;
+        ysw_event_note_batch_t note_batch;
         ysw_event_bank_select_t bank_select;
         ysw_event_program_change_t program_change;
+        ysw_event_prefetch_t prefetch;
+        ysw_event_preload_t preload;
+        ysw_event_preload_done_t preload_done;
         ysw_event_amp_volume_t amp_volume;
         ysw_event_synth_gain_t synth_gain;
         ysw_event_sample_load_t sample_load;
@@ -208,12 +293,16 @@ void ysw_event_publish(ysw_bus_t *bus, ysw_event_t *event);
 
 void ysw_event_fire_note_on(ysw_bus_t *bus, ysw_origin_t origin, ysw_event_note_on_t *note_on);
 void ysw_event_fire_note_off(ysw_bus_t *bus, ysw_origin_t origin, ysw_event_note_off_t *note_off);
+void ysw_event_fire_note_batch(ysw_bus_t *bus, ysw_origin_t origin, ysw_event_note_batch_t *note_batch);
 void ysw_event_fire_bank_select(ysw_bus_t *bus, ysw_origin_t origin, ysw_event_bank_select_t *bank);
 void ysw_event_fire_program_change(ysw_bus_t *bus, ysw_origin_t origin, ysw_event_program_change_t *program);
+void ysw_event_fire_prefetch(ysw_bus_t *bus, ysw_origin_t origin, ysw_event_prefetch_t *prefetch);
+void ysw_event_fire_preload(ysw_bus_t *bus, ysw_origin_t origin, ysw_event_preload_t *preload);
+void ysw_event_fire_preload_done(ysw_bus_t *bus, uint16_t token);
 void ysw_event_fire_amp_volume(ysw_bus_t *bus, uint16_t percent_volume);
 void ysw_event_fire_synth_gain(ysw_bus_t *bus, uint16_t percent_gain);
-void ysw_event_fire_loop_done(ysw_bus_t *bus);
-void ysw_event_fire_play_done(ysw_bus_t *bus);
+void ysw_event_fire_loop_done(ysw_bus_t *bus, uint8_t track);
+void ysw_event_fire_play_done(ysw_bus_t *bus, uint8_t track);
 void ysw_event_fire_idle(ysw_bus_t *bus);
 void ysw_event_fire_note_status(ysw_bus_t *bus, ysw_note_t *note);
 void ysw_event_fire_key_down(ysw_bus_t *bus, ysw_event_key_down_t *key_down);
@@ -224,8 +313,11 @@ void ysw_event_fire_notekey_up(ysw_bus_t *bus, ysw_event_notekey_up_t *notekey_u
 void ysw_event_fire_softkey_down(ysw_bus_t *bus, ysw_event_softkey_down_t *softkey_down);
 void ysw_event_fire_softkey_pressed(ysw_bus_t *bus, ysw_event_softkey_pressed_t *softkey_pressed);
 void ysw_event_fire_softkey_up(ysw_bus_t *bus, ysw_event_softkey_up_t *softkey_up);
-void ysw_event_fire_loop(ysw_bus_t *bus, bool loop);
-void ysw_event_fire_play(ysw_bus_t *bus, ysw_array_t *notes, uint8_t bpm);
-void ysw_event_fire_stop(ysw_bus_t *bus);
+void ysw_event_fire_loop(ysw_bus_t *bus, uint8_t track, bool loop);
+void ysw_event_fire_play(ysw_bus_t *bus, uint8_t track, ysw_notes_t *notes, uint8_t bpm);
+void ysw_event_fire_play_source(ysw_bus_t *bus, uint8_t track, ysw_note_source_t *source, uint8_t bpm);
+void ysw_event_fire_play_clip(ysw_bus_t *bus, uint8_t track, ysw_event_clip_t *clip);
+void ysw_event_fire_stop(ysw_bus_t *bus, uint8_t track);
+void ysw_event_fire_seek(ysw_bus_t *bus, uint8_t track, uint32_t tick);
 void ysw_event_fire_sample_load(ysw_bus_t *bus, ysw_event_sample_load_t *sample_load);
 void ysw_event_fire_chooser_select(ysw_bus_t *bus, zm_section_t *section, void *context);
@@ -18,6 +18,7 @@ typedef enum {
     YSW_ORIGIN_SAMPLER,
     YSW_ORIGIN_SEQUENCER,
     YSW_ORIGIN_SOFTKEY,
+    YSW_ORIGIN_SYNTH,
     YSW_ORIGIN_LAST,
 } ysw_origin_t;
 
@@ -43,6 +43,16 @@ void ysw_event_fire_note_off(ysw_bus_t *bus, ysw_origin_t origin, ysw_event_note
     ysw_event_publish(bus, &event);
 }
 
+void ysw_event_fire_note_batch(ysw_bus_t *bus, ysw_origin_t origin, ysw_event_note_batch_t *note_batch)
+{
+    ysw_event_t event = {
+        .header.origin = origin,
+        .header.type = YSW_EVENT_NOTE_BATCH,
+        .note_batch = *note_batch,
+    };
+    ysw_event_publish(bus, &event);
+}
+
 void ysw_event_fire_bank_select(ysw_bus_t *bus, ysw_origin_t origin, ysw_event_bank_select_t *bank)
 {
     ysw_event_t event = {
@@ -63,6 +73,36 @@ void ysw_event_fire_program_change(ysw_bus_t *bus, ysw_origin_t origin, ysw_even
     ysw_event_publish(bus, &event);
 }
 
+void ysw_event_fire_prefetch(ysw_bus_t *bus, ysw_origin_t origin, ysw_event_prefetch_t *prefetch)
+{
+    ysw_event_t event = {
+        .header.origin = origin,
+        .header.type = YSW_EVENT_PREFETCH,
+        .prefetch = *prefetch,
+    };
+    ysw_event_publish(bus, &event);
+}
+
+void ysw_event_fire_preload(ysw_bus_t *bus, ysw_origin_t origin, ysw_event_preload_t *preload)
+{
+    ysw_event_t event = {
+        .header.origin = origin,
+        .header.type = YSW_EVENT_PRELOAD,
+        .preload = *preload,
+    };
+    ysw_event_publish(bus, &event);
+}
+
+void ysw_event_fire_preload_done(ysw_bus_t *bus, uint16_t token)
+{
+    ysw_event_t event = {
+        .header.origin = YSW_ORIGIN_SYNTH,
+        .header.type = YSW_EVENT_PRELOAD_DONE,
+        .preload_done.token = token,
+    };
+    ysw_event_publish(bus, &event);
+}
+
 void ysw_event_fire_amp_volume(ysw_bus_t *bus, uint16_t percent_volume)
 {
     ysw_event_t event = {
@@ -83,20 +123,22 @@ void ysw_event_fire_synth_gain(ysw_bus_t *bus, uint16_t percent_gain)
     ysw_event_publish(bus, &event);
 }
 
-void ysw_event_fire_loop_done(ysw_bus_t *bus)
+void ysw_event_fire_loop_done(ysw_bus_t *bus, uint8_t track)
 {
     ysw_event_t event = {
         .header.origin = YSW_ORIGIN_SEQUENCER,
         .header.type = YSW_EVENT_LOOP_DONE,
+        .transport.track = track,
     };
     ysw_event_publish(bus, &event);
 }
 
-void ysw_event_fire_play_done(ysw_bus_t *bus)
+void ysw_event_fire_play_done(ysw_bus_t *bus, uint8_t track)
 {
     ysw_event_t event = {
         .header.origin = YSW_ORIGIN_SEQUENCER,
         .header.type = YSW_EVENT_PLAY_DONE,
+        .transport.track = track,
     };
     ysw_event_publish(bus, &event);
 }
@@ -200,33 +242,72 @@ void ysw_event_fire_softkey_up(ysw_bus_t *bus, ysw_event_softkey_up_t *softkey_u
     ysw_event_publish(bus, &event);
 }
 
-void ysw_event_fire_loop(ysw_bus_t *bus, bool loop)
+void ysw_event_fire_loop(ysw_bus_t *bus, uint8_t track, bool loop)
 {
     ysw_event_t event = {
         .header.origin = YSW_ORIGIN_COMMAND,
         .header.type = YSW_EVENT_LOOP,
+        .loop.track = track,
         .loop.loop = loop,
     };
     ysw_event_publish(bus, &event);
 }
 
-void ysw_event_fire_play(ysw_bus_t *bus, ysw_array_t *notes, uint8_t bpm)
+void ysw_event_fire_play(ysw_bus_t *bus, uint8_t track, ysw_notes_t *notes, uint8_t bpm)
 {
     ysw_event_t event = {
         .header.origin = YSW_ORIGIN_COMMAND,
         .header.type = YSW_EVENT_PLAY,
         .play.type = YSW_EVENT_PLAY_NOW,
+        .play.track = track,
         .play.clip.notes = notes,
         .play.clip.bpm = bpm,
     };
     ysw_event_publish(bus, &event);
 }
 
-void ysw_event_fire_stop(ysw_bus_t *bus)
+void ysw_event_fire_play_source(ysw_bus_t *bus, uint8_t track, ysw_note_source_t *source, uint8_t bpm)
+{
+    ysw_event_t event = {
+        .header.origin = YSW_ORIGIN_COMMAND,
+        .header.type = YSW_EVENT_PLAY,
+        .play.type = YSW_EVENT_PLAY_NOW,
+        .play.track = track,
+        .play.clip.source = source,
+        .play.clip.bpm = bpm,
+    };
+    ysw_event_publish(bus, &event);
+}
+
+void ysw_event_fire_play_clip(ysw_bus_t *bus, uint8_t track, ysw_event_clip_t *clip)
+{
+    ysw_event_t event = {
+        .header.origin = YSW_ORIGIN_COMMAND,
+        .header.type = YSW_EVENT_PLAY,
+        .play.type = YSW_EVENT_PLAY_NOW,
+        .play.track = track,
+        .play.clip = *clip,
+    };
+    ysw_event_publish(bus, &event);
+}
+
+void ysw_event_fire_stop(ysw_bus_t *bus, uint8_t track)
 {
     ysw_event_t event = {
         .header.origin = YSW_ORIGIN_COMMAND,
         .header.type = YSW_EVENT_STOP,
+        .transport.track = track,
+    };
+    ysw_event_publish(bus, &event);
+}
+
+void ysw_event_fire_seek(ysw_bus_t *bus, uint8_t track, uint32_t tick)
+{
+    ysw_event_t event = {
+        .header.origin = YSW_ORIGIN_COMMAND,
+        .header.type = YSW_EVENT_SEEK,
+        .seek.track = track,
+        .seek.tick = tick,
     };
     ysw_event_publish(bus, &event);
 }
@@ -19,6 +19,7 @@
 #define TAG "YSW_FLUID_SYNTH"
 
 typedef struct {
+    ysw_bus_t *bus;
     const char *sf_filename;
     QueueHandle_t queue;
     fluid_synth_t *synth;
@@ -37,11 +38,30 @@ static inline void on_note_off(ysw_fluid_synth_t *fluid_synth, ysw_event_note_of
     fluid_synth_noteoff(fluid_synth->synth, m->channel, m->midi_note);
 }
 
+static void on_note_batch(ysw_fluid_synth_t *fluid_synth, ysw_event_note_batch_t *m)
+{
+    for (uint8_t i = 0; i < m->count; i++) {
+        ysw_event_batch_note_t *note = &m->notes[i];
+        if (note->velocity) {
+            fluid_synth_noteon(fluid_synth->synth, note->channel, note->midi_note, note->velocity);
+        } else {
+            fluid_synth_noteoff(fluid_synth->synth, note->channel, note->midi_note);
+        }
+    }
+}
+
 static inline void on_program_change(ysw_fluid_synth_t *fluid_synth, ysw_event_program_change_t *m)
 {
     fluid_synth_program_change(fluid_synth->synth, m->channel, m->program);
 }
 
+// Programs are loaded when they are selected, so there is nothing to wait for
+
+static inline void on_preload(ysw_fluid_synth_t *fluid_synth, ysw_event_preload_t *m)
+{
+    ysw_event_fire_preload_done(fluid_synth->bus, m->token);
+}
+
 static void process_event(void *context, ysw_event_t *event)
 {
     ysw_fluid_synth_t *fluid_synth = context;
@@ -52,9 +72,15 @@ static void process_event(void *context, ysw_event_t *event)
         case YSW_EVENT_NOTE_OFF:
             on_note_off(fluid_synth, &event->note_off);
             break;
+        case YSW_EVENT_NOTE_BATCH:
+            on_note_batch(fluid_synth, &event->note_batch);
+            break;
         case YSW_EVENT_PROGRAM_CHANGE:
             on_program_change(fluid_synth, &event->program_change);
             break;
+        case YSW_EVENT_PRELOAD:
+            on_preload(fluid_synth, &event->preload);
+            break;
         default:
             break;
     }
@@ -94,6 +120,7 @@ static void initialize_synthesizer(ysw_fluid_synth_t *fluid_synth, const char *d
 void ysw_fluid_synth_create_task(ysw_bus_t *bus, const char *sf_filename, const char *driver)
 {
     ysw_fluid_synth_t *fluid_synth = ysw_heap_allocate(sizeof(ysw_fluid_synth_t));
+    fluid_synth->bus = bus;
     fluid_synth->sf_filename = sf_filename;
     initialize_synthesizer(fluid_synth, driver);
 
@@ -76,6 +76,14 @@ static void on_note_off(ysw_led_t *led, ysw_event_note_off_t *event)
     control_led(event->channel, event->midi_note, false);
 }
 
+static void on_note_batch(ysw_led_t *led, ysw_event_note_batch_t *event)
+{
+    for (uint8_t i = 0; i < event->count; i++) {
+        ysw_event_batch_note_t *note = &event->notes[i];
+        control_led(note->channel, note->midi_note, note->velocity);
+    }
+}
+
 static void process_event(void *context, ysw_event_t *event)
 {
     ysw_led_t *led = context;
@@ -87,6 +95,9 @@ static void process_event(void *context, ysw_event_t *event)
             case YSW_EVENT_NOTE_OFF:
                 on_note_off(led, &event->note_off);
                 break;
+            case YSW_EVENT_NOTE_BATCH:
+                on_note_batch(led, &event->note_batch);
+                break;
             default:
                 break;
         }
@@ -61,7 +61,7 @@ void app_main()
     ysw_main_init_device(bus);
     zm_music_t *music = zm_load_music();
     ysw_main_init_synthesizer(bus, music);
-    ysw_sequencer_create_task(bus);
+    ysw_sequencer_create_task(bus, &ysw_sequencer_default_config);
     ysw_shell_create(bus, music);
 }
 
@@ -34,6 +34,10 @@
 
 #define TAG "YSW_MAIN_LINUX"
 
+// Stop the ALSA stream after this much silence so that an idle kiosk does not keep the
+// audio device busy
+#define ALSA_IDLE_MILLIS 5000
+
 UNUSED
 static void initialize_fs_synthesizer(ysw_bus_t *bus, zm_music_t *music)
 {
@@ -47,19 +51,26 @@ ysw_mod_synth_t *ysw_mod_synth;
 
 static ysw_mod_sample_type_t sample_type = YSW_MOD_16BIT_SIGNED;
 
+static bool is_audio_silent;
+
 static int32_t generate_audio(uint8_t *buffer, int32_t bytes_requested)
 {
     int32_t bytes_generated = 0;
     if (buffer && bytes_requested) {
-        ysw_mod_generate_samples(ysw_mod_synth, (int16_t*)buffer, bytes_requested / 4, sample_type);
+        is_audio_silent = ysw_mod_generate_samples(ysw_mod_synth, (int16_t*)buffer, bytes_requested / 4, sample_type);
         bytes_generated = bytes_requested;
     }
     return bytes_generated;
 }
 
+static bool is_silent()
+{
+    return is_audio_silent;
+}
+
 static void* alsa_thread(void *p)
 {
-    ysw_alsa_initialize(generate_audio);
+    ysw_alsa_initialize(generate_audio, ysw_mod_synth->sample_rate, is_silent, ALSA_IDLE_MILLIS);
     return NULL;
 }
 
@@ -67,7 +78,12 @@ static void initialize_mod_synthesizer(ysw_bus_t *bus, zm_music_t *music)
 {
     ESP_LOGD(TAG, "configuring MOD synth with ALSA");
 
-    ysw_mod_synth = ysw_mod_synth_create_task(bus);
+    ysw_mod_synth_config_t config = ysw_mod_synth_default_config;
+    config.sample_rate = 48000;
+    config.max_voices = 64;
+    config.interpolation = YSW_MOD_INTERPOLATE_CUBIC;
+
+    ysw_mod_synth = ysw_mod_synth_create_task(bus, &config);
     pthread_t p;
     pthread_create(&p, NULL, &alsa_thread, NULL);
 }
@@ -210,8 +226,25 @@ void ysw_main_init_synthesizer(ysw_bus_t *bus, zm_music_t *music)
     initialize_mod_synthesizer(bus, music);
 }
 
+static uint32_t get_audio_frame(void *context)
+{
+    return ysw_mod_synth_get_frame_clock(context);
+}
+
+static void initialize_sequencer(ysw_bus_t *bus)
+{
+    // Schedule notes against the MOD synth's frame clock rather than the system clock
+    ysw_sequencer_config_t config = ysw_sequencer_default_config;
+    config.get_frame = get_audio_frame;
+    config.clock_context = ysw_mod_synth;
+    config.sample_rate = ysw_mod_synth->sample_rate;
+
+    ysw_sequencer_create_task(bus, &config);
+}
+
 //#define YSW_TEST 1
 //#define YSW_EXTRACTOR 1
+//#define YSW_COMPILER 1
 
 int main(int argc, char *argv[])
 {
@@ -222,12 +255,14 @@ int main(int argc, char *argv[])
     extern int extract(int argc, char *argv[]);
     char *args[] = {"extract", "extractor/music.sf2", "extractor/tmp"};
     extract(3, args);
+#elif YSW_COMPILER
+    ysw_mod_image_compile("extractor/tmp", "extractor/tmp/" YSW_MOD_IMAGE_NAME);
 #else
     ysw_bus_t *bus = ysw_event_create_bus();
     ysw_main_init_device(bus);
     zm_music_t *music = zm_load_music();
     ysw_main_init_synthesizer(bus, music);
-    ysw_sequencer_create_task(bus);
+    initialize_sequencer(bus);
     ysw_shell_create(bus, music);
     return 0;
 #endif
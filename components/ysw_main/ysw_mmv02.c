@@ -190,7 +190,9 @@ void ysw_main_init_synthesizer(ysw_bus_t *bus, zm_music_t *music)
     ESP_LOGD(TAG, "configuring FluidSynth synth");
     ysw_fluid_synth_create_task(bus, YSW_MUSIC_SOUNDFONT, "a2dp");
 #elif SYNTH_TYPE == MOD_SYNTH
-    ysw_mod_synth = ysw_mod_synth_create_task(bus);
+    ysw_mod_synth_config_t config = ysw_mod_synth_default_config;
+    config.sample_rate = YSW_I2S_SAMPLE_RATE;
+    ysw_mod_synth = ysw_mod_synth_create_task(bus, &config);
 #endif
     ysw_i2s_create_task(initialize_audio_output, generate_audio);
 }
@@ -171,7 +171,9 @@ void ysw_main_init_device(ysw_bus_t *bus)
 
 void ysw_main_init_synthesizer(ysw_bus_t *bus, zm_music_t *music)
 {
-    ysw_mod_synth = ysw_mod_synth_create_task(bus);
+    ysw_mod_synth_config_t config = ysw_mod_synth_default_config;
+    config.sample_rate = YSW_I2S_SAMPLE_RATE;
+    ysw_mod_synth = ysw_mod_synth_create_task(bus, &config);
     ysw_i2s_create_task(initialize_audio_output, generate_audio);
 }
 
@@ -0,0 +1,102 @@
+// Copyright 2020 Anthony F. Stuart - All rights reserved.
+//
+// This program and the accompanying materials are made available
+// under the terms of the GNU General Public License. For other license
+// options please contact the copyright owner.
+//
+// This program is made available on an "as is" basis, without
+// warranties or conditions of any kind, either express or implied.
+
+#pragma once
+
+#include "stdint.h"
+
+// A sound bank image packs every preset and sample of a folder of preset CSV files and
+// raw sample files into a single file. The file starts with a header, followed by tables
+// of fixed size records, followed by sample data. All multi-byte values are little endian.
+//
+//   ysw_mod_image_header_t
+//   ysw_mod_image_preset_t[preset_count] (sorted by bank, program)
+//   ysw_mod_image_instrument_t[instrument_count]
+//   ysw_mod_image_zone_t[zone_count]
+//   ysw_mod_image_data_t[data_count]
+//   sample data, each starting at a YSW_MOD_IMAGE_ALIGNMENT boundary
+
+#define YSW_MOD_IMAGE_NAME "soundbank.bin"
+#define YSW_MOD_IMAGE_MAGIC 0x42575359 // YSWB
+#define YSW_MOD_IMAGE_VERSION 1
+#define YSW_MOD_IMAGE_ALIGNMENT 4
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t preset_count;
+    uint32_t instrument_count;
+    uint32_t zone_count;
+    uint32_t data_count;
+    uint32_t presets_offset;
+    uint32_t instruments_offset;
+    uint32_t zones_offset;
+    uint32_t data_offset;
+} ysw_mod_image_header_t;
+
+typedef struct {
+    uint8_t bank;
+    uint8_t program;
+    uint16_t instrument_count;
+    uint32_t first_instrument;
+} ysw_mod_image_preset_t;
+
+typedef struct {
+    uint32_t zone_count;
+    uint32_t first_zone;
+} ysw_mod_image_instrument_t;
+
+// Envelope times are in timecents and sustain is in centibels, as in the preset CSV
+// files, so that they can be converted at the synthesizer's output rate.
+
+typedef struct {
+    uint32_t data_index;
+    uint32_t loop_start;
+    uint32_t loop_end;
+    int16_t attenuation;
+    int16_t fine_tune;
+    int16_t root_key;
+    int16_t delay;
+    int16_t attack;
+    int16_t hold;
+    int16_t decay;
+    int16_t sustain;
+    int16_t release;
+    uint16_t reserved;
+    uint8_t loop_type;
+    uint8_t volume;
+    uint8_t pan;
+    uint8_t from_note;
+    uint8_t to_note;
+    uint8_t from_velocity;
+    uint8_t to_velocity;
+    uint8_t reserved2;
+} ysw_mod_image_zone_t;
+
+typedef struct {
+    uint32_t offset;
+    uint32_t length;
+} ysw_mod_image_data_t;
+
+typedef struct {
+    int fd;
+    uint32_t guard_before; // zero samples allocated before and after sample data
+    uint32_t guard_after;
+    ysw_mod_image_header_t header;
+    ysw_mod_image_preset_t *presets;
+    ysw_mod_image_instrument_t *instruments;
+    ysw_mod_image_zone_t *zones;
+    ysw_mod_image_data_t *data;
+    int8_t **cache; // sample data that has been read, by data index
+} ysw_mod_image_t;
+
+ysw_mod_image_t *ysw_mod_image_open(const char *path, uint32_t guard_before, uint32_t guard_after);
+ysw_mod_image_preset_t *ysw_mod_image_find_preset(ysw_mod_image_t *image, uint8_t bank, uint8_t program);
+int8_t *ysw_mod_image_get_data(ysw_mod_image_t *image, uint32_t data_index, uint32_t *length);
+void ysw_mod_image_compile(const char *folder, const char *path);
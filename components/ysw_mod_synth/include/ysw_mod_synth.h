@@ -11,15 +11,30 @@
 
 #include "ysw_bus.h"
 #include "ysw_midi.h"
+#include "ysw_mod_image.h"
+#include "ysw_ring.h"
+#include "ysw_task.h"
 #include "hash.h"
-#include "freertos/FreeRTOS.h"
-#include "freertos/semphr.h"
 #include "stdint.h"
 
-#define MAX_VOICES 16
+#define YSW_MOD_DEFAULT_MAX_VOICES 16
+#define YSW_MOD_DEFAULT_SAMPLE_RATE 44100
+
+// Sample files and images hold samples recorded at this rate
+#define YSW_MOD_SOURCE_SAMPLE_RATE 44100.0
+
+// Voices are rendered a block of frames at a time into 32-bit mix buffers
+#define YSW_MOD_BLOCK_SIZE 64
 
 #define YSW_MOD_MAX_BANKS 2
 
+// Note ons waiting for the loader task to finish loading their preset
+#define YSW_MOD_MAX_PENDING 32
+
+// Preload requests waiting for the loader task, and the presets in each
+#define YSW_MOD_MAX_PRELOADS 4
+#define YSW_MOD_MAX_PRELOAD_PRESETS 16
+
 // NB: ysw_mod_synth.c depends on the order and relationship of DAHDSR states
 
 typedef enum {
@@ -50,7 +65,7 @@ typedef enum {
 typedef struct {
     char *name;
     int8_t *data;
-    uint16_t length;
+    uint32_t length;
     uint32_t loop_start;
     uint32_t loop_end;
     ysw_mod_loop_t loop_type;
@@ -64,14 +79,15 @@ typedef struct {
     uint32_t hold;
     uint32_t decay;
     uint32_t release;
-    uint32_t sustain;
+    float sustain; // level, 0.0 to 1.0
+    float increment_per_hz; // scaled position increment per Hz of note frequency, at output rate
     uint8_t from_note;
     uint8_t to_note;
     uint8_t from_velocity;
     uint8_t to_velocity;
 } ysw_mod_sample_t;
 
-typedef struct {
+typedef struct voice_s {
     ysw_mod_sample_t *sample;
     uint32_t samppos; // scaled position in sample
     uint32_t sampinc;
@@ -80,18 +96,32 @@ typedef struct {
     uint32_t loop_start;
     uint32_t loop_end;
     ysw_mod_loop_t loop_type;
-    uint32_t iterations;
-    uint32_t next_change;
-    int32_t amplitude;
-    int32_t ramp_step;
+    float level; // envelope level, 0.0 to 1.0
+    float coeff; // level = level * coeff + offset, for each frame of current segment
+    float offset;
+    uint32_t remaining; // frames remaining in current segment
     uint8_t volume;
+    uint8_t left_volume; // volume after pan, hoisted out of render loop
+    uint8_t right_volume;
     uint8_t channel;
     uint8_t midi_note;
+    uint8_t priority; // channel priority when voice was started
+    bool is_held; // note on without a note off
+    uint16_t active_index; // position in active_voices heap
+    struct voice_s *next_held; // next voice for same channel and note
+    struct voice_s *prev_held;
     ysw_mod_state_t state;
 } voice_t;
 
+// Zones are indexed when the preset is realized. Velocities are mapped to buckets that
+// start wherever some zone's velocity range starts or ends, so every velocity in a bucket
+// selects the same zone for a given note.
+
 typedef struct {
     ysw_array_t *samples;
+    uint8_t bucket_count;
+    uint8_t velocity_buckets[YSW_MIDI_MAX_COUNT]; // velocity -> bucket
+    uint8_t *zone_map; // [midi_note * bucket_count + bucket] -> sample index + 1, 0 if none
 } ysw_mod_instrument_t;
 
 typedef struct {
@@ -103,15 +133,98 @@ typedef struct {
 
 typedef struct {
     uint8_t num;
-    ysw_mod_preset_t *presets[YSW_MIDI_MAX_COUNT];
+    ysw_mod_preset_t *presets[YSW_MIDI_MAX_COUNT]; // published by loader task once samples are loaded
+    bool requested[YSW_MIDI_MAX_COUNT]; // written only by event task
 } ysw_mod_bank_t;
 
+typedef struct {
+    uint8_t channel;
+    uint8_t midi_note;
+    uint8_t velocity;
+    uint8_t bank;
+    uint8_t program;
+    uint32_t frame;
+} ysw_mod_pending_t;
+
+typedef struct {
+    uint16_t token;
+    uint8_t count;
+    uint8_t banks[YSW_MOD_MAX_PRELOAD_PRESETS];
+    uint8_t programs[YSW_MOD_MAX_PRELOAD_PRESETS];
+} ysw_mod_preload_t;
+
+// Interpolation kernels for reading samples at fractional positions. Sample data is
+// allocated with YSW_MOD_GUARD_BEFORE and YSW_MOD_GUARD_AFTER guard points so that
+// kernels never check bounds.
+
+typedef enum {
+    YSW_MOD_INTERPOLATE_NONE,
+    YSW_MOD_INTERPOLATE_LINEAR,
+    YSW_MOD_INTERPOLATE_CUBIC,
+} ysw_mod_interpolation_t;
+
+#define YSW_MOD_GUARD_BEFORE 1
+#define YSW_MOD_GUARD_AFTER 2
+
+// Voices are allocated from a pool of max_voices. When the pool is exhausted, a sounding
+// voice is stolen: released voices first, then voices on lower priority channels, then
+// the oldest voice. Envelope times and pitch are converted to the output sample_rate
+// when each preset is realized.
+
+typedef struct {
+    uint32_t sample_rate;
+    uint16_t max_voices;
+    uint8_t channel_priorities[YSW_MIDI_MAX_CHANNELS]; // higher values are stolen last
+    ysw_mod_interpolation_t interpolation;
+} ysw_mod_synth_config_t;
+
+extern const ysw_mod_synth_config_t ysw_mod_synth_default_config;
+
+// Commands are posted by the event task and applied by the audio callback at block
+// boundaries. The event task resolves presets and loads sample data, so by the time a
+// note on command is posted, everything the audio callback needs is in memory.
+
+typedef enum {
+    YSW_MOD_COMMAND_NOTE_ON,
+    YSW_MOD_COMMAND_NOTE_OFF,
+    YSW_MOD_COMMAND_GAIN,
+} ysw_mod_command_type_t;
+
+typedef struct {
+    ysw_mod_command_type_t type;
+    uint8_t channel;
+    uint8_t midi_note;
+    uint8_t velocity;
+    uint16_t percent_gain;
+    ysw_mod_sample_t *sample;
+    uint32_t frame; // frame clock value at which to apply, 0 for start of next block
+} ysw_mod_command_t;
+
+// Timed commands that were taken from the ring before they were due, ordered by frame and
+// then by sequence, the order in which they were taken
+
+#define YSW_MOD_MAX_TIMED 64
+
+typedef struct {
+    ysw_mod_command_t command;
+    uint32_t sequence;
+} ysw_mod_timed_t;
+
 typedef struct {
     uint8_t channel_banks[YSW_MIDI_MAX_CHANNELS];
     uint8_t channel_presets[YSW_MIDI_MAX_CHANNELS];
     uint32_t voice_time;
-    voice_t voices[MAX_VOICES];
-    uint16_t voice_count;
+    uint32_t sample_rate;
+    uint16_t max_voices;
+    uint8_t channel_priorities[YSW_MIDI_MAX_CHANNELS];
+    ysw_mod_interpolation_t interpolation;
+    voice_t *voices; // pool of max_voices voices, owned by audio callback
+    voice_t **free_voices; // stack of idle voices
+    uint16_t free_count;
+    voice_t **active_voices; // heap of sounding voices, root is next to be stolen
+    uint16_t active_count;
+    voice_t **retired_voices; // voices that went idle while rendering current block
+    voice_t **held_voices; // [channel * YSW_MIDI_MAX_COUNT + midi_note] -> list of held voices
     uint16_t mod_loaded;
     int16_t last_left_sample;
     int16_t last_right_sample;;
@@ -119,10 +232,24 @@ typedef struct {
     int16_t stereo_separation;
     int16_t filter;
     uint16_t percent_gain;
-    SemaphoreHandle_t mutex;
+    uint32_t frame_clock; // frames generated, written only by audio callback
+    ysw_ring_t *commands; // from event task (producer) to audio callback (consumer)
+    ysw_mod_timed_t timed[YSW_MOD_MAX_TIMED]; // heap of timed commands, owned by audio callback
+    uint16_t timed_count;
+    uint32_t timed_sequence;
+    ysw_bus_t *bus;
+    ysw_task_t *task;
+    QueueHandle_t loader_queue;
+    ysw_mod_pending_t pending[YSW_MOD_MAX_PENDING];
+    uint8_t pending_count;
+    ysw_mod_preload_t preloads[YSW_MOD_MAX_PRELOADS];
+    uint8_t preload_count;
     const char *folder;
     ysw_mod_bank_t banks[YSW_MOD_MAX_BANKS];
     hash_t *sample_map;
+    ysw_mod_image_t *image; // owned by loader task, NULL if using CSV and sample files
+    int32_t left_mix[YSW_MOD_BLOCK_SIZE];
+    int32_t right_mix[YSW_MOD_BLOCK_SIZE];
 } ysw_mod_synth_t;
 
 typedef enum {
@@ -130,7 +257,9 @@ typedef enum {
     YSW_MOD_16BIT_UNSIGNED,
 } ysw_mod_sample_type_t;
 
-ysw_mod_synth_t *ysw_mod_synth_create_task(ysw_bus_t *bus);
+ysw_mod_synth_t *ysw_mod_synth_create_task(ysw_bus_t *bus, const ysw_mod_synth_config_t *config);
+
+uint32_t ysw_mod_synth_get_frame_clock(ysw_mod_synth_t *mod_synth);
 
-void ysw_mod_generate_samples(ysw_mod_synth_t *ysw_mod_synth,
+bool ysw_mod_generate_samples(ysw_mod_synth_t *ysw_mod_synth,
         int16_t *buffer, uint32_t number, ysw_mod_sample_type_t sample_type);
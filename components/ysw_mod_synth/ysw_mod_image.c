@@ -0,0 +1,487 @@
+// Copyright 2020 Anthony F. Stuart - All rights reserved.
+//
+// This program and the accompanying materials are made available
+// under the terms of the GNU General Public License. For other license
+// options please contact the copyright owner.
+//
+// This program is made available on an "as is" basis, without
+// warranties or conditions of any kind, either express or implied.
+
+#include "ysw_mod_image.h"
+#include "ysw_array.h"
+#include "ysw_csv.h"
+#include "ysw_heap.h"
+#include "hash.h"
+#include "esp_log.h"
+#include "sys/types.h"
+#include "sys/stat.h"
+#include "assert.h"
+#include "dirent.h"
+#include "fcntl.h"
+#include "stdbool.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+
+#define TAG "YSW_MOD_IMAGE"
+
+#define PATH_SIZE 128
+#define RECORD_SIZE 128
+#define TOKENS_SIZE 64
+
+// Must match ysw_mod_record_t in ysw_mod_synth.c
+
+#define RECORD_PRESET 0
+#define RECORD_INSTRUMENT 1
+#define RECORD_SAMPLE 2
+
+static void read_at(int fd, uint32_t offset, void *buffer, uint32_t length)
+{
+    if (lseek(fd, offset, SEEK_SET) == -1) {
+        ESP_LOGE(TAG, "lseek failed, offset=%d", offset);
+        abort();
+    }
+    int rc = read(fd, buffer, length);
+    if (rc != length) {
+        ESP_LOGE(TAG, "read failed, rc=%d, length=%d", rc, length);
+        abort();
+    }
+}
+
+static void *read_table(int fd, uint32_t offset, uint32_t count, uint32_t record_size)
+{
+    uint32_t length = count * record_size;
+    void *table = ysw_heap_allocate(length ? length : 1);
+    read_at(fd, offset, table, length);
+    return table;
+}
+
+static int compare_presets(const void *left, const void *right)
+{
+    const ysw_mod_image_preset_t *left_preset = left;
+    const ysw_mod_image_preset_t *right_preset = right;
+    int delta = left_preset->bank - right_preset->bank;
+    if (!delta) {
+        delta = left_preset->program - right_preset->program;
+    }
+    return delta;
+}
+
+static bool has_table(uint32_t size, uint32_t offset, uint32_t count, uint32_t record_size)
+{
+    return !(offset % YSW_MOD_IMAGE_ALIGNMENT) && offset <= size && count <= (size - offset) / record_size;
+}
+
+static bool is_range(uint32_t first, uint32_t count, uint32_t total)
+{
+    return first <= total && count <= total - first;
+}
+
+static bool locate_tables(const ysw_mod_image_header_t *h, uint32_t size)
+{
+    return has_table(size, h->presets_offset, h->preset_count, sizeof(ysw_mod_image_preset_t)) &&
+            has_table(size, h->instruments_offset, h->instrument_count, sizeof(ysw_mod_image_instrument_t)) &&
+            has_table(size, h->zones_offset, h->zone_count, sizeof(ysw_mod_image_zone_t)) &&
+            has_table(size, h->data_offset, h->data_count, sizeof(ysw_mod_image_data_t));
+}
+
+// Checks every reference in the image, so that a damaged image is rejected when it is
+// opened rather than read out of bounds when a preset is realized. Presets must be in
+// order, because they are found with a binary search.
+
+static bool validate_records(ysw_mod_image_t *image, uint32_t size)
+{
+    const ysw_mod_image_header_t *h = &image->header;
+    for (uint32_t i = 0; i < h->preset_count; i++) {
+        const ysw_mod_image_preset_t *r = &image->presets[i];
+        if (!is_range(r->first_instrument, r->instrument_count, h->instrument_count) ||
+                (i && compare_presets(&image->presets[i - 1], r) >= 0)) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < h->instrument_count; i++) {
+        const ysw_mod_image_instrument_t *r = &image->instruments[i];
+        if (!is_range(r->first_zone, r->zone_count, h->zone_count)) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < h->zone_count; i++) {
+        if (image->zones[i].data_index >= h->data_count) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < h->data_count; i++) {
+        const ysw_mod_image_data_t *r = &image->data[i];
+        if (!is_range(r->offset, r->length, size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void free_tables(ysw_mod_image_t *image)
+{
+    ysw_heap_free(image->presets);
+    ysw_heap_free(image->instruments);
+    ysw_heap_free(image->zones);
+    ysw_heap_free(image->data);
+}
+
+// Returns NULL if there is no image at path, or if it is damaged, so that callers can fall
+// back to CSV files. Sample data is returned with guard_before and guard_after zero samples
+// around it, so that playback can read past either end without checking bounds.
+
+ysw_mod_image_t *ysw_mod_image_open(const char *path, uint32_t guard_before, uint32_t guard_after)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1 || sb.st_size < sizeof(ysw_mod_image_header_t)) {
+        ESP_LOGE(TAG, "invalid image, path=%s, size=%ld", path, (long)sb.st_size);
+        close(fd);
+        return NULL;
+    }
+    uint32_t size = sb.st_size;
+
+    ysw_mod_image_header_t header;
+    read_at(fd, 0, &header, sizeof(header));
+    if (header.magic != YSW_MOD_IMAGE_MAGIC || header.version != YSW_MOD_IMAGE_VERSION) {
+        ESP_LOGE(TAG, "invalid image, path=%s, magic=%#x, version=%d", path, header.magic, header.version);
+        close(fd);
+        return NULL;
+    }
+
+    if (!locate_tables(&header, size)) {
+        ESP_LOGE(TAG, "invalid image, path=%s, tables extend past size=%d", path, size);
+        close(fd);
+        return NULL;
+    }
+
+    ysw_mod_image_t *image = ysw_heap_allocate(sizeof(ysw_mod_image_t));
+    image->fd = fd;
+    image->guard_before = guard_before;
+    image->guard_after = guard_after;
+    image->header = header;
+    image->presets = read_table(fd, header.presets_offset, header.preset_count, sizeof(ysw_mod_image_preset_t));
+    image->instruments = read_table(fd, header.instruments_offset, header.instrument_count, sizeof(ysw_mod_image_instrument_t));
+    image->zones = read_table(fd, header.zones_offset, header.zone_count, sizeof(ysw_mod_image_zone_t));
+    image->data = read_table(fd, header.data_offset, header.data_count, sizeof(ysw_mod_image_data_t));
+
+    if (!validate_records(image, size)) {
+        ESP_LOGE(TAG, "invalid image, path=%s, damaged records", path);
+        free_tables(image);
+        ysw_heap_free(image);
+        close(fd);
+        return NULL;
+    }
+
+    image->cache = ysw_heap_allocate(header.data_count * sizeof(int8_t *) + 1);
+
+    ESP_LOGD(TAG, "open path=%s, presets=%d, instruments=%d, zones=%d, samples=%d", path,
+            header.preset_count, header.instrument_count, header.zone_count, header.data_count);
+
+    return image;
+}
+
+ysw_mod_image_preset_t *ysw_mod_image_find_preset(ysw_mod_image_t *image, uint8_t bank, uint8_t program)
+{
+    assert(image);
+    ysw_mod_image_preset_t needle = {
+        .bank = bank,
+        .program = program,
+    };
+    return bsearch(&needle, image->presets, image->header.preset_count,
+            sizeof(ysw_mod_image_preset_t), compare_presets);
+}
+
+// Sample data is shared by every zone that references it, so it is read at most once
+
+int8_t *ysw_mod_image_get_data(ysw_mod_image_t *image, uint32_t data_index, uint32_t *length)
+{
+    assert(image);
+    assert(data_index < image->header.data_count);
+
+    ysw_mod_image_data_t *data = &image->data[data_index];
+    if (!image->cache[data_index]) {
+        int8_t *buffer = ysw_heap_allocate(image->guard_before + data->length + image->guard_after);
+        image->cache[data_index] = buffer + image->guard_before;
+        read_at(image->fd, data->offset, image->cache[data_index], data->length);
+    }
+
+    if (length) {
+        *length = data->length;
+    }
+
+    return image->cache[data_index];
+}
+
+typedef struct {
+    const char *folder;
+    ysw_array_t *presets;
+    ysw_array_t *instruments;
+    ysw_array_t *zones;
+    ysw_array_t *sample_names;
+    hash_t *sample_map;
+} compiler_t;
+
+static uint32_t get_data_index(compiler_t *compiler, const char *name)
+{
+    hnode_t *node = hash_lookup(compiler->sample_map, name);
+    if (node) {
+        return (uintptr_t)hnode_get(node);
+    }
+    char *sample_name = ysw_heap_strdup(name);
+    uint32_t data_index = ysw_array_push(compiler->sample_names, sample_name);
+    if (!hash_alloc_insert(compiler->sample_map, sample_name, (void *)(uintptr_t)data_index)) {
+        ESP_LOGE(TAG, "hash_alloc_insert failed");
+        abort();
+    }
+    return data_index;
+}
+
+static int16_t parse_timecents(const char *token)
+{
+    return token[0] ? atoi(token) : -32768;
+}
+
+static void compile_zone(compiler_t *compiler, ysw_csv_t *csv)
+{
+    ysw_mod_image_zone_t *zone = ysw_heap_allocate(sizeof(ysw_mod_image_zone_t));
+    zone->data_index = get_data_index(compiler, ysw_csv_get_token(csv, 1));
+    zone->loop_start = atoi(ysw_csv_get_token(csv, 2));
+    zone->loop_end = atoi(ysw_csv_get_token(csv, 3));
+    zone->volume = atoi(ysw_csv_get_token(csv, 4));
+    zone->pan = atoi(ysw_csv_get_token(csv, 5));
+    zone->loop_type = atoi(ysw_csv_get_token(csv, 6));
+    zone->attenuation = atoi(ysw_csv_get_token(csv, 7));
+    zone->fine_tune = atoi(ysw_csv_get_token(csv, 8));
+    zone->root_key = atoi(ysw_csv_get_token(csv, 9));
+    zone->delay = parse_timecents(ysw_csv_get_token(csv, 10));
+    zone->attack = parse_timecents(ysw_csv_get_token(csv, 11));
+    zone->hold = parse_timecents(ysw_csv_get_token(csv, 12));
+    zone->decay = parse_timecents(ysw_csv_get_token(csv, 13));
+    zone->sustain = atoi(ysw_csv_get_token(csv, 14));
+    zone->release = parse_timecents(ysw_csv_get_token(csv, 15));
+    zone->from_note = atoi(ysw_csv_get_token(csv, 16));
+    zone->to_note = atoi(ysw_csv_get_token(csv, 17));
+    zone->from_velocity = atoi(ysw_csv_get_token(csv, 18));
+    zone->to_velocity = atoi(ysw_csv_get_token(csv, 19));
+    ysw_array_push(compiler->zones, zone);
+}
+
+// Records follow the same grammar as parse_file in ysw_mod_synth.c: a preset record,
+// followed by instrument records, each followed by its sample records.
+
+static void compile_preset(compiler_t *compiler, const char *file_name)
+{
+    char path[PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/presets/%s", compiler->folder, file_name);
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        ESP_LOGE(TAG, "fopen failed, file=%s", path);
+        abort();
+    }
+
+    ysw_csv_t *csv = ysw_csv_create(file, RECORD_SIZE, TOKENS_SIZE);
+
+    ysw_mod_image_preset_t *preset = NULL;
+    ysw_mod_image_instrument_t *instrument = NULL;
+
+    uint32_t token_count = 0;
+    while ((token_count = ysw_csv_parse_next_record(csv))) {
+        uint32_t type = atoi(ysw_csv_get_token(csv, 0));
+        if (type == RECORD_PRESET && token_count == 4 && !preset) {
+            preset = ysw_heap_allocate(sizeof(ysw_mod_image_preset_t));
+            preset->bank = atoi(ysw_csv_get_token(csv, 2));
+            preset->program = atoi(ysw_csv_get_token(csv, 3));
+            preset->first_instrument = ysw_array_get_count(compiler->instruments);
+            ysw_array_push(compiler->presets, preset);
+        } else if (type == RECORD_INSTRUMENT && token_count == 2 && preset) {
+            instrument = ysw_heap_allocate(sizeof(ysw_mod_image_instrument_t));
+            instrument->first_zone = ysw_array_get_count(compiler->zones);
+            ysw_array_push(compiler->instruments, instrument);
+            preset->instrument_count++;
+        } else if (type == RECORD_SAMPLE && token_count == 20 && instrument) {
+            compile_zone(compiler, csv);
+            instrument->zone_count++;
+        } else {
+            ESP_LOGW(TAG, "invalid file=%s, record_count=%d, record type=%d, token_count=%d",
+                    path, ysw_csv_get_record_count(csv), type, token_count);
+        }
+    }
+
+    ysw_csv_free(csv);
+    fclose(file);
+}
+
+static int compare_names(const void *left, const void *right)
+{
+    return strcmp(*(char * const *)left, *(char * const *)right);
+}
+
+// Preset file names are %03d-%03d.csv (bank, program) so sorting by name sorts by key
+
+static ysw_array_t *get_preset_file_names(const char *folder)
+{
+    char path[PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/presets", folder);
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        ESP_LOGE(TAG, "opendir failed, folder=%s", path);
+        abort();
+    }
+
+    ysw_array_t *file_names = ysw_array_create(128);
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        const char *extension = strrchr(entry->d_name, '.');
+        if (extension && strcmp(extension, ".csv") == 0) {
+            ysw_array_push(file_names, ysw_heap_strdup(entry->d_name));
+        }
+    }
+
+    closedir(dir);
+    ysw_array_sort(file_names, compare_names);
+    return file_names;
+}
+
+static void write_bytes(FILE *file, const void *buffer, uint32_t length)
+{
+    if (length && fwrite(buffer, length, 1, file) != 1) {
+        ESP_LOGE(TAG, "fwrite failed, length=%d", length);
+        abort();
+    }
+}
+
+static void write_table(FILE *file, ysw_array_t *records, uint32_t record_size)
+{
+    uint32_t count = ysw_array_get_count(records);
+    for (uint32_t i = 0; i < count; i++) {
+        write_bytes(file, ysw_array_get(records, i), record_size);
+    }
+}
+
+static inline uint32_t align(uint32_t offset)
+{
+    return (offset + YSW_MOD_IMAGE_ALIGNMENT - 1) & ~(YSW_MOD_IMAGE_ALIGNMENT - 1);
+}
+
+static void write_image(compiler_t *compiler, const char *path)
+{
+    ysw_mod_image_header_t header = {
+        .magic = YSW_MOD_IMAGE_MAGIC,
+        .version = YSW_MOD_IMAGE_VERSION,
+        .preset_count = ysw_array_get_count(compiler->presets),
+        .instrument_count = ysw_array_get_count(compiler->instruments),
+        .zone_count = ysw_array_get_count(compiler->zones),
+        .data_count = ysw_array_get_count(compiler->sample_names),
+    };
+
+    header.presets_offset = sizeof(ysw_mod_image_header_t);
+    header.instruments_offset = header.presets_offset + header.preset_count * sizeof(ysw_mod_image_preset_t);
+    header.zones_offset = header.instruments_offset + header.instrument_count * sizeof(ysw_mod_image_instrument_t);
+    header.data_offset = header.zones_offset + header.zone_count * sizeof(ysw_mod_image_zone_t);
+
+    ysw_mod_image_data_t *data = ysw_heap_allocate(header.data_count * sizeof(ysw_mod_image_data_t) + 1);
+    uint32_t offset = align(header.data_offset + header.data_count * sizeof(ysw_mod_image_data_t));
+    for (uint32_t i = 0; i < header.data_count; i++) {
+        char sample_path[PATH_SIZE];
+        snprintf(sample_path, sizeof(sample_path), "%s/samples/%s", compiler->folder,
+                (char *)ysw_array_get(compiler->sample_names, i));
+        struct stat sb;
+        if (stat(sample_path, &sb) == -1) {
+            ESP_LOGE(TAG, "stat failed, file=%s", sample_path);
+            abort();
+        }
+        data[i].offset = offset;
+        data[i].length = sb.st_size;
+        offset = align(offset + sb.st_size);
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        ESP_LOGE(TAG, "fopen failed, file=%s", path);
+        abort();
+    }
+
+    write_bytes(file, &header, sizeof(header));
+    write_table(file, compiler->presets, sizeof(ysw_mod_image_preset_t));
+    write_table(file, compiler->instruments, sizeof(ysw_mod_image_instrument_t));
+    write_table(file, compiler->zones, sizeof(ysw_mod_image_zone_t));
+    write_bytes(file, data, header.data_count * sizeof(ysw_mod_image_data_t));
+
+    for (uint32_t i = 0; i < header.data_count; i++) {
+        char sample_path[PATH_SIZE];
+        snprintf(sample_path, sizeof(sample_path), "%s/samples/%s", compiler->folder,
+                (char *)ysw_array_get(compiler->sample_names, i));
+        int fd = open(sample_path, O_RDONLY);
+        if (fd == -1) {
+            ESP_LOGE(TAG, "open failed, file=%s", sample_path);
+            abort();
+        }
+        void *buffer = ysw_heap_allocate(data[i].length + 1);
+        read_at(fd, 0, buffer, data[i].length);
+        close(fd);
+
+        static const uint8_t padding[YSW_MOD_IMAGE_ALIGNMENT];
+        write_bytes(file, padding, data[i].offset - ftell(file));
+        write_bytes(file, buffer, data[i].length);
+        ysw_heap_free(buffer);
+    }
+
+    fclose(file);
+    ysw_heap_free(data);
+
+    ESP_LOGI(TAG, "compile path=%s, presets=%d, instruments=%d, zones=%d, samples=%d, bytes=%d", path,
+            header.preset_count, header.instrument_count, header.zone_count, header.data_count, offset);
+}
+
+/**
+ * Compile a folder of preset CSV files and raw sample files (i.e. the output of the
+ * extractor) into a single sound bank image.
+ * @param folder containing presets and samples subfolders
+ * @param path of image file to create
+ */
+
+void ysw_mod_image_compile(const char *folder, const char *path)
+{
+    compiler_t compiler = {
+        .folder = folder,
+        .presets = ysw_array_create(128),
+        .instruments = ysw_array_create(128),
+        .zones = ysw_array_create(512),
+        .sample_names = ysw_array_create(512),
+        .sample_map = hash_create(HASHCOUNT_T_MAX, NULL, NULL),
+    };
+
+    ysw_array_t *file_names = get_preset_file_names(folder);
+    uint32_t file_count = ysw_array_get_count(file_names);
+    for (uint32_t i = 0; i < file_count; i++) {
+        compile_preset(&compiler, ysw_array_get(file_names, i));
+    }
+
+    // ysw_mod_image_find_preset does a binary search, so reject files named out of order
+    uint32_t preset_count = ysw_array_get_count(compiler.presets);
+    for (uint32_t i = 1; i < preset_count; i++) {
+        if (compare_presets(ysw_array_get(compiler.presets, i - 1), ysw_array_get(compiler.presets, i)) >= 0) {
+            ESP_LOGE(TAG, "presets are not in (bank, program) order at index=%d", i);
+            abort();
+        }
+    }
+
+    write_image(&compiler, path);
+
+    hash_free_nodes(compiler.sample_map);
+    hash_destroy(compiler.sample_map);
+    ysw_array_free_all(compiler.presets);
+    ysw_array_free_all(compiler.instruments);
+    ysw_array_free_all(compiler.zones);
+    ysw_array_free_all(compiler.sample_names);
+    ysw_array_free_all(file_names);
+}
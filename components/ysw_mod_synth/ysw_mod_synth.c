@@ -14,9 +14,12 @@
 #include "ysw_csv.h"
 #include "ysw_event.h"
 #include "ysw_heap.h"
+#include "ysw_message.h"
 #include "ysw_midi.h"
 #include "ysw_task.h"
 #include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "sys/types.h"
 #include "sys/stat.h"
 #include "assert.h"
@@ -28,21 +31,40 @@
 #include "unistd.h"
 
 #define TAG "YSW_MOD_SYNTH"
+#define LOADER_TAG "YSW_MOD_LOADER"
 
 // TODO: establish naming conventions for scaled values, positions vs indices, sample properties, etc.
-// TODO: evaluate cost of generating samples via ysw_bus (or alternative) and remove mutex
 // TODO: make ysw_mod_generate_samples private and handle via ysw_bus
 
 #define PATH_SIZE 128
 #define RECORD_SIZE 128
 #define TOKENS_SIZE 64
 
-#define SAMPLE_RATE 44100.0
+// Must be a power of two, see ysw_ring_create
+#define COMMAND_RING_SIZE 256
+
+#define LOADER_QUEUE_SIZE 32
+
+// How often the event task checks whether deferred note ons and preloads are ready
+#define PENDING_POLL_MILLIS 5
 
 #define POS_SCALE_FACTOR 10
-#define AMP_SCALE_FACTOR 20
-#define AMP_MAX_VALUE 100
-#define AMP_MAX_SCALED (AMP_MAX_VALUE << AMP_SCALE_FACTOR)
+#define POS_FRACTION_MASK ((1 << POS_SCALE_FACTOR) - 1)
+
+// Kernels return samples scaled from 8 to 16 bits so that interpolation keeps its precision
+#define KERNEL_SCALE_FACTOR 8
+
+// Envelope levels run from 0.0 to 1.0 and are treated as silent below -100 dB
+#define ENVELOPE_SILENCE 0.00001f
+#define ENVELOPE_GAIN_SCALE 32767.0f
+
+// Presets and samples are loaded by a separate loader task so that a note on for an
+// instrument that is not in memory yet does not hold up the event task.
+
+typedef struct {
+    uint8_t bank;
+    uint8_t program;
+} ysw_mod_load_request_t;
 
 typedef enum {
     YSW_MOD_PRESET = 0,
@@ -60,41 +82,50 @@ static inline float to_frequency(int8_t note)
     return 440.0 * pow(2.0, (note - 69) / 12.0);
 }
 
-static inline uint32_t apply_amplitude_envelope(int32_t amplitude, int32_t value)
+#define GAIN_SCALE_FACTOR 15
+#define MIX_SCALE_FACTOR 8
+
+static inline int32_t to_mix_gain(uint16_t percent_gain)
 {
-    return (value * (amplitude >> AMP_SCALE_FACTOR)) / AMP_MAX_VALUE;
+    return (percent_gain << MIX_SCALE_FACTOR) / 100;
 }
 
-static inline uint32_t apply_percent_gain(uint16_t percent_gain, int32_t value)
+static inline float centibels_to_level(int16_t centibels)
 {
-    return (percent_gain * value) / 100;
+    return powf(10.0, (-centibels / 10.0 / 20.0));
 }
 
-static inline uint32_t parse_centibels(const char *token)
+static inline uint32_t timecents_to_samples(int16_t timecents, float sample_rate)
 {
-    int16_t centibels = atoi(token);
-    float amplitude = powf(10.0, (-centibels / 10.0 / 20.0));
-    uint32_t scaled_amplitude = amplitude * (AMP_MAX_VALUE << AMP_SCALE_FACTOR);
-    return scaled_amplitude;
+    uint32_t samples = to_millis(timecents) * sample_rate;
+    return samples;
 }
 
-static inline uint32_t parse_timecents(const char *token)
+static inline float parse_centibels(const char *token)
 {
-    int16_t timecents = token[0] ? atoi(token) : -32768;
-    uint32_t samples = to_millis(timecents) * SAMPLE_RATE;
-    return samples;
+    return centibels_to_level(atoi(token));
 }
 
-static inline uint32_t calculate_sample_increment(ysw_mod_sample_t *sample, uint8_t midi_note)
+static inline uint32_t parse_timecents(const char *token, float sample_rate)
+{
+    return timecents_to_samples(token[0] ? atoi(token) : -32768, sample_rate);
+}
+
+static inline float get_increment_per_hz(ysw_mod_sample_t *sample, float sample_rate)
 {
-    uint32_t sampinc = (1 << POS_SCALE_FACTOR) *
+    return (1 << POS_SCALE_FACTOR) *
         to_millis(sample->fine_tune) /
         to_frequency(sample->root_key) *
-        to_frequency(midi_note);
+        (YSW_MOD_SOURCE_SAMPLE_RATE / sample_rate);
+}
+
+static inline uint32_t calculate_sample_increment(ysw_mod_sample_t *sample, uint8_t midi_note)
+{
+    uint32_t sampinc = sample->increment_per_hz * to_frequency(midi_note);
     return sampinc;
 }
 
-static ysw_mod_sample_t *parse_sample(ysw_csv_t *csv)
+static ysw_mod_sample_t *parse_sample(ysw_csv_t *csv, float sample_rate)
 {
     ysw_mod_sample_t *sample = ysw_heap_allocate(sizeof(ysw_mod_sample_t));
     sample->name = ysw_heap_strdup(ysw_csv_get_token(csv, 1));
@@ -106,12 +137,13 @@ static ysw_mod_sample_t *parse_sample(ysw_csv_t *csv)
     sample->attenuation = atoi(ysw_csv_get_token(csv, 7));
     sample->fine_tune = atoi(ysw_csv_get_token(csv, 8));
     sample->root_key = atoi(ysw_csv_get_token(csv, 9));
-    sample->delay = parse_timecents(ysw_csv_get_token(csv, 10));
-    sample->attack = parse_timecents(ysw_csv_get_token(csv, 11));
-    sample->hold = parse_timecents(ysw_csv_get_token(csv, 12));
-    sample->decay = parse_timecents(ysw_csv_get_token(csv, 13));
+    sample->delay = parse_timecents(ysw_csv_get_token(csv, 10), sample_rate);
+    sample->attack = parse_timecents(ysw_csv_get_token(csv, 11), sample_rate);
+    sample->hold = parse_timecents(ysw_csv_get_token(csv, 12), sample_rate);
+    sample->decay = parse_timecents(ysw_csv_get_token(csv, 13), sample_rate);
     sample->sustain = parse_centibels(ysw_csv_get_token(csv, 14));
-    sample->release = parse_timecents(ysw_csv_get_token(csv, 15));
+    sample->release = parse_timecents(ysw_csv_get_token(csv, 15), sample_rate);
+    sample->increment_per_hz = get_increment_per_hz(sample, sample_rate);
     sample->from_note = atoi(ysw_csv_get_token(csv, 16));
     sample->to_note = atoi(ysw_csv_get_token(csv, 17));
     sample->from_velocity = atoi(ysw_csv_get_token(csv, 18));
@@ -119,16 +151,16 @@ static ysw_mod_sample_t *parse_sample(ysw_csv_t *csv)
 
     ESP_LOGD(TAG, "%-12s %-12g %-12g %-12g %-12g %-12g",
             sample->name,
-            (float)sample->attack / SAMPLE_RATE,
-            (float)sample->hold / SAMPLE_RATE,
-            (float)sample->decay / SAMPLE_RATE,
+            (float)sample->attack / sample_rate,
+            (float)sample->hold / sample_rate,
+            (float)sample->decay / sample_rate,
             (float)atoi(ysw_csv_get_token(csv, 14)) / 10,
-            (float)sample->release / SAMPLE_RATE);
+            (float)sample->release / sample_rate);
 
     return sample;
 }
 
-static ysw_mod_instrument_t *parse_instrument(ysw_csv_t *csv)
+static ysw_mod_instrument_t *parse_instrument(ysw_csv_t *csv, float sample_rate)
 {
     ysw_mod_instrument_t *instrument = ysw_heap_allocate(sizeof(ysw_mod_instrument_t));
     instrument->samples = ysw_array_create(8);
@@ -141,7 +173,7 @@ static ysw_mod_instrument_t *parse_instrument(ysw_csv_t *csv)
     while (!done && ((token_count = ysw_csv_parse_next_record(csv)))) {
         ysw_mod_record_t type = atoi(ysw_csv_get_token(csv, 0));
         if (type == YSW_MOD_SAMPLE && token_count == 20) {
-            ysw_mod_sample_t *sample = parse_sample(csv);
+            ysw_mod_sample_t *sample = parse_sample(csv, sample_rate);
             ysw_array_push(instrument->samples, sample);
         } else {
             ysw_csv_push_back_record(csv);
@@ -152,7 +184,7 @@ static ysw_mod_instrument_t *parse_instrument(ysw_csv_t *csv)
     return instrument;
 }
 
-static ysw_mod_preset_t *parse_preset(ysw_csv_t *csv)
+static ysw_mod_preset_t *parse_preset(ysw_csv_t *csv, float sample_rate)
 {
     ysw_mod_preset_t *preset = ysw_heap_allocate(sizeof(ysw_mod_preset_t));
     preset->instruments = ysw_array_create(2);
@@ -166,7 +198,7 @@ static ysw_mod_preset_t *parse_preset(ysw_csv_t *csv)
     while (!done && ((token_count = ysw_csv_parse_next_record(csv)))) {
         ysw_mod_record_t type = atoi(ysw_csv_get_token(csv, 0));
         if (type == YSW_MOD_INSTRUMENT && token_count == 2) {
-            ysw_mod_instrument_t *instrument = parse_instrument(csv);
+            ysw_mod_instrument_t *instrument = parse_instrument(csv, sample_rate);
             ysw_array_push(preset->instruments, instrument);
         } else {
             ysw_csv_push_back_record(csv);
@@ -177,7 +209,7 @@ static ysw_mod_preset_t *parse_preset(ysw_csv_t *csv)
     return preset;
 }
 
-ysw_mod_preset_t *parse_file(FILE *file)
+ysw_mod_preset_t *parse_file(FILE *file, float sample_rate)
 {
     ysw_mod_preset_t *preset = NULL;
     ysw_csv_t *csv = ysw_csv_create(file, RECORD_SIZE, TOKENS_SIZE);
@@ -186,7 +218,7 @@ ysw_mod_preset_t *parse_file(FILE *file)
     while ((token_count = ysw_csv_parse_next_record(csv))) {
         ysw_mod_record_t type = atoi(ysw_csv_get_token(csv, 0));
         if (type == YSW_MOD_PRESET && token_count == 4) {
-            preset = parse_preset(csv);
+            preset = parse_preset(csv, sample_rate);
         } else {
             ESP_LOGW(TAG, "invalid record_count=%d, record type=%d, token_count=%d",
                     ysw_csv_get_record_count(csv), type, token_count);
@@ -200,7 +232,7 @@ ysw_mod_preset_t *parse_file(FILE *file)
     return preset;
 }
 
-static void load_preset(ysw_mod_synth_t *mod_synth, ysw_mod_bank_t *bank, uint8_t preset)
+static ysw_mod_preset_t *load_preset(ysw_mod_synth_t *mod_synth, ysw_mod_bank_t *bank, uint8_t preset)
 {
     char buf[PATH_SIZE];
     snprintf(buf, sizeof(buf), "%s/presets/%03d-%03d.csv", mod_synth->folder, bank->num, preset);
@@ -208,13 +240,14 @@ static void load_preset(ysw_mod_synth_t *mod_synth, ysw_mod_bank_t *bank, uint8_
     FILE *file = fopen(buf, "r");
     assert(file);
 
-    ysw_mod_preset_t *p = parse_file(file);
-    bank->presets[preset] = p;
+    ysw_mod_preset_t *p = parse_file(file, mod_synth->sample_rate);
 
     fclose(file);
+
+    return p;
 }
 
-static void *load_sample(ysw_mod_synth_t *mod_synth, const char* name, uint16_t *byte_count)
+static void *load_sample(ysw_mod_synth_t *mod_synth, const char* name, uint32_t *byte_count)
 {
     char path[PATH_SIZE];
     snprintf(path, sizeof(path), "%s/samples/%s", mod_synth->folder, name);
@@ -228,7 +261,8 @@ static void *load_sample(ysw_mod_synth_t *mod_synth, const char* name, uint16_t
 
     int sample_size = sb.st_size;
 
-    void *sample_data = ysw_heap_allocate(sample_size);
+    int8_t *buffer = ysw_heap_allocate(YSW_MOD_GUARD_BEFORE + sample_size + YSW_MOD_GUARD_AFTER);
+    int8_t *sample_data = buffer + YSW_MOD_GUARD_BEFORE;
 
     int fd = open(path, O_RDONLY);
     if (fd == -1) {
@@ -257,16 +291,6 @@ static void *load_sample(ysw_mod_synth_t *mod_synth, const char* name, uint16_t
     return sample_data;
 }
 
-static void enter_critical_section(ysw_mod_synth_t *mod_synth)
-{
-    xSemaphoreTake(mod_synth->mutex, portMAX_DELAY);
-}
-
-static void leave_critical_section(ysw_mod_synth_t *mod_synth)
-{
-    xSemaphoreGive(mod_synth->mutex);
-}
-
 static void initialize_synthesizer(ysw_mod_synth_t *mod_synth)
 {
     assert(mod_synth);
@@ -275,177 +299,261 @@ static void initialize_synthesizer(ysw_mod_synth_t *mod_synth)
     mod_synth->stereo_separation = 1;
     mod_synth->filter = 1;
     mod_synth->mod_loaded = 1;
-    mod_synth->mutex = xSemaphoreCreateMutex();
+    mod_synth->commands = ysw_ring_create(COMMAND_RING_SIZE, sizeof(ysw_mod_command_t));
 }
 
-// from and to must already be scaled up when passed to this function
-static int32_t get_ramp_step(voice_t *voice, uint32_t from, uint32_t to)
+// Envelopes are generated a segment at a time, after Christian Schoenebeck's Fast
+// Exponential Envelope Generator: within a segment, each frame's level is computed from
+// the previous one with a single multiply-add (level = level * coeff + offset), and the
+// coefficients are only recalculated when the envelope moves to its next segment. Attack
+// is linear, while decay and release fall at a constant rate in dB, as in SoundFont 2.
+
+static void enter_segment(voice_t *voice, ysw_mod_state_t state, uint32_t frames, float coeff, float offset)
 {
-    // TODO: use Christian Schoenebeck’s Fast Exponential Envelope Generator
-    int32_t n = to - from;
-    int32_t d = voice->next_change - voice->iterations;
-    int32_t r = d ? n / d : 0;
-    return r;
+    voice->state = state;
+    voice->remaining = frames;
+    voice->coeff = coeff;
+    voice->offset = offset;
 }
 
-static void calculate_amplitude_envelope(ysw_mod_synth_t *mod_synth, voice_t *voice)
+// Frames for a dB-linear segment to fall from level to target, given that it would take
+// full_frames to fall from full scale to silence
+
+static inline uint32_t get_fall_frames(uint32_t full_frames, float level, float target)
 {
+    return full_frames * (log10f(level / target) / -log10f(ENVELOPE_SILENCE));
+}
+
+static inline float get_fall_coeff(uint32_t full_frames)
+{
+    return full_frames ? powf(ENVELOPE_SILENCE, 1.0f / full_frames) : 0;
+}
+
+static void enter_release(voice_t *voice)
+{
+    if (voice->level <= ENVELOPE_SILENCE) {
+        voice->state = YSW_MOD_IDLE;
+        return;
+    }
+    uint32_t release = voice->sample->release;
+    uint32_t frames = get_fall_frames(release, voice->level, ENVELOPE_SILENCE);
+    enter_segment(voice, YSW_MOD_RELEASE, frames, get_fall_coeff(release), 0);
+}
+
+// Called at the end of each segment to set up the next one
+
+static void advance_envelope(voice_t *voice)
+{
+    ysw_mod_sample_t *sample = voice->sample;
     switch (voice->state) {
         case YSW_MOD_NOTE_ON:
-            voice->iterations = 0;
-            voice->amplitude = 0;
-            voice->ramp_step = 0;
-            voice->next_change = voice->iterations + voice->sample->delay;
-            voice->state = YSW_MOD_DELAY;
-            // fall through
+            voice->level = 0;
+            enter_segment(voice, YSW_MOD_DELAY, sample->delay, 1, 0);
+            break;
         case YSW_MOD_DELAY:
-            if (voice->iterations >= voice->next_change) {
-                voice->state = YSW_MOD_ATTACK;
-                voice->next_change = voice->iterations + voice->sample->attack;
-                voice->ramp_step = get_ramp_step(voice, 0, AMP_MAX_SCALED);
-                // ESP_LOGD(TAG, "attack samples=%d (%gs), from=%d, to=%d, step=%d", voice->next_change - voice->iterations, (float)(voice->next_change - voice->iterations)/SAMPLE_RATE, 0, AMP_MAX_SCALED, voice->ramp_step);
-            }
-            voice->amplitude += voice->ramp_step;
+            voice->level = 0;
+            enter_segment(voice, YSW_MOD_ATTACK, sample->attack, 1, sample->attack ? 1.0f / sample->attack : 0);
             break;
         case YSW_MOD_ATTACK:
-            if (voice->iterations >= voice->next_change) {
-                voice->state = YSW_MOD_HOLD;
-                voice->next_change = voice->iterations + voice->sample->hold;
-                voice->ramp_step = 0;
-                // ESP_LOGD(TAG, "hold samples=%d (%gs), from=%d, to=%d, step=%d", voice->next_change - voice->iterations, (float)(voice->next_change - voice->iterations)/SAMPLE_RATE, voice->amplitude, voice->amplitude, voice->ramp_step);
-            }
-            voice->amplitude += voice->ramp_step;
+            voice->level = 1;
+            enter_segment(voice, YSW_MOD_HOLD, sample->hold, 1, 0);
             break;
         case YSW_MOD_HOLD:
-            if (voice->iterations >= voice->next_change) {
-                voice->state = YSW_MOD_DECAY;
-                //voice->next_change = voice->iterations + voice->sample->decay;
-                voice->next_change = voice->iterations + (3 * SAMPLE_RATE);
-                voice->ramp_step = get_ramp_step(voice, AMP_MAX_SCALED, voice->sample->sustain);
-                ESP_LOGD(TAG, "decay samples=%d (%gs), from=%d, to=%d, step=%d", voice->next_change - voice->iterations, (float)(voice->next_change - voice->iterations)/SAMPLE_RATE, AMP_MAX_SCALED, voice->sample->sustain, voice->ramp_step);
+            voice->level = 1;
+            if (sample->sustain < 1) {
+                uint32_t frames = get_fall_frames(sample->decay, 1, fmaxf(sample->sustain, ENVELOPE_SILENCE));
+                enter_segment(voice, YSW_MOD_DECAY, frames, get_fall_coeff(sample->decay), 0);
+                ESP_LOGD(TAG, "decay samples=%d, to=%g", frames, sample->sustain);
+            } else {
+                enter_segment(voice, YSW_MOD_DECAY, 0, 1, 0);
             }
-            voice->amplitude += voice->ramp_step;
             break;
         case YSW_MOD_DECAY:
-            if (voice->iterations >= voice->next_change) {
-                voice->state = YSW_MOD_SUSTAIN;
-                voice->ramp_step = 0;
-                ESP_LOGD(TAG, "sustain amplitude=%d, sustain=%d, delta=%d", voice->amplitude, voice->sample->sustain, voice->amplitude - voice->sample->sustain);
-            }
-            voice->amplitude += voice->ramp_step;
-            break;
-        case YSW_MOD_SUSTAIN:
-            if ((voice->amplitude >> AMP_SCALE_FACTOR) <= 0) {
+            voice->level = sample->sustain;
+            if (voice->level <= ENVELOPE_SILENCE) {
                 voice->state = YSW_MOD_IDLE;
                 ESP_LOGD(TAG, "sustain->idle");
+            } else {
+                enter_segment(voice, YSW_MOD_SUSTAIN, UINT32_MAX, 1, 0);
             }
             break;
+        case YSW_MOD_SUSTAIN:
+            voice->remaining = UINT32_MAX;
+            break;
         case YSW_MOD_NOTE_OFF:
             // TODO: consider impact of loop_type
-            voice->state = YSW_MOD_RELEASE;
-            voice->next_change = voice->iterations + voice->sample->release;
-            voice->ramp_step = get_ramp_step(voice, voice->amplitude, 0);
-            // ESP_LOGD(TAG, "note_off samples=%d (%g), from=%d, to=%d, step=%d", voice->next_change - voice->iterations, (float)(voice->next_change - voice->iterations)/SAMPLE_RATE, voice->amplitude, 0, voice->ramp_step);
-            voice->amplitude += voice->ramp_step;
+            enter_release(voice);
             break;
         case YSW_MOD_RELEASE:
-            if (voice->iterations >= voice->next_change || (voice->amplitude >> AMP_SCALE_FACTOR) <= 0) {
-                voice->state = YSW_MOD_IDLE;
-                voice->ramp_step = 0;
-                voice->amplitude = 0;
-                // ESP_LOGD(TAG, "release->idle");
-            }
-            voice->amplitude += voice->ramp_step;
+            voice->level = 0;
+            voice->state = YSW_MOD_IDLE;
             break;
         case YSW_MOD_IDLE:
-            // ESP_LOGD(TAG, "idle");
             break;
     }
-    voice->iterations++;
 }
 
-/**
- * Generate two-channel 16-bit signed audio samples. There are four bytes per sample (LLRR).
- * @param caller_context pointer to context returned by ysw_mod_synth_create_task
- * @param buffer to be filled with signed 16 bit audio samples for left and right channels
- * @param number of four byte samples to generate (i.e. sizeof(outbuffer) / 4)
- */
+// Read the sample at a scaled position using the given kernel. Kernels read up to
+// YSW_MOD_GUARD_BEFORE points before and YSW_MOD_GUARD_AFTER points after the position
+// without checking bounds.
 
-void ysw_mod_generate_samples(ysw_mod_synth_t *mod_synth,
-        int16_t *buffer, uint32_t number, ysw_mod_sample_type_t sample_type)
+static inline int32_t read_sample(const int8_t *data, uint32_t samppos, ysw_mod_interpolation_t interpolation)
 {
-    assert(mod_synth);
-    assert(buffer);
-
-    enter_critical_section(mod_synth);
-
-    if (!mod_synth->mod_loaded) {
-        for (uint32_t i = 0; i < number; i++)
-        {
-            *buffer++ = 0;
-            *buffer++ = 0;
+    const int8_t *p = data + (samppos >> POS_SCALE_FACTOR);
+    const int32_t fraction = samppos & POS_FRACTION_MASK;
+    switch (interpolation) {
+        case YSW_MOD_INTERPOLATE_LINEAR:
+            return (p[0] << KERNEL_SCALE_FACTOR) +
+                (((p[1] - p[0]) * fraction) >> (POS_SCALE_FACTOR - KERNEL_SCALE_FACTOR));
+        case YSW_MOD_INTERPOLATE_CUBIC: {
+            // Catmull-Rom spline through p[-1] .. p[2]
+            const float t = fraction * (1.0f / (1 << POS_SCALE_FACTOR));
+            const float a = p[-1], b = p[0], c = p[1], d = p[2];
+            const float value = b + 0.5f * t * (c - a + t * (2 * a - 5 * b + 4 * c - d + t * (3 * (b - c) + d - a)));
+            return value * (1 << KERNEL_SCALE_FACTOR);
         }
-        return;
+        case YSW_MOD_INTERPOLATE_NONE:
+        default:
+            return p[0] << KERNEL_SCALE_FACTOR;
     }
+}
 
-    int32_t last_left = mod_synth->last_left_sample;
-    int32_t last_right = mod_synth->last_right_sample;;
+// Render a run of frames that is known to stay within the sample (or loop) and within one
+// envelope segment. The kernel is a constant in each caller, so the switch in read_sample
+// is resolved outside of the loop.
 
-    for (uint32_t i = 0; i < number; i++) {
+static inline uint32_t render_run(ysw_mod_synth_t *mod_synth, voice_t *voice, const int8_t *data,
+        uint32_t i, uint32_t run_end, uint32_t samppos, ysw_mod_interpolation_t interpolation)
+{
+    const uint32_t sampinc = voice->sampinc;
+    const int32_t left_volume = voice->left_volume;
+    const int32_t right_volume = voice->right_volume;
+    const float coeff = voice->coeff;
+    const float offset = voice->offset;
+
+    int32_t *left_mix = mod_synth->left_mix;
+    int32_t *right_mix = mod_synth->right_mix;
+    float level = voice->level;
+
+    for (; i < run_end; i++) {
+        int32_t sample = read_sample(data, samppos, interpolation);
+        int32_t value = (sample * (int32_t)(level * ENVELOPE_GAIN_SCALE)) >> KERNEL_SCALE_FACTOR;
+        left_mix[i] += (value * left_volume) >> GAIN_SCALE_FACTOR;
+        right_mix[i] += (value * right_volume) >> GAIN_SCALE_FACTOR;
+        level = level * coeff + offset;
+        samppos += sampinc;
+    }
 
-        int32_t left = 0;
-        int32_t right = 0;
+    voice->level = level;
+    return samppos;
+}
 
-        voice_t *voice = mod_synth->voices;
+// Render a run from data using the configured kernel
 
-        for (uint16_t j = 0; j < mod_synth->voice_count; j++, voice++) {
-            if (voice->state != YSW_MOD_IDLE) {
+static inline uint32_t render_kernel(ysw_mod_synth_t *mod_synth, voice_t *voice, const int8_t *data,
+        uint32_t i, uint32_t run_end, uint32_t samppos)
+{
+    switch (mod_synth->interpolation) {
+        case YSW_MOD_INTERPOLATE_LINEAR:
+            return render_run(mod_synth, voice, data, i, run_end, samppos, YSW_MOD_INTERPOLATE_LINEAR);
+        case YSW_MOD_INTERPOLATE_CUBIC:
+            return render_run(mod_synth, voice, data, i, run_end, samppos, YSW_MOD_INTERPOLATE_CUBIC);
+        case YSW_MOD_INTERPOLATE_NONE:
+        default:
+            return render_run(mod_synth, voice, data, i, run_end, samppos, YSW_MOD_INTERPOLATE_NONE);
+    }
+}
 
-                voice->samppos += voice->sampinc;
-                uint32_t index = voice->samppos >> POS_SCALE_FACTOR;
+// Render one voice for a block of frames, adding its output to the mix buffers. The block
+// is split into runs at envelope segment boundaries and at the end of the sample (or loop),
+// so the per-frame loop has no bounds checks. Near the end of a loop, where the kernel
+// would read past loop_end, frames are read from a window that wraps to loop_start.
 
-                if (voice->loop_type == YSW_MOD_LOOP_CONTINUOUS || voice->loop_type == YSW_MOD_LOOP_THROUGH) {
-                    if (index >= voice->loop_end) {
-                        index = voice->loop_start;
-                        voice->samppos = index << POS_SCALE_FACTOR;
-                        voice->samppos -= voice->sampinc; // samppos is incremented before next use
-                    }
-                } else {
-                    if (index >= voice->length) {
-                        voice->state = YSW_MOD_IDLE;
-                    }
-                }
+static void render_voice(ysw_mod_synth_t *mod_synth, voice_t *voice, uint32_t frames)
+{
+    const int8_t *data = voice->sample->data;
+    const uint32_t sampinc = voice->sampinc;
+    const bool is_looped = voice->loop_type == YSW_MOD_LOOP_CONTINUOUS || voice->loop_type == YSW_MOD_LOOP_THROUGH;
+    const uint32_t loop_start = voice->loop_start << POS_SCALE_FACTOR;
+    const uint32_t end = (is_looped ? voice->loop_end : voice->length) << POS_SCALE_FACTOR;
+    const uint32_t loop_length = end - loop_start;
+    const uint32_t wrap_start = is_looped ?
+        (ysw_uint32_max(voice->loop_end, YSW_MOD_GUARD_AFTER) - YSW_MOD_GUARD_AFTER) << POS_SCALE_FACTOR : end;
+
+    uint32_t samppos = voice->samppos; // position of the next frame
+
+    // Note on and note off are applied at block boundaries
+    if (voice->state == YSW_MOD_NOTE_ON || voice->state == YSW_MOD_NOTE_OFF) {
+        advance_envelope(voice);
+    }
 
-                int32_t voice_left = 0;
-                int32_t voice_right = 0;
-
-                switch (voice->sample->pan) {
-                    case YSW_MOD_PAN_LEFT:
-                        voice_left = (voice->sample->data[index] * voice->volume);
-                        break;
-                    case YSW_MOD_PAN_RIGHT:
-                        voice_right = (voice->sample->data[index] * voice->volume);
-                        break;
-                    case YSW_MOD_PAN_CENTER:
-                    default:
-                        voice_left = (voice->sample->data[index] * voice->volume);
-                        voice_right = (voice->sample->data[index] * voice->volume);
-                        break;
-                }
+    uint32_t i = 0;
+    while (i < frames && voice->state != YSW_MOD_IDLE) {
 
-                calculate_amplitude_envelope(mod_synth, voice);
+        if (!voice->remaining) {
+            advance_envelope(voice);
+            continue;
+        }
 
-                voice_left = apply_amplitude_envelope(voice->amplitude, voice_left);
-                voice_right = apply_amplitude_envelope(voice->amplitude, voice_right);
+        if (samppos >= end) {
+            if (!is_looped) {
+                voice->state = YSW_MOD_IDLE;
+                break;
+            }
+            // Wrap by the loop length, keeping the fractional phase
+            samppos = loop_start + (samppos - end) % loop_length;
+        }
 
-                left += voice_left;
-                right += voice_right;
+        uint32_t run = ysw_uint32_min(frames - i, voice->remaining);
 
+        if (samppos < wrap_start) {
+            if (sampinc) {
+                run = ysw_uint32_min(run, (wrap_start - samppos + sampinc - 1) / sampinc);
+            }
+            samppos = render_kernel(mod_synth, voice, data, i, i + run, samppos);
+        } else {
+            // Copy the points around this position, wrapping those past loop_end, and
+            // render the frames that stay on this position
+            int8_t window[YSW_MOD_GUARD_BEFORE + 1 + YSW_MOD_GUARD_AFTER];
+            const int32_t position = samppos >> POS_SCALE_FACTOR;
+            for (int32_t k = 0; k < (int32_t)sizeof(window); k++) {
+                int32_t index = position - YSW_MOD_GUARD_BEFORE + k;
+                if (index >= (int32_t)voice->loop_end) {
+                    index = voice->loop_start + (index - voice->loop_start) % (voice->loop_end - voice->loop_start);
+                }
+                window[k] = data[index];
+            }
+            const uint32_t fraction = samppos & POS_FRACTION_MASK;
+            if (sampinc) {
+                run = ysw_uint32_min(run, ((1 << POS_SCALE_FACTOR) - fraction + sampinc - 1) / sampinc);
             }
+            const uint32_t window_pos = (YSW_MOD_GUARD_BEFORE << POS_SCALE_FACTOR) + fraction;
+            samppos += render_kernel(mod_synth, voice, window, i, i + run, window_pos) - window_pos;
         }
 
-        left = apply_percent_gain(mod_synth->percent_gain, left);
-        right = apply_percent_gain(mod_synth->percent_gain, right);
+        i += run;
+        voice->remaining -= run;
+    }
+
+    voice->samppos = samppos;
+}
+
+// Apply gain, filter, stereo separation and clamping to the mix buffers and write the result
+// as interleaved 16-bit samples.
+
+static void output_block(ysw_mod_synth_t *mod_synth, int16_t *buffer, uint32_t frames,
+        ysw_mod_sample_type_t sample_type)
+{
+    const int32_t gain = to_mix_gain(mod_synth->percent_gain);
+    const int32_t offset = sample_type == YSW_MOD_16BIT_UNSIGNED ? 32768 : 0;
+
+    int32_t last_left = mod_synth->last_left_sample;
+    int32_t last_right = mod_synth->last_right_sample;
+
+    for (uint32_t i = 0; i < frames; i++) {
+
+        int32_t left = (mod_synth->left_mix[i] * gain) >> MIX_SCALE_FACTOR;
+        int32_t right = (mod_synth->right_mix[i] * gain) >> MIX_SCALE_FACTOR;
 
         int32_t temp_left = (short)left;
         int32_t temp_right = (short)right;
@@ -472,65 +580,377 @@ void ysw_mod_generate_samples(ysw_mod_synth_t *mod_synth,
             right = -32768;
         }
 
-        if (sample_type == YSW_MOD_16BIT_UNSIGNED) {
-            left += 32768;
-            right += 32768;
-        }
-
-        *buffer++ = left;
-        *buffer++ = right;
+        *buffer++ = left + offset;
+        *buffer++ = right + offset;
 
         last_left = temp_left;
         last_right = temp_right;
-
     }
 
     mod_synth->last_left_sample = last_left;
     mod_synth->last_right_sample = last_right;
+}
+
+// The active voices form a binary heap ordered by how willing we are to steal a voice.
+// Released voices come before held voices, then lower priority before higher priority,
+// then older before newer.
+
+static inline bool is_steal_before(voice_t *left, voice_t *right)
+{
+    if (left->is_held != right->is_held) {
+        return !left->is_held;
+    }
+    if (left->priority != right->priority) {
+        return left->priority < right->priority;
+    }
+    return (int32_t)(left->time - right->time) < 0;
+}
+
+static inline void set_active(ysw_mod_synth_t *mod_synth, uint16_t index, voice_t *voice)
+{
+    mod_synth->active_voices[index] = voice;
+    voice->active_index = index;
+}
+
+static void sift_up(ysw_mod_synth_t *mod_synth, uint16_t index)
+{
+    voice_t *voice = mod_synth->active_voices[index];
+    while (index) {
+        uint16_t parent = (index - 1) / 2;
+        if (!is_steal_before(voice, mod_synth->active_voices[parent])) {
+            break;
+        }
+        set_active(mod_synth, index, mod_synth->active_voices[parent]);
+        index = parent;
+    }
+    set_active(mod_synth, index, voice);
+}
+
+static void sift_down(ysw_mod_synth_t *mod_synth, uint16_t index)
+{
+    voice_t *voice = mod_synth->active_voices[index];
+    uint16_t count = mod_synth->active_count;
+    for (;;) {
+        uint16_t child = index * 2 + 1;
+        if (child >= count) {
+            break;
+        }
+        if (child + 1 < count && is_steal_before(mod_synth->active_voices[child + 1], mod_synth->active_voices[child])) {
+            child++;
+        }
+        if (!is_steal_before(mod_synth->active_voices[child], voice)) {
+            break;
+        }
+        set_active(mod_synth, index, mod_synth->active_voices[child]);
+        index = child;
+    }
+    set_active(mod_synth, index, voice);
+}
 
-    leave_critical_section(mod_synth);
+static void add_active(ysw_mod_synth_t *mod_synth, voice_t *voice)
+{
+    uint16_t index = mod_synth->active_count++;
+    set_active(mod_synth, index, voice);
+    sift_up(mod_synth, index);
+}
+
+static void remove_active(ysw_mod_synth_t *mod_synth, voice_t *voice)
+{
+    uint16_t index = voice->active_index;
+    voice_t *last = mod_synth->active_voices[--mod_synth->active_count];
+    if (last != voice) {
+        set_active(mod_synth, index, last);
+        sift_up(mod_synth, index);
+        sift_down(mod_synth, last->active_index);
+    }
 }
 
-static uint8_t allocate_voice(ysw_mod_synth_t *mod_synth, uint8_t channel, uint8_t midi_note)
+static inline voice_t **get_held_voices(ysw_mod_synth_t *mod_synth, uint8_t channel, uint8_t midi_note)
 {
-    voice_t *voice = NULL;
-    uint8_t voice_index = 0;
-    // See if there are any free voices to allocate
-    if (mod_synth->voice_count < MAX_VOICES) {
-        // If so allocate the first one from the free zone
-        voice_index = mod_synth->voice_count++;
-        voice = &mod_synth->voices[voice_index];
+    return &mod_synth->held_voices[channel * YSW_MIDI_MAX_COUNT + midi_note];
+}
+
+static void hold_voice(ysw_mod_synth_t *mod_synth, voice_t *voice)
+{
+    voice_t **head = get_held_voices(mod_synth, voice->channel, voice->midi_note);
+    voice->prev_held = NULL;
+    voice->next_held = *head;
+    if (*head) {
+        (*head)->prev_held = voice;
+    }
+    *head = voice;
+    voice->is_held = true;
+}
+
+static void unhold_voice(ysw_mod_synth_t *mod_synth, voice_t *voice)
+{
+    if (voice->prev_held) {
+        voice->prev_held->next_held = voice->next_held;
     } else {
-        // Otherwise no free voices to allocate, so iterate through all active voices
-        uint32_t time = UINT_MAX;
-        for (uint8_t i = 0; i < mod_synth->voice_count; i++) {
-            // See if voice has reached end of sample or 100% attenuation
-            if (mod_synth->voices[i].state == YSW_MOD_IDLE) {
-                // Yes, see if it is last one in active zone and will be first one in free zone
-                if (--mod_synth->voice_count != voice_index) {
-                    // It wasn't last one so replace it with the one that was previously at the end
-                    mod_synth->voices[i] = mod_synth->voices[mod_synth->voice_count];
-                    // And process the newly relocated voice on next iteration
-                    i--;
-                }
-            } else if (mod_synth->voices[i].time < time) {
-                // Otherwise voice is still playing, keep track of oldest voice in case we need to steal it
-                time = mod_synth->voices[i].time;
-                voice_index = i;
+        *get_held_voices(mod_synth, voice->channel, voice->midi_note) = voice->next_held;
+    }
+    if (voice->next_held) {
+        voice->next_held->prev_held = voice->prev_held;
+    }
+    voice->next_held = NULL;
+    voice->prev_held = NULL;
+    voice->is_held = false;
+}
+
+static void free_voice(ysw_mod_synth_t *mod_synth, voice_t *voice)
+{
+    if (voice->is_held) {
+        unhold_voice(mod_synth, voice);
+    }
+    remove_active(mod_synth, voice);
+    voice->state = YSW_MOD_IDLE;
+    mod_synth->free_voices[mod_synth->free_count++] = voice;
+}
+
+static voice_t *allocate_voice(ysw_mod_synth_t *mod_synth)
+{
+    if (!mod_synth->free_count) {
+        // ESP_LOGD(TAG, "allocate_voice stealing channel=%d, midi_note=%d", mod_synth->active_voices[0]->channel, mod_synth->active_voices[0]->midi_note);
+        free_voice(mod_synth, mod_synth->active_voices[0]);
+    }
+    return mod_synth->free_voices[--mod_synth->free_count];
+}
+
+static void start_voice(ysw_mod_synth_t *mod_synth, const ysw_mod_command_t *command)
+{
+    ysw_mod_sample_t *sample = command->sample;
+    voice_t *voice = allocate_voice(mod_synth);
+    voice->sample = sample;
+    voice->channel = command->channel;
+    voice->midi_note = command->midi_note;
+    voice->priority = mod_synth->channel_priorities[command->channel];
+    voice->length = sample->length;
+    voice->loop_start = sample->loop_start;
+    voice->loop_end = sample->loop_end;
+    voice->loop_type = sample->loop_type;
+    voice->volume = command->velocity / 2; // mod volume range is 0-63
+    voice->left_volume = sample->pan == YSW_MOD_PAN_RIGHT ? 0 : voice->volume;
+    voice->right_volume = sample->pan == YSW_MOD_PAN_LEFT ? 0 : voice->volume;
+    voice->sampinc = calculate_sample_increment(sample, command->midi_note);
+    voice->samppos = 0;
+    voice->level = 0;
+    voice->remaining = 0;
+    voice->time = mod_synth->voice_time++;
+    voice->state = YSW_MOD_NOTE_ON;
+    hold_voice(mod_synth, voice);
+    add_active(mod_synth, voice);
+}
+
+static void stop_voices(ysw_mod_synth_t *mod_synth, uint8_t channel, uint8_t midi_note)
+{
+    voice_t *voice = *get_held_voices(mod_synth, channel, midi_note);
+    while (voice) {
+        voice_t *next = voice->next_held;
+        // Note will progress through release and be freed when it goes idle
+        unhold_voice(mod_synth, voice);
+        voice->state = YSW_MOD_NOTE_OFF;
+        // Released voices are stolen first, so move it toward the root of the heap
+        sift_up(mod_synth, voice->active_index);
+        voice = next;
+    }
+}
+
+// Called only from the audio callback, which owns the voices
+
+static inline bool is_due(ysw_mod_synth_t *mod_synth, const ysw_mod_command_t *command)
+{
+    return !command->frame || (int32_t)(command->frame - mod_synth->frame_clock) <= 0;
+}
+
+static inline bool is_before(const ysw_mod_timed_t *left, const ysw_mod_timed_t *right)
+{
+    int32_t delta = left->command.frame - right->command.frame;
+    return delta < 0 || (!delta && (int32_t)(left->sequence - right->sequence) < 0);
+}
+
+static void push_timed(ysw_mod_synth_t *mod_synth, const ysw_mod_command_t *command)
+{
+    ysw_mod_timed_t timed = {
+        .command = *command,
+        .sequence = mod_synth->timed_sequence++,
+    };
+    uint16_t index = mod_synth->timed_count++;
+    while (index) {
+        uint16_t parent = (index - 1) / 2;
+        if (!is_before(&timed, &mod_synth->timed[parent])) {
+            break;
+        }
+        mod_synth->timed[index] = mod_synth->timed[parent];
+        index = parent;
+    }
+    mod_synth->timed[index] = timed;
+}
+
+static void pop_timed(ysw_mod_synth_t *mod_synth)
+{
+    uint16_t count = --mod_synth->timed_count;
+    ysw_mod_timed_t timed = mod_synth->timed[count];
+    uint16_t index = 0;
+    uint16_t child;
+    while ((child = (2 * index) + 1) < count) {
+        if (child + 1 < count && is_before(&mod_synth->timed[child + 1], &mod_synth->timed[child])) {
+            child++;
+        }
+        if (!is_before(&mod_synth->timed[child], &timed)) {
+            break;
+        }
+        mod_synth->timed[index] = mod_synth->timed[child];
+        index = child;
+    }
+    mod_synth->timed[index] = timed;
+}
+
+static void apply_command(ysw_mod_synth_t *mod_synth, const ysw_mod_command_t *command)
+{
+    switch (command->type) {
+        case YSW_MOD_COMMAND_NOTE_ON:
+            start_voice(mod_synth, command);
+            break;
+        case YSW_MOD_COMMAND_NOTE_OFF:
+            stop_voices(mod_synth, command->channel, command->midi_note);
+            break;
+        case YSW_MOD_COMMAND_GAIN:
+            mod_synth->percent_gain = command->percent_gain;
+            break;
+    }
+}
+
+// Apply the commands that are due at the start of the next block and return the number of
+// frames to render before the next timed command is due, so that the block ends exactly
+// where it takes effect. Untimed commands, and commands that arrive late, are applied right
+// away. Commands for later frames are held in order of frame rather than left in the ring,
+// so they don't hold up the commands behind them, which may be untimed or, with several
+// tracks playing, due sooner. If YSW_MOD_MAX_TIMED commands are already held, the earliest
+// of them and the new command is applied early, so the ring is always drained.
+
+static uint32_t process_commands(ysw_mod_synth_t *mod_synth, uint32_t frames)
+{
+    while (mod_synth->timed_count && is_due(mod_synth, &mod_synth->timed[0].command)) {
+        apply_command(mod_synth, &mod_synth->timed[0].command);
+        pop_timed(mod_synth);
+    }
+    const ysw_mod_command_t *command;
+    while ((command = ysw_ring_peek(mod_synth->commands))) {
+        if (is_due(mod_synth, command)) {
+            apply_command(mod_synth, command);
+        } else if (mod_synth->timed_count < YSW_MOD_MAX_TIMED) {
+            push_timed(mod_synth, command);
+        } else {
+            ysw_mod_timed_t timed = {
+                .command = *command,
+                .sequence = mod_synth->timed_sequence,
+            };
+            if (is_before(&timed, &mod_synth->timed[0])) {
+                apply_command(mod_synth, command);
+            } else {
+                apply_command(mod_synth, &mod_synth->timed[0].command);
+                pop_timed(mod_synth);
+                push_timed(mod_synth, command);
             }
         }
-        // See if we freed one or more voices
-        if (mod_synth->voice_count < MAX_VOICES) {
-            // Yes, allocate first one from free zone
-            voice_index = mod_synth->voice_count++;
+        ysw_ring_skip(mod_synth->commands);
+    }
+    if (mod_synth->timed_count) {
+        frames = ysw_uint32_min(frames, mod_synth->timed[0].command.frame - mod_synth->frame_clock);
+    }
+    return frames;
+}
+
+static inline void advance_frame_clock(ysw_mod_synth_t *mod_synth, uint32_t frames)
+{
+    __atomic_store_n(&mod_synth->frame_clock, mod_synth->frame_clock + frames, __ATOMIC_RELEASE);
+}
+
+// Write a block of silence without running the output stage. Only valid when no voices are
+// active and the filter has settled, so the output stage would produce silence anyway.
+
+static void output_silence(int16_t *buffer, uint32_t frames, ysw_mod_sample_type_t sample_type)
+{
+    if (sample_type == YSW_MOD_16BIT_SIGNED) {
+        memset(buffer, 0, frames * 2 * sizeof(int16_t));
+    } else {
+        for (uint32_t i = 0; i < frames * 2; i++) {
+            buffer[i] = 32768;
         }
-        // At this point, voice_index is either first one in free zone or oldest voice encountered
-        voice = &mod_synth->voices[voice_index];
     }
-    voice->channel = channel;
-    voice->midi_note = midi_note;
-    // ESP_LOGD(TAG, "alloc: index=%d, count=%d, max=%d, time=%d, state=%d", voice_index, mod_synth->voice_count, MAX_VOICES, voice->time, voice->state);
-    return voice_index;
+}
+
+static inline bool is_silent(ysw_mod_synth_t *mod_synth)
+{
+    return !mod_synth->active_count && !mod_synth->last_left_sample && !mod_synth->last_right_sample;
+}
+
+/**
+ * Generate two-channel 16-bit signed audio samples. There are four bytes per sample (LLRR).
+ * Samples are rendered in blocks of up to YSW_MOD_BLOCK_SIZE frames, one voice at a time.
+ * Commands from the event task are applied at block boundaries, so no lock is taken here.
+ * Blocks are split so that commands stamped with a frame take effect at exactly that frame.
+ * @param caller_context pointer to context returned by ysw_mod_synth_create_task
+ * @param buffer to be filled with signed 16 bit audio samples for left and right channels
+ * @param number of four byte samples to generate (i.e. sizeof(outbuffer) / 4)
+ * @return true if every frame generated was silent, so that the output stage can skip
+ * its own processing or pause when idle
+ */
+
+bool ysw_mod_generate_samples(ysw_mod_synth_t *mod_synth,
+        int16_t *buffer, uint32_t number, ysw_mod_sample_type_t sample_type)
+{
+    assert(mod_synth);
+    assert(buffer);
+
+    if (!mod_synth->mod_loaded) {
+        process_commands(mod_synth, number);
+        output_silence(buffer, number, sample_type);
+        advance_frame_clock(mod_synth, number);
+        return true;
+    }
+
+    bool is_all_silent = true;
+
+    while (number) {
+        uint32_t frames = ysw_uint32_min(number, YSW_MOD_BLOCK_SIZE);
+
+        frames = process_commands(mod_synth, frames);
+
+        if (is_silent(mod_synth)) {
+            output_silence(buffer, frames, sample_type);
+            advance_frame_clock(mod_synth, frames);
+            buffer += frames * 2;
+            number -= frames;
+            continue;
+        }
+
+        is_all_silent = false;
+
+        memset(mod_synth->left_mix, 0, frames * sizeof(int32_t));
+        memset(mod_synth->right_mix, 0, frames * sizeof(int32_t));
+
+        uint16_t retired_count = 0;
+        for (uint16_t j = 0; j < mod_synth->active_count; j++) {
+            voice_t *voice = mod_synth->active_voices[j];
+            render_voice(mod_synth, voice, frames);
+            if (voice->state == YSW_MOD_IDLE) {
+                mod_synth->retired_voices[retired_count++] = voice;
+            }
+        }
+
+        for (uint16_t j = 0; j < retired_count; j++) {
+            free_voice(mod_synth, mod_synth->retired_voices[j]);
+        }
+
+        output_block(mod_synth, buffer, frames, sample_type);
+        advance_frame_clock(mod_synth, frames);
+
+        buffer += frames * 2;
+        number -= frames;
+    }
+
+    return is_all_silent;
 }
 
 static ysw_mod_bank_t *find_bank(ysw_mod_synth_t *mod_synth, uint8_t num)
@@ -543,30 +963,90 @@ static ysw_mod_bank_t *find_bank(ysw_mod_synth_t *mod_synth, uint8_t num)
     return NULL;
 }
 
-static ysw_mod_preset_t *realize_preset(ysw_mod_synth_t *mod_synth, uint8_t bank, uint8_t preset)
+static inline ysw_mod_sample_t *find_sample(ysw_mod_instrument_t *instrument, uint8_t midi_note, uint8_t velocity)
 {
-    ysw_mod_bank_t *b = find_bank(mod_synth, bank);
-    assert(b);
+    uint8_t bucket = instrument->velocity_buckets[velocity];
+    uint8_t entry = instrument->zone_map[midi_note * instrument->bucket_count + bucket];
+    return entry ? ysw_array_get_fast(instrument->samples, entry - 1) : NULL;
+}
 
-    if (!b->presets[preset]) {
-        load_preset(mod_synth, b, preset);
+// Returns index + 1 of the first sample that matches, or 0 if none match
+
+static uint8_t match_sample(ysw_mod_instrument_t *instrument, uint8_t midi_note, uint8_t velocity)
+{
+    uint8_t sample_count = ysw_array_get_count(instrument->samples);
+    for (uint8_t i = 0; i < sample_count; i++) {
+        ysw_mod_sample_t *sample = ysw_array_get(instrument->samples, i);
+        if (sample->from_note <= midi_note && midi_note <= sample->to_note &&
+                sample->from_velocity <= velocity && velocity <= sample->to_velocity) {
+            return i + 1;
+        }
     }
+    return 0;
+}
+
+// Loops are played without bounds checks, so make sure they lie within the sample. Points
+// read past loop_end are wrapped to loop_start by render_voice, so sample data (which may be
+// shared by several zones) is never modified.
 
-    return b->presets[preset];
+static void check_loops(ysw_mod_instrument_t *instrument)
+{
+    uint8_t sample_count = ysw_array_get_count(instrument->samples);
+    for (uint8_t i = 0; i < sample_count; i++) {
+        ysw_mod_sample_t *sample = ysw_array_get(instrument->samples, i);
+        if (sample->loop_type != YSW_MOD_LOOP_CONTINUOUS && sample->loop_type != YSW_MOD_LOOP_THROUGH) {
+            continue;
+        }
+        sample->loop_end = ysw_uint32_min(sample->loop_end, sample->length);
+        if (sample->loop_start >= sample->loop_end) {
+            ESP_LOGW(LOADER_TAG, "empty loop, name=%s, loop_start=%d, loop_end=%d",
+                    sample->name ? sample->name : "", sample->loop_start, sample->loop_end);
+            sample->loop_type = YSW_MOD_LOOP_NONE;
+        }
+    }
 }
 
-static ysw_mod_sample_t *find_sample(ysw_mod_instrument_t *instrument, uint8_t midi_note)
+// Build the instrument's note/velocity -> zone map. The first matching zone wins, as it
+// did when zones were searched on each note on.
+
+static void index_instrument(ysw_mod_instrument_t *instrument)
 {
     uint8_t sample_count = ysw_array_get_count(instrument->samples);
+    assert(sample_count < UINT8_MAX);
+
+    bool is_bucket_start[YSW_MIDI_MAX_COUNT] = { [0] = true };
     for (uint8_t i = 0; i < sample_count; i++) {
         ysw_mod_sample_t *sample = ysw_array_get(instrument->samples, i);
-        if (sample->from_note <= midi_note && midi_note <= sample->to_note) {
-            return sample;
+        if (sample->from_velocity < YSW_MIDI_MAX_COUNT) {
+            is_bucket_start[sample->from_velocity] = true;
+        }
+        if (sample->to_velocity + 1 < YSW_MIDI_MAX_COUNT) {
+            is_bucket_start[sample->to_velocity + 1] = true;
+        }
+    }
+
+    uint8_t bucket_velocities[YSW_MIDI_MAX_COUNT];
+    uint8_t bucket_count = 0;
+    for (uint8_t velocity = 0; velocity < YSW_MIDI_MAX_COUNT; velocity++) {
+        if (is_bucket_start[velocity]) {
+            bucket_velocities[bucket_count++] = velocity;
+        }
+        instrument->velocity_buckets[velocity] = bucket_count - 1;
+    }
+
+    instrument->bucket_count = bucket_count;
+    instrument->zone_map = ysw_heap_allocate(YSW_MIDI_MAX_COUNT * bucket_count);
+
+    for (uint8_t midi_note = 0; midi_note < YSW_MIDI_MAX_COUNT; midi_note++) {
+        for (uint8_t bucket = 0; bucket < bucket_count; bucket++) {
+            uint8_t entry = match_sample(instrument, midi_note, bucket_velocities[bucket]);
+            instrument->zone_map[midi_note * bucket_count + bucket] = entry;
         }
     }
-    return NULL;
 }
 
+// Called only from the loader task, which owns the sample map
+
 static void realize_sample_data(ysw_mod_synth_t *mod_synth, ysw_mod_sample_t *sample)
 {
     if (sample && !sample->data) {
@@ -583,83 +1063,273 @@ static void realize_sample_data(ysw_mod_synth_t *mod_synth, ysw_mod_sample_t *sa
     }
 }
 
-static ysw_mod_sample_t *get_sample(ysw_mod_synth_t *mod_synth, ysw_mod_instrument_t *instrument, uint8_t midi_note)
+// Load a preset and all of its samples, then publish it. Until it is published, the
+// event task treats the preset as not ready and does not look inside it.
+
+static ysw_mod_sample_t *realize_image_zone(ysw_mod_synth_t *mod_synth, ysw_mod_image_zone_t *zone)
 {
-    ysw_mod_sample_t *sample = find_sample(instrument, midi_note);
-    realize_sample_data(mod_synth, sample);
+    uint32_t length = 0;
+    ysw_mod_sample_t *sample = ysw_heap_allocate(sizeof(ysw_mod_sample_t));
+    sample->data = ysw_mod_image_get_data(mod_synth->image, zone->data_index, &length);
+    sample->length = length;
+    sample->loop_start = zone->loop_start;
+    sample->loop_end = zone->loop_end;
+    sample->volume = zone->volume;
+    sample->pan = zone->pan;
+    sample->loop_type = zone->loop_type;
+    sample->attenuation = zone->attenuation;
+    sample->fine_tune = zone->fine_tune;
+    sample->root_key = zone->root_key;
+    sample->delay = timecents_to_samples(zone->delay, mod_synth->sample_rate);
+    sample->attack = timecents_to_samples(zone->attack, mod_synth->sample_rate);
+    sample->hold = timecents_to_samples(zone->hold, mod_synth->sample_rate);
+    sample->decay = timecents_to_samples(zone->decay, mod_synth->sample_rate);
+    sample->sustain = centibels_to_level(zone->sustain);
+    sample->release = timecents_to_samples(zone->release, mod_synth->sample_rate);
+    sample->increment_per_hz = get_increment_per_hz(sample, mod_synth->sample_rate);
+    sample->from_note = zone->from_note;
+    sample->to_note = zone->to_note;
+    sample->from_velocity = zone->from_velocity;
+    sample->to_velocity = zone->to_velocity;
     return sample;
 }
 
-static void start_note(ysw_mod_synth_t *mod_synth, uint8_t channel, uint8_t midi_note, uint8_t velocity)
+// A preset that is not in the image is realized without instruments, so its notes are silent
+
+static ysw_mod_preset_t *realize_image_preset(ysw_mod_synth_t *mod_synth, uint8_t bank, uint8_t program)
 {
-    enter_critical_section(mod_synth);
+    ysw_mod_preset_t *p = ysw_heap_allocate(sizeof(ysw_mod_preset_t));
+    p->bank = bank;
+    p->num = program;
+    p->instruments = ysw_array_create(2);
+
+    ysw_mod_image_preset_t *preset = ysw_mod_image_find_preset(mod_synth->image, bank, program);
+    if (!preset) {
+        ESP_LOGW(TAG, "realize_image_preset bank=%d, program=%d not found", bank, program);
+        return p;
+    }
 
-    uint8_t bank = mod_synth->channel_banks[channel];
-    uint8_t preset = mod_synth->channel_presets[channel];
-    ysw_mod_preset_t *p = realize_preset(mod_synth, bank, preset);
+    for (uint32_t i = 0; i < preset->instrument_count; i++) {
+        ysw_mod_image_instrument_t *image_instrument = &mod_synth->image->instruments[preset->first_instrument + i];
+        ysw_mod_instrument_t *instrument = ysw_heap_allocate(sizeof(ysw_mod_instrument_t));
+        instrument->samples = ysw_array_create(image_instrument->zone_count);
+        for (uint32_t j = 0; j < image_instrument->zone_count; j++) {
+            ysw_mod_image_zone_t *zone = &mod_synth->image->zones[image_instrument->first_zone + j];
+            ysw_array_push(instrument->samples, realize_image_zone(mod_synth, zone));
+        }
+        ysw_array_push(p->instruments, instrument);
+    }
+
+    return p;
+}
+
+static ysw_mod_preset_t *realize_csv_preset(ysw_mod_synth_t *mod_synth, ysw_mod_bank_t *b, uint8_t program)
+{
+    ysw_mod_preset_t *p = load_preset(mod_synth, b, program);
     uint8_t instrument_count = ysw_array_get_count(p->instruments);
     for (uint8_t i = 0; i < instrument_count; i++) {
         ysw_mod_instrument_t *instrument = ysw_array_get(p->instruments, i);
-        ysw_mod_sample_t *sample = get_sample(mod_synth, instrument, midi_note);
-        if (sample) {
-            uint8_t voice_index = allocate_voice(mod_synth, channel, midi_note);
-            voice_t *voice = &mod_synth->voices[voice_index];
-            voice->sample = sample;
-            voice->length = sample->length;
-            voice->loop_start = sample->loop_start;
-            voice->loop_end = sample->loop_end;
-            voice->loop_type = sample->loop_type;
-            voice->volume = velocity / 2; // mod volume range is 0-63
-            voice->sampinc = calculate_sample_increment(sample, midi_note);
-            voice->samppos = 0;
-            voice->time = mod_synth->voice_time++;
-            voice->state = YSW_MOD_NOTE_ON;
+        uint8_t sample_count = ysw_array_get_count(instrument->samples);
+        for (uint8_t j = 0; j < sample_count; j++) {
+            ysw_mod_sample_t *sample = ysw_array_get(instrument->samples, j);
+            realize_sample_data(mod_synth, sample);
         }
     }
+    return p;
+}
+
+static void realize_preset(ysw_mod_synth_t *mod_synth, ysw_mod_load_request_t *request)
+{
+    ysw_mod_bank_t *b = find_bank(mod_synth, request->bank);
+    assert(b);
+
+    if (b->presets[request->program]) {
+        return;
+    }
+
+    ysw_mod_preset_t *p = NULL;
+    if (mod_synth->image) {
+        p = realize_image_preset(mod_synth, request->bank, request->program);
+    } else {
+        p = realize_csv_preset(mod_synth, b, request->program);
+    }
 
-    leave_critical_section(mod_synth);
+    uint8_t instrument_count = ysw_array_get_count(p->instruments);
+    for (uint8_t i = 0; i < instrument_count; i++) {
+        ysw_mod_instrument_t *instrument = ysw_array_get(p->instruments, i);
+        check_loops(instrument);
+        index_instrument(instrument);
+    }
+
+    __atomic_store_n(&b->presets[request->program], p, __ATOMIC_RELEASE);
 }
 
-static void stop_note(ysw_mod_synth_t *mod_synth, uint8_t channel, uint8_t midi_note)
+static void run_loader(void *context)
 {
-    enter_critical_section(mod_synth);
+    ysw_mod_synth_t *mod_synth = context;
 
-    for (uint8_t i = 0; i < mod_synth->voice_count; i++) {
-        voice_t *voice = &mod_synth->voices[i];
-        // See if this voice is associated with this channel's note
-        if (voice->channel == channel && voice->midi_note == midi_note) {
-            if (voice->state >= YSW_MOD_DELAY && voice->state <= YSW_MOD_SUSTAIN) {
-                // ESP_LOGD(TAG, "stop: initiating release, index=%d, state=%d", i, voice->state);
-                // Note will progress through release and be freed in allocate_voice
-                voice->state = YSW_MOD_NOTE_OFF;
-            }
+    // Prefer a compiled sound bank image (one file, one index read) to CSV and sample files
+    char path[PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", mod_synth->folder, YSW_MOD_IMAGE_NAME);
+    mod_synth->image = ysw_mod_image_open(path, YSW_MOD_GUARD_BEFORE, YSW_MOD_GUARD_AFTER);
+
+    for (;;) {
+        ysw_mod_load_request_t request;
+        BaseType_t is_message = xQueueReceive(mod_synth->loader_queue, &request, portMAX_DELAY);
+        if (is_message) {
+            realize_preset(mod_synth, &request);
         }
     }
+}
+
+// Returns the preset if the loader task has published it, otherwise asks the loader
+// task to load it (once) and returns NULL. Never blocks.
+
+static ysw_mod_preset_t *request_preset(ysw_mod_synth_t *mod_synth, uint8_t bank, uint8_t program)
+{
+    ysw_mod_bank_t *b = find_bank(mod_synth, bank);
+    assert(b);
+
+    ysw_mod_preset_t *p = __atomic_load_n(&b->presets[program], __ATOMIC_ACQUIRE);
+    if (!p && !b->requested[program]) {
+        b->requested[program] = true;
+        ysw_mod_load_request_t request = {
+            .bank = bank,
+            .program = program,
+        };
+        ysw_message_send(mod_synth->loader_queue, &request);
+    }
 
-    leave_critical_section(mod_synth);
+    return p;
 }
 
-static void preload_preset(ysw_mod_synth_t *mod_synth, uint8_t bank, uint8_t preset)
+// Called only from the event task. If the audio callback has fallen behind, wait for it
+// to drain the ring rather than drop the command (a dropped note off would hang a note).
+
+static void post_command(ysw_mod_synth_t *mod_synth, ysw_mod_command_t *command)
+{
+    while (!ysw_ring_put(mod_synth->commands, command)) {
+        vTaskDelay(1);
+    }
+}
+
+static void post_note_on(ysw_mod_synth_t *mod_synth, ysw_mod_preset_t *p,
+        uint8_t channel, uint8_t midi_note, uint8_t velocity, uint32_t frame)
 {
-    ysw_mod_preset_t *p = realize_preset(mod_synth, bank, preset);
     uint8_t instrument_count = ysw_array_get_count(p->instruments);
     for (uint8_t i = 0; i < instrument_count; i++) {
         ysw_mod_instrument_t *instrument = ysw_array_get(p->instruments, i);
-        uint8_t sample_count = ysw_array_get_count(instrument->samples);
-        for (uint8_t j = 0; j < sample_count; j++) {
-            ysw_mod_sample_t *sample = ysw_array_get(instrument->samples, j);
-            realize_sample_data(mod_synth, sample);
+        ysw_mod_sample_t *sample = find_sample(instrument, midi_note, velocity);
+        if (sample) {
+            ysw_mod_command_t command = {
+                .type = YSW_MOD_COMMAND_NOTE_ON,
+                .channel = channel,
+                .midi_note = midi_note,
+                .velocity = velocity,
+                .sample = sample,
+                .frame = frame,
+            };
+            post_command(mod_synth, &command);
+        }
+    }
+}
+
+// Poll while there are note ons or preloads waiting for the loader task
+
+static void update_wait_millis(ysw_mod_synth_t *mod_synth)
+{
+    if (mod_synth->pending_count || mod_synth->preload_count) {
+        ysw_task_set_wait_millis(mod_synth->task, PENDING_POLL_MILLIS);
+    } else {
+        ysw_task_set_wait_millis(mod_synth->task, ysw_task_default_config.wait_millis);
+    }
+}
+
+static void defer_note_on(ysw_mod_synth_t *mod_synth, uint8_t bank, uint8_t program,
+        uint8_t channel, uint8_t midi_note, uint8_t velocity, uint32_t frame)
+{
+    if (mod_synth->pending_count == YSW_MOD_MAX_PENDING) {
+        ESP_LOGW(TAG, "defer_note_on pending list full, skipping channel=%d, midi_note=%d", channel, midi_note);
+        return;
+    }
+
+    mod_synth->pending[mod_synth->pending_count++] = (ysw_mod_pending_t ) {
+        .channel = channel,
+        .midi_note = midi_note,
+        .velocity = velocity,
+        .bank = bank,
+        .program = program,
+        .frame = frame,
+    };
+
+    update_wait_millis(mod_synth);
+}
+
+static void remove_pending(ysw_mod_synth_t *mod_synth, uint8_t index)
+{
+    mod_synth->pending[index] = mod_synth->pending[--mod_synth->pending_count];
+    if (!mod_synth->pending_count) {
+        update_wait_millis(mod_synth);
+    }
+}
+
+static void process_pending(ysw_mod_synth_t *mod_synth)
+{
+    uint8_t i = 0;
+    while (i < mod_synth->pending_count) {
+        ysw_mod_pending_t *pending = &mod_synth->pending[i];
+        ysw_mod_preset_t *p = request_preset(mod_synth, pending->bank, pending->program);
+        if (p) {
+            post_note_on(mod_synth, p, pending->channel, pending->midi_note, pending->velocity, pending->frame);
+            remove_pending(mod_synth, i);
+        } else {
+            i++;
         }
     }
 }
 
+static void start_note(ysw_mod_synth_t *mod_synth, uint8_t channel, uint8_t midi_note, uint8_t velocity,
+        uint32_t frame)
+{
+    uint8_t bank = mod_synth->channel_banks[channel];
+    uint8_t program = mod_synth->channel_presets[channel];
+    ysw_mod_preset_t *p = request_preset(mod_synth, bank, program);
+    if (p) {
+        post_note_on(mod_synth, p, channel, midi_note, velocity, frame);
+    } else {
+        defer_note_on(mod_synth, bank, program, channel, midi_note, velocity, frame);
+    }
+}
+
+static void stop_note(ysw_mod_synth_t *mod_synth, uint8_t channel, uint8_t midi_note, uint32_t frame)
+{
+    // A note that is released before its preset is loaded is never started
+    uint8_t i = 0;
+    while (i < mod_synth->pending_count) {
+        ysw_mod_pending_t *pending = &mod_synth->pending[i];
+        if (pending->channel == channel && pending->midi_note == midi_note) {
+            remove_pending(mod_synth, i);
+        } else {
+            i++;
+        }
+    }
+
+    ysw_mod_command_t command = {
+        .type = YSW_MOD_COMMAND_NOTE_OFF,
+        .channel = channel,
+        .midi_note = midi_note,
+        .frame = frame,
+    };
+    post_command(mod_synth, &command);
+}
+
 static void on_note_on(ysw_mod_synth_t *mod_synth, ysw_event_note_on_t *m)
 {
     assert(m->channel < YSW_MIDI_MAX_CHANNELS);
     assert(m->midi_note < YSW_MIDI_MAX_COUNT);
     assert(m->velocity < YSW_MIDI_MAX_COUNT);
 
-    start_note(mod_synth, m->channel, m->midi_note, m->velocity);
+    start_note(mod_synth, m->channel, m->midi_note, m->velocity, m->frame);
 }
 
 static void on_note_off(ysw_mod_synth_t *mod_synth, ysw_event_note_off_t *m)
@@ -667,7 +1337,24 @@ static void on_note_off(ysw_mod_synth_t *mod_synth, ysw_event_note_off_t *m)
     assert(m->channel < YSW_MIDI_MAX_CHANNELS);
     assert(m->midi_note < YSW_MIDI_MAX_COUNT);
 
-    stop_note(mod_synth, m->channel, m->midi_note);
+    stop_note(mod_synth, m->channel, m->midi_note, m->frame);
+}
+
+static void on_note_batch(ysw_mod_synth_t *mod_synth, ysw_event_note_batch_t *m)
+{
+    assert(m->count <= YSW_EVENT_MAX_BATCH);
+
+    for (uint8_t i = 0; i < m->count; i++) {
+        ysw_event_batch_note_t *note = &m->notes[i];
+        assert(note->channel < YSW_MIDI_MAX_CHANNELS);
+        assert(note->midi_note < YSW_MIDI_MAX_COUNT);
+        assert(note->velocity < YSW_MIDI_MAX_COUNT);
+        if (note->velocity) {
+            start_note(mod_synth, note->channel, note->midi_note, note->velocity, m->frame);
+        } else {
+            stop_note(mod_synth, note->channel, note->midi_note, m->frame);
+        }
+    }
 }
 
 static void on_bank_select(ysw_mod_synth_t *mod_synth, ysw_event_bank_select_t *m)
@@ -686,18 +1373,98 @@ static void on_program_change(ysw_mod_synth_t *mod_synth, ysw_event_program_chan
 
     if (m->preload) {
         uint8_t bank = mod_synth->channel_banks[m->channel];
-        preload_preset(mod_synth, bank, m->program);
+        request_preset(mod_synth, bank, m->program);
     }
 }
 
+static void on_prefetch(ysw_mod_synth_t *mod_synth, ysw_event_prefetch_t *m)
+{
+    assert(m->count <= YSW_EVENT_MAX_PREFETCH);
+
+    for (uint8_t i = 0; i < m->count; i++) {
+        assert(m->presets[i].program < YSW_MIDI_MAX_COUNT);
+        request_preset(mod_synth, m->presets[i].bank, m->presets[i].program);
+    }
+}
+
+// Requests every preset in the preload (so they load in parallel with each other) and
+// returns true if all of them have been published
+
+static bool is_preload_done(ysw_mod_synth_t *mod_synth, ysw_mod_preload_t *preload)
+{
+    bool is_done = true;
+    for (uint8_t i = 0; i < preload->count; i++) {
+        if (!request_preset(mod_synth, preload->banks[i], preload->programs[i])) {
+            is_done = false;
+        }
+    }
+    return is_done;
+}
+
+static void process_preloads(ysw_mod_synth_t *mod_synth)
+{
+    uint8_t i = 0;
+    while (i < mod_synth->preload_count) {
+        ysw_mod_preload_t *preload = &mod_synth->preloads[i];
+        if (is_preload_done(mod_synth, preload)) {
+            ysw_event_fire_preload_done(mod_synth->bus, preload->token);
+            mod_synth->preloads[i] = mod_synth->preloads[--mod_synth->preload_count];
+        } else {
+            i++;
+        }
+    }
+    update_wait_millis(mod_synth);
+}
+
+static void on_preload(ysw_mod_synth_t *mod_synth, ysw_event_preload_t *m)
+{
+    assert(m->count <= YSW_EVENT_MAX_PRELOAD);
+    assert(m->count <= YSW_MOD_MAX_PRELOAD_PRESETS);
+
+    if (mod_synth->preload_count == YSW_MOD_MAX_PRELOADS) {
+        ESP_LOGW(TAG, "on_preload preload list full, not waiting for token=%d", m->token);
+        ysw_event_fire_preload_done(mod_synth->bus, m->token);
+        return;
+    }
+
+    ysw_mod_preload_t *preload = &mod_synth->preloads[mod_synth->preload_count++];
+    preload->token = m->token;
+    preload->count = m->count;
+    for (uint8_t i = 0; i < m->count; i++) {
+        assert(m->programs[i].channel < YSW_MIDI_MAX_CHANNELS);
+        assert(m->programs[i].program < YSW_MIDI_MAX_COUNT);
+        preload->banks[i] = mod_synth->channel_banks[m->programs[i].channel];
+        preload->programs[i] = m->programs[i].program;
+    }
+
+    process_preloads(mod_synth);
+}
+
 static void on_synth_gain(ysw_mod_synth_t *mod_synth, ysw_event_synth_gain_t *m)
 {
-    mod_synth->percent_gain = m->percent_gain;
+    ysw_mod_command_t command = {
+        .type = YSW_MOD_COMMAND_GAIN,
+        .percent_gain = m->percent_gain,
+    };
+    post_command(mod_synth, &command);
 }
 
 static void process_event(void *context, ysw_event_t *event)
 {
     ysw_mod_synth_t *mod_synth = context;
+
+    if (mod_synth->pending_count) {
+        process_pending(mod_synth);
+    }
+
+    if (mod_synth->preload_count) {
+        process_preloads(mod_synth);
+    }
+
+    if (!event) {
+        return;
+    }
+
     switch (event->header.type) {
         case YSW_EVENT_NOTE_ON:
             on_note_on(mod_synth, &event->note_on);
@@ -705,12 +1472,21 @@ static void process_event(void *context, ysw_event_t *event)
         case YSW_EVENT_NOTE_OFF:
             on_note_off(mod_synth, &event->note_off);
             break;
+        case YSW_EVENT_NOTE_BATCH:
+            on_note_batch(mod_synth, &event->note_batch);
+            break;
         case YSW_EVENT_BANK_SELECT:
             on_bank_select(mod_synth, &event->bank_select);
             break;
         case YSW_EVENT_PROGRAM_CHANGE:
             on_program_change(mod_synth, &event->program_change);
             break;
+        case YSW_EVENT_PREFETCH:
+            on_prefetch(mod_synth, &event->prefetch);
+            break;
+        case YSW_EVENT_PRELOAD:
+            on_preload(mod_synth, &event->preload);
+            break;
         case YSW_EVENT_SYNTH_GAIN:
             on_synth_gain(mod_synth, &event->synth_gain);
             break;
@@ -719,12 +1495,44 @@ static void process_event(void *context, ysw_event_t *event)
     }
 }
 
-ysw_mod_synth_t *ysw_mod_synth_create_task(ysw_bus_t *bus)
+const ysw_mod_synth_config_t ysw_mod_synth_default_config = {
+    .sample_rate = YSW_MOD_DEFAULT_SAMPLE_RATE,
+    .max_voices = YSW_MOD_DEFAULT_MAX_VOICES,
+    .interpolation = YSW_MOD_INTERPOLATE_LINEAR,
+};
+
+static void initialize_voices(ysw_mod_synth_t *mod_synth, const ysw_mod_synth_config_t *config)
+{
+    assert(config->max_voices);
+
+    uint16_t max_voices = config->max_voices;
+    mod_synth->max_voices = max_voices;
+    mod_synth->interpolation = config->interpolation;
+    memcpy(mod_synth->channel_priorities, config->channel_priorities, sizeof(mod_synth->channel_priorities));
+
+    mod_synth->voices = ysw_heap_allocate(max_voices * sizeof(voice_t));
+    mod_synth->free_voices = ysw_heap_allocate(max_voices * sizeof(voice_t *));
+    mod_synth->active_voices = ysw_heap_allocate(max_voices * sizeof(voice_t *));
+    mod_synth->retired_voices = ysw_heap_allocate(max_voices * sizeof(voice_t *));
+    mod_synth->held_voices = ysw_heap_allocate(YSW_MIDI_MAX_CHANNELS * YSW_MIDI_MAX_COUNT * sizeof(voice_t *));
+
+    // Push in reverse order so that voices are allocated from the start of the pool
+    for (uint16_t i = 0; i < max_voices; i++) {
+        mod_synth->free_voices[mod_synth->free_count++] = &mod_synth->voices[max_voices - i - 1];
+    }
+}
+
+ysw_mod_synth_t *ysw_mod_synth_create_task(ysw_bus_t *bus, const ysw_mod_synth_config_t *config)
 {
     extern void hash_ensure_assert_off(void);
     hash_ensure_assert_off();
 
+    assert(config);
+    assert(config->sample_rate);
+
     ysw_mod_synth_t *mod_synth = ysw_heap_allocate(sizeof(ysw_mod_synth_t));
+    mod_synth->bus = bus;
+    mod_synth->sample_rate = config->sample_rate;
     mod_synth->percent_gain = 100;
     mod_synth->folder = "/spiffs";
     mod_synth->banks[0].num = 0;
@@ -732,15 +1540,28 @@ ysw_mod_synth_t *ysw_mod_synth_create_task(ysw_bus_t *bus)
     mod_synth->sample_map = hash_create(128, NULL, NULL);
 
     initialize_synthesizer(mod_synth);
+    initialize_voices(mod_synth, config);
+
+    ysw_task_config_t loader_config = ysw_task_default_config;
 
-    ysw_task_config_t config = ysw_task_default_config;
+    loader_config.name = LOADER_TAG;
+    loader_config.function = run_loader;
+    loader_config.context = mod_synth;
+    loader_config.queue = &mod_synth->loader_queue;
+    loader_config.queue_size = LOADER_QUEUE_SIZE;
+    loader_config.item_size = sizeof(ysw_mod_load_request_t);
 
-    config.name = TAG;
-    config.bus = bus;
-    config.event_handler = process_event;
-    config.context = mod_synth;
+    ysw_task_create(&loader_config);
 
-    ysw_task_t *task = ysw_task_create(&config);
+    ysw_task_config_t task_config = ysw_task_default_config;
+
+    task_config.name = TAG;
+    task_config.bus = bus;
+    task_config.task = &mod_synth->task;
+    task_config.event_handler = process_event;
+    task_config.context = mod_synth;
+
+    ysw_task_t *task = ysw_task_create(&task_config);
 
     ysw_task_subscribe(task, YSW_ORIGIN_EDITOR);
     ysw_task_subscribe(task, YSW_ORIGIN_SEQUENCER);
@@ -748,3 +1569,12 @@ ysw_mod_synth_t *ysw_mod_synth_create_task(ysw_bus_t *bus)
 
     return mod_synth;
 }
+
+// Returns the number of frames generated so far. Notes stamped with a frame clock value
+// are started or stopped at exactly that frame. The clock wraps, so compare values by
+// their signed difference.
+
+uint32_t ysw_mod_synth_get_frame_clock(ysw_mod_synth_t *mod_synth)
+{
+    return __atomic_load_n(&mod_synth->frame_clock, __ATOMIC_ACQUIRE);
+}
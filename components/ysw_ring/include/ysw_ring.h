@@ -0,0 +1,32 @@
+// Copyright 2020 Anthony F. Stuart - All rights reserved.
+//
+// This program and the accompanying materials are made available
+// under the terms of the GNU General Public License. For other license
+// options please contact the copyright owner.
+//
+// This program is made available on an "as is" basis, without
+// warranties or conditions of any kind, either express or implied.
+
+#pragma once
+
+#include "stdbool.h"
+#include "stdint.h"
+
+// Lock-free single-producer/single-consumer ring of fixed size items. Exactly one
+// task may put and exactly one task may get. Neither side ever blocks.
+
+typedef struct {
+    uint8_t *items;
+    uint32_t item_size;
+    uint32_t mask;
+    uint32_t head; // next slot to put, written only by producer
+    uint32_t tail; // next slot to get, written only by consumer
+} ysw_ring_t;
+
+ysw_ring_t *ysw_ring_create(uint32_t item_count, uint32_t item_size);
+bool ysw_ring_put(ysw_ring_t *ring, const void *item);
+bool ysw_ring_get(ysw_ring_t *ring, void *item);
+const void *ysw_ring_peek(ysw_ring_t *ring);
+void ysw_ring_skip(ysw_ring_t *ring);
+uint32_t ysw_ring_get_count(ysw_ring_t *ring);
+void ysw_ring_free(ysw_ring_t *ring);
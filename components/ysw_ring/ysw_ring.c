@@ -0,0 +1,101 @@
+// Copyright 2020 Anthony F. Stuart - All rights reserved.
+//
+// This program and the accompanying materials are made available
+// under the terms of the GNU General Public License. For other license
+// options please contact the copyright owner.
+//
+// This program is made available on an "as is" basis, without
+// warranties or conditions of any kind, either express or implied.
+
+#include "ysw_ring.h"
+
+#include "ysw_heap.h"
+#include "esp_log.h"
+#include "assert.h"
+#include "stdlib.h"
+#include "string.h"
+
+#define TAG "YSW_RING"
+
+// head and tail run freely and wrap at 2^32, so item_count must be a power of two.
+// Each side reads the other side's index with acquire semantics and publishes its
+// own with release semantics, so item contents are visible before the index moves.
+
+ysw_ring_t *ysw_ring_create(uint32_t item_count, uint32_t item_size)
+{
+    if (!item_count || (item_count & (item_count - 1))) {
+        ESP_LOGE(TAG, "item_count=%d is not a power of two", item_count);
+        abort();
+    }
+    ysw_ring_t *ring = ysw_heap_allocate(sizeof(ysw_ring_t));
+    ring->items = ysw_heap_allocate(item_count * item_size);
+    ring->item_size = item_size;
+    ring->mask = item_count - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    return ring;
+}
+
+bool ysw_ring_put(ysw_ring_t *ring, const void *item)
+{
+    assert(ring);
+    assert(item);
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail > ring->mask) {
+        return false;
+    }
+    memcpy(ring->items + (head & ring->mask) * ring->item_size, item, ring->item_size);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool ysw_ring_get(ysw_ring_t *ring, void *item)
+{
+    assert(ring);
+    assert(item);
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return false;
+    }
+    memcpy(item, ring->items + (tail & ring->mask) * ring->item_size, ring->item_size);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Consumer only: returns the next item without removing it, or NULL if the ring is empty.
+// The item remains valid until it is removed with ysw_ring_skip.
+
+const void *ysw_ring_peek(ysw_ring_t *ring)
+{
+    assert(ring);
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return NULL;
+    }
+    return ring->items + (tail & ring->mask) * ring->item_size;
+}
+
+void ysw_ring_skip(ysw_ring_t *ring)
+{
+    assert(ring);
+    assert(ring->tail != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE));
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t ysw_ring_get_count(ysw_ring_t *ring)
+{
+    assert(ring);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return head - tail;
+}
+
+void ysw_ring_free(ysw_ring_t *ring)
+{
+    assert(ring);
+    ysw_heap_free(ring->items);
+    ysw_heap_free(ring);
+}
@@ -12,5 +12,41 @@
 #include "ysw_bus.h"
 
 #define YSW_SEQUENCER_SPEED_DEFAULT 100
+#define YSW_SEQUENCER_LOOKAHEAD_DEFAULT 20
+#define YSW_SEQUENCER_PRELOAD_TIMEOUT_DEFAULT 1000
+#define YSW_SEQUENCER_PRELOAD_RESPONDERS_DEFAULT 1
+#define YSW_SEQUENCER_TRACKS_DEFAULT 4
 
-void ysw_sequencer_create_task(ysw_bus_t *bus);
+typedef uint32_t (*ysw_sequencer_clock_cb_t)(void *context);
+
+// By default, notes are sent when they are due, as timed by the RTOS. If get_frame is set,
+// notes are sent up to lookahead_millis ahead of time, stamped with the audio frame (as
+// returned by get_frame) at which the synthesizer should start or stop them. The lookahead
+// must cover the latency of the bus, the synthesizer's event task and its audio buffer.
+//
+// Before a clip starts, the programs it uses are sent to the synthesizers in preload
+// events. The clip starts when each of the preload_responders synthesizers on the bus has
+// replied to each preload, or after preload_timeout_millis if they do not. A
+// preload_timeout_millis of zero starts clips without preloading.
+//
+// Each of track_count tracks plays its own clip, independently of the others, e.g. an
+// accompaniment on one track and previews of individual steps on another. Tracks that
+// play at the same time must use separate channels, because each channel has one program.
+//
+// A clip with a note source is played a piece at a time, as the pieces are needed. Each
+// piece is requested, and its programs preloaded, while the piece before it is playing. It
+// cannot have a tempo map, be looped or be the target of a seek.
+
+typedef struct {
+    ysw_sequencer_clock_cb_t get_frame;
+    void *clock_context;
+    uint32_t sample_rate;
+    uint32_t lookahead_millis;
+    uint32_t preload_timeout_millis;
+    uint8_t preload_responders;
+    uint8_t track_count;
+} ysw_sequencer_config_t;
+
+extern const ysw_sequencer_config_t ysw_sequencer_default_config;
+
+void ysw_sequencer_create_task(ysw_bus_t *bus, const ysw_sequencer_config_t *config);
@@ -12,366 +12,1006 @@
 #include "ysw_heap.h"
 #include "ysw_task.h"
 #include "ysw_midi.h"
+#include "ysw_tempo.h"
 #include "ysw_ticks.h"
 #include "esp_log.h"
-#include "time.h"
+#include "assert.h"
 
 #define TAG "YSW_SEQUENCER"
 
-#define MAX_POLYPHONY 64
+#define INITIAL_ACTIVE_SIZE 16
+
+#define MICROS_PER_MINUTE 60000000ull
+
+// Times are in playback micros, which advance at the tempo of the clip, scaled by the
+// current tempo and playback speed. Note times within a clip are relative to tick zero
+// and are limited to about 71 minutes.
+
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+} note_time_t;
 
 typedef struct {
     uint8_t channel;
     uint8_t midi_note;
-    time_t end_time;
+    uint64_t end_time;
 } active_note_t;
 
+struct ysw_sequencer_s;
+
+// Each track plays its own clip and play list, on its own timeline, with its own tempo,
+// speed and loop setting. Active notes are kept per track, because their end times are
+// in the track's playback time.
+
 typedef struct {
-    ysw_bus_t *bus;
-    ysw_task_t *task;
+    struct ysw_sequencer_s *sequencer;
+    uint8_t index;
     ysw_event_clip_t clip;
+    ysw_notes_t *next_piece; // piece that follows clip.notes in a streamed clip, NULL if none
+    uint32_t next_length; // length of next_piece, in ticks
+    note_time_t *note_times; // [note index] -> start and end of note, from clip's tempo map
+    uint32_t clip_end; // end of last note in clip, i.e. length of one iteration
+    uint16_t max_duration; // duration of longest note in clip, in ticks
+    uint64_t clip_start_time; // playback time of tick zero of current iteration
+    uint64_t anchor_time; // playback time at anchor_millis (and anchor_frame)
+    uint32_t anchor_millis; // wall clock millis at anchor_time
+    uint32_t anchor_frame; // lookahead frame at anchor_time, if using an audio clock
     ysw_array_t *play_list;
-    active_note_t active_notes[MAX_POLYPHONY];
-    uint8_t programs[YSW_MIDI_MAX_CHANNELS];
+    active_note_t *active_notes; // heap ordered by end_time, root is next to end
+    uint16_t active_count;
+    uint16_t active_size;
+    uint16_t *active_indexes; // [channel * YSW_MIDI_MAX_COUNT + midi_note] -> heap index + 1, 0 if not active
     uint32_t next_note;
-    uint32_t start_millis;
-    uint8_t active_count;
+    uint32_t seek_tick; // position to start at when playback starts or resumes
+    bool is_seek_pending;
+    bool is_loop_done_pending; // LOOP_DONE is sent when the next iteration reaches clip_start_time
+    bool is_playing;
+    uint16_t preload_token; // token of most recent preload
+    uint16_t preload_count; // preload replies expected before clip starts, zero if not preloading
+    uint32_t preload_deadline; // millis at which clip starts whether or not synthesizer replied
+    uint8_t channel_offset; // added to each note's channel
+    uint8_t bpm; // current tempo, the clip's tempo map is scaled by bpm / clip.bpm
     uint8_t playback_speed;
     bool loop;
+} track_t;
+
+// The tracks share the batch and the programs sent to the synthesizer, and are served
+// by a single task that wakes up for whichever track has the next note to start or end.
+// The synthesizer has one program per channel, so tracks that play at the same time must
+// use separate channels.
+
+typedef struct ysw_sequencer_s {
+    ysw_bus_t *bus;
+    ysw_task_t *task;
+    ysw_sequencer_config_t config;
+    track_t *tracks;
+    ysw_event_note_batch_t batch; // note ons and offs waiting to be sent
+    ysw_note_t statuses[YSW_EVENT_MAX_BATCH]; // note statuses to send after the batch
+    uint8_t status_count;
+    uint8_t programs[YSW_MIDI_MAX_CHANNELS];
+    uint8_t program_tracks[YSW_MIDI_MAX_CHANNELS]; // track that last changed each channel's program
+    uint16_t preload_token; // token of most recent preload, on any track
 } ysw_sequencer_t;
 
-static inline time_t t2ms(ysw_sequencer_t *sequencer, uint32_t ticks)
+static inline bool is_clip_playing(track_t *track)
 {
-    return ysw_ticks_to_millis(ticks, sequencer->clip.bpm);
+    return track->is_playing;
 }
 
-static inline bool is_clip_playing(ysw_sequencer_t *sequencer)
+static inline bool is_preloading(track_t *track)
 {
-    return sequencer->start_millis;
+    return track->preload_count;
 }
 
-static void release_notes(ysw_sequencer_t *sequencer)
+static inline bool is_clocked(ysw_sequencer_t *sequencer)
 {
-    for (uint8_t i = 0; i < sequencer->active_count; i++) {
-        active_note_t *active_note = &sequencer->active_notes[i];
-        ysw_event_note_off_t note_off = {
-            .channel = active_note->channel,
-            .midi_note = active_note->midi_note,
-        };
-        ysw_event_fire_note_off(sequencer->bus, YSW_ORIGIN_SEQUENCER, &note_off);
+    return sequencer->config.get_frame;
+}
+
+// The frame up to which notes are sent, i.e. the current audio frame plus the lookahead
+
+static inline uint32_t get_lookahead_frame(ysw_sequencer_t *sequencer)
+{
+    uint32_t frame = sequencer->config.get_frame(sequencer->config.clock_context);
+    return frame + (sequencer->config.lookahead_millis * sequencer->config.sample_rate) / 1000;
+}
+
+static inline uint32_t get_anchor_frame(ysw_sequencer_t *sequencer)
+{
+    return is_clocked(sequencer) ? get_lookahead_frame(sequencer) : 0;
+}
+
+static inline int64_t playback_to_wall(track_t *track, int64_t micros)
+{
+    return (micros * 100 * track->clip.bpm) / ((int64_t)track->playback_speed * track->bpm);
+}
+
+static inline int64_t wall_to_playback(track_t *track, int64_t micros)
+{
+    return (micros * track->playback_speed * track->bpm) / (100 * (int64_t)track->clip.bpm);
+}
+
+static uint64_t get_playback_time_at(track_t *track, uint32_t millis, uint32_t frame)
+{
+    ysw_sequencer_t *sequencer = track->sequencer;
+    int64_t elapsed_micros;
+    if (is_clocked(sequencer)) {
+        int32_t elapsed_frames = frame - track->anchor_frame;
+        elapsed_micros = ((int64_t)elapsed_frames * 1000000) / sequencer->config.sample_rate;
+    } else {
+        elapsed_micros = (int64_t)(millis - track->anchor_millis) * 1000;
+    }
+    return track->anchor_time + wall_to_playback(track, elapsed_micros);
+}
+
+static inline uint64_t get_playback_time(track_t *track)
+{
+    return get_playback_time_at(track, ysw_get_millis(), get_anchor_frame(track->sequencer));
+}
+
+// Playback time is anchored to the wall clock (and audio clock) when playback starts or
+// resumes, and re-anchored at the current playback time when the tempo or speed changes,
+// so that playback continues from where it is, at the new rate
+
+static void set_anchor(track_t *track, uint64_t time, uint32_t millis, uint32_t frame)
+{
+    track->anchor_time = time;
+    track->anchor_millis = millis;
+    track->anchor_frame = frame;
+}
+
+static void reanchor(track_t *track)
+{
+    uint32_t millis = ysw_get_millis();
+    uint32_t frame = get_anchor_frame(track->sequencer);
+    set_anchor(track, get_playback_time_at(track, millis, frame), millis, frame);
+}
+
+// Returns the frame at which an event at the given playback time should take effect, or
+// zero (as soon as possible) if not using an audio clock
+
+static inline uint32_t get_note_frame(track_t *track, uint64_t time)
+{
+    ysw_sequencer_t *sequencer = track->sequencer;
+    if (!is_clocked(sequencer)) {
+        return 0;
+    }
+    int64_t wall_micros = playback_to_wall(track, (int64_t)(time - track->anchor_time));
+    uint32_t frame = track->anchor_frame + (wall_micros * sequencer->config.sample_rate) / 1000000;
+    return frame ? frame : 1;
+}
+
+// Rounds up, so the sequencer does not wake up just before the event is due
+
+static inline TickType_t get_ticks_to_wait(track_t *track, uint64_t delay_time)
+{
+    uint32_t delay_millis = (playback_to_wall(track, delay_time) + 999) / 1000;
+    return ysw_millis_to_rtos_ticks(delay_millis);
+}
+
+static inline uint8_t get_channel(track_t *track, ysw_note_t *note)
+{
+    return (note->channel + track->channel_offset) % YSW_MIDI_MAX_CHANNELS;
+}
+
+// The active notes form a binary heap ordered by end time, so the next note to end is
+// always at the root. Each note's position in the heap is tracked by channel and note, so
+// that a note that is played again while it is still active can be found and extended.
+
+static inline uint16_t *get_active_index(track_t *track, uint8_t channel, uint8_t midi_note)
+{
+    return &track->active_indexes[channel * YSW_MIDI_MAX_COUNT + midi_note];
+}
+
+static inline void set_active_note(track_t *track, uint16_t index, active_note_t *active_note)
+{
+    track->active_notes[index] = *active_note;
+    *get_active_index(track, active_note->channel, active_note->midi_note) = index + 1;
+}
+
+static void sift_up(track_t *track, uint16_t index)
+{
+    active_note_t active_note = track->active_notes[index];
+    while (index) {
+        uint16_t parent = (index - 1) / 2;
+        if (track->active_notes[parent].end_time <= active_note.end_time) {
+            break;
+        }
+        set_active_note(track, index, &track->active_notes[parent]);
+        index = parent;
+    }
+    set_active_note(track, index, &active_note);
+}
+
+static void sift_down(track_t *track, uint16_t index)
+{
+    active_note_t active_note = track->active_notes[index];
+    uint16_t count = track->active_count;
+    for (;;) {
+        uint16_t child = index * 2 + 1;
+        if (child >= count) {
+            break;
+        }
+        if (child + 1 < count && track->active_notes[child + 1].end_time < track->active_notes[child].end_time) {
+            child++;
+        }
+        if (active_note.end_time <= track->active_notes[child].end_time) {
+            break;
+        }
+        set_active_note(track, index, &track->active_notes[child]);
+        index = child;
     }
-    sequencer->active_count = 0;
+    set_active_note(track, index, &active_note);
+}
+
+static void add_active_note(track_t *track, active_note_t *active_note)
+{
+    if (track->active_count == track->active_size) {
+        track->active_size *= 2;
+        track->active_notes = ysw_heap_reallocate(track->active_notes, track->active_size * sizeof(active_note_t));
+    }
+    uint16_t index = track->active_count++;
+    set_active_note(track, index, active_note);
+    sift_up(track, index);
+}
+
+static void update_active_note(track_t *track, uint16_t index, active_note_t *active_note)
+{
+    set_active_note(track, index, active_note);
+    sift_up(track, index);
+    sift_down(track, *get_active_index(track, active_note->channel, active_note->midi_note) - 1);
 }
 
-static inline bool is_clip_present(ysw_sequencer_t *sequencer)
+static void remove_first_active_note(track_t *track)
 {
-    return sequencer->clip.notes;
+    active_note_t *first = &track->active_notes[0];
+    *get_active_index(track, first->channel, first->midi_note) = 0;
+    if (--track->active_count) {
+        set_active_note(track, 0, &track->active_notes[track->active_count]);
+        sift_down(track, 0);
+    }
 }
 
-static void free_clip(ysw_sequencer_t *sequencer)
+// Note ons and note offs that take effect at the same time are collected into a batch and
+// sent as a single event. The batch is sent when a note for a different frame is added, when
+// it is full, when the sequencer is about to wait, and before any other playback event, so
+// subscribers see everything in order. The status of each note that was started is sent
+// after the batch, so listeners don't show a note before it sounds.
+
+static void send_batch(ysw_sequencer_t *sequencer)
 {
-    ysw_array_free(sequencer->clip.notes);
-    sequencer->clip.notes = NULL;
-    sequencer->clip.bpm = 0;
+    if (sequencer->batch.count) {
+        ysw_event_fire_note_batch(sequencer->bus, YSW_ORIGIN_SEQUENCER, &sequencer->batch);
+        sequencer->batch.count = 0;
+    }
+    for (uint8_t i = 0; i < sequencer->status_count; i++) {
+        ysw_event_fire_note_status(sequencer->bus, &sequencer->statuses[i]);
+    }
+    sequencer->status_count = 0;
 }
 
-static inline void adjust_playback_start_millis(ysw_sequencer_t *sequencer)
+static void add_to_batch(ysw_sequencer_t *sequencer, uint8_t channel, uint8_t midi_note, uint8_t velocity,
+        uint32_t frame)
 {
-    uint32_t tick;
-    if (sequencer->next_note == 0) {
-        // beginning of clip: start at zero
-        tick = 0;
+    ysw_event_note_batch_t *batch = &sequencer->batch;
+    if (batch->count == YSW_EVENT_MAX_BATCH || (batch->count && batch->frame != frame)) {
+        send_batch(sequencer);
+    }
+    batch->frame = frame;
+    batch->notes[batch->count++] = (ysw_event_batch_note_t ) {
+        .channel = channel,
+        .midi_note = midi_note,
+        .velocity = velocity,
+    };
+}
+
+static void release_notes(track_t *track)
+{
+    ysw_sequencer_t *sequencer = track->sequencer;
+    send_batch(sequencer);
+    for (uint16_t i = 0; i < track->active_count; i++) {
+        active_note_t *active_note = &track->active_notes[i];
+        add_to_batch(sequencer, active_note->channel, active_note->midi_note, 0, 0);
+        *get_active_index(track, active_note->channel, active_note->midi_note) = 0;
+    }
+    send_batch(sequencer);
+    track->active_count = 0;
+}
+
+static void play_note(track_t *track, ysw_note_t *note, uint64_t start_time, uint64_t end_time, int next_note_index)
+{
+    ysw_sequencer_t *sequencer = track->sequencer;
+    uint8_t channel = get_channel(track, note);
+
+    if (note->program != sequencer->programs[channel]) {
+        ysw_event_program_change_t program_change = {
+            .channel = channel,
+            .program = note->program,
+            .preload = false, // requested by preload_clip before clip started
+        };
+        uint8_t owner = sequencer->program_tracks[channel];
+        if (owner != track->index && is_clip_playing(&sequencer->tracks[owner])) {
+            ESP_LOGW(TAG, "play_note track=%d, channel=%d is in use by track=%d", track->index, channel, owner);
+        }
+        send_batch(sequencer);
+        ysw_event_fire_program_change(sequencer->bus, YSW_ORIGIN_EDITOR, &program_change);
+        sequencer->programs[channel] = note->program;
+        sequencer->program_tracks[channel] = track->index;
+    }
+
+    uint32_t frame = get_note_frame(track, start_time);
+
+    if (next_note_index != -1) {
+        add_to_batch(sequencer, channel, note->midi_note, 0, frame);
+    }
+
+    add_to_batch(sequencer, channel, note->midi_note, note->velocity, frame);
+
+    active_note_t active_note = {
+        .channel = channel,
+        .midi_note = note->midi_note,
+        .end_time = end_time,
+    };
+
+    if (next_note_index != -1) {
+        update_active_note(track, next_note_index, &active_note);
     } else {
-        // middle of clip: start at current note
-        ysw_note_t *note = ysw_array_get(sequencer->clip.notes, sequencer->next_note);
-        tick = note->start;
+        add_active_note(track, &active_note);
     }
 
-    uint32_t old_elapsed_millis = t2ms(sequencer, tick);
-    uint32_t new_elapsed_millis = (100 * old_elapsed_millis) / sequencer->playback_speed;
-    sequencer->start_millis = ysw_get_millis() - new_elapsed_millis;
+    // Each status follows its note on in the batch, so there is always room
+    assert(sequencer->status_count < sequencer->batch.count);
+    sequencer->statuses[sequencer->status_count++] = *note;
+}
+
+static inline bool is_clip_present(track_t *track)
+{
+    return track->clip.notes;
+}
+
+static inline uint64_t ticks_to_micros(uint32_t ticks, uint8_t bpm)
+{
+    return ((uint64_t)ticks * MICROS_PER_MINUTE) / ((uint32_t)bpm * YSW_TICKS_PER_QUARTER_NOTE);
+}
+
+typedef struct {
+    ysw_array_t *tempos;
+    uint32_t next; // index of next tempo change
+    uint32_t tick; // tick at which current tempo took effect
+    uint8_t bpm; // current tempo
+    uint64_t time; // micros at tick
+} tempo_walker_t;
+
+// Returns the micros from tick zero to the given tick. The tick must not be less than the
+// tick in the previous call with the same walker.
+
+static uint64_t walk_to_tick(tempo_walker_t *walker, uint32_t tick)
+{
+    uint32_t tempo_count = walker->tempos ? ysw_array_get_count(walker->tempos) : 0;
+    while (walker->next < tempo_count) {
+        ysw_tempo_t *tempo = ysw_array_get(walker->tempos, walker->next);
+        if (tempo->start > tick) {
+            break;
+        }
+        assert(tempo->bpm);
+        walker->time += ticks_to_micros(tempo->start - walker->tick, walker->bpm);
+        walker->tick = tempo->start;
+        walker->bpm = tempo->bpm;
+        walker->next++;
+    }
+    return walker->time + ticks_to_micros(tick - walker->tick, walker->bpm);
 }
 
-static uint32_t get_current_playback_millis(ysw_sequencer_t *sequencer)
+// The start and end of every note are computed from the clip's tempo map once, when the
+// clip (or piece of a streamed clip) is set, so nothing but a lookup is needed to play each note
+
+static void index_notes(track_t *track)
 {
-    uint32_t current_millis = ysw_get_millis();
-    uint32_t elapsed_millis = current_millis - sequencer->start_millis;
-    uint32_t playback_millis = (elapsed_millis * sequencer->playback_speed) / 100;
-    return playback_millis;
+    ysw_event_clip_t *clip = &track->clip;
+    uint32_t note_count = ysw_notes_get_count(clip->notes);
+    track->note_times = ysw_heap_allocate(ysw_uint32_max(note_count, 1) * sizeof(note_time_t));
+
+    uint64_t clip_end = 0;
+    uint16_t max_duration = 0;
+    tempo_walker_t walker = {
+        .tempos = clip->tempos,
+        .bpm = clip->bpm,
+    };
+
+    for (uint32_t i = 0; i < note_count; i++) {
+        ysw_note_t *note = ysw_notes_get(clip->notes, i);
+        uint64_t start = walk_to_tick(&walker, note->start);
+        tempo_walker_t end_walker = walker;
+        uint64_t end = walk_to_tick(&end_walker, note->start + note->duration);
+        assert(end <= UINT32_MAX);
+        track->note_times[i] = (note_time_t ) {
+            .start = start,
+            .end = end,
+        };
+        if (end > clip_end) {
+            clip_end = end;
+        }
+        if (note->duration > max_duration) {
+            max_duration = note->duration;
+        }
+    }
+
+    track->clip_end = clip_end;
+    track->max_duration = max_duration;
 }
 
-static void play_clip(ysw_sequencer_t *sequencer, ysw_event_clip_t *new_clip)
+// A streamed clip is played a piece at a time. Each piece is an iteration of the clip that
+// is clip_end (i.e. the length of the piece) long, but has its own notes.
+
+static void set_clip(track_t *track, ysw_event_clip_t *clip)
 {
-    ESP_LOGD(TAG, "play_clip bpm=%d", new_clip->bpm);
-    if (is_clip_playing(sequencer)) {
-        release_notes(sequencer);
+    assert(clip->bpm);
+    assert(!clip->source || !clip->tempos);
+
+    track->clip = *clip;
+    track->bpm = clip->bpm;
+
+    uint32_t length = 0;
+    if (clip->source) {
+        track->clip.notes = clip->source->next(clip->source, &length);
+        assert(track->clip.notes);
+        track->next_piece = clip->source->next(clip->source, &track->next_length);
     }
-    if (is_clip_present(sequencer)) {
-        free_clip(sequencer);
+
+    index_notes(track);
+
+    if (clip->source) {
+        track->clip_end = ticks_to_micros(length, clip->bpm);
     }
-    sequencer->clip = *new_clip;
-    sequencer->next_note = 0;
-    adjust_playback_start_millis(sequencer);
 }
 
-static void pause_clip(ysw_sequencer_t *sequencer)
+static void free_clip(track_t *track)
 {
-    ESP_LOGD(TAG, "pause_clip start_millis=%d", sequencer->start_millis);
-    if (is_clip_playing(sequencer)) {
-        release_notes(sequencer);
+    if (track->clip.source) {
+        track->clip.source->free(track->clip.source); // including its current and next pieces
+        track->next_piece = NULL;
     } else {
-        // Hitting PAUSE twice is like STOP -- you restart at beginning
-        sequencer->next_note = 0;
+        ysw_notes_free(track->clip.notes);
+    }
+    if (track->clip.tempos) {
+        ysw_array_free_all(track->clip.tempos);
+    }
+    ysw_heap_free(track->note_times);
+    track->clip.notes = NULL;
+    track->clip.tempos = NULL;
+    track->clip.source = NULL;
+    track->clip.bpm = 0;
+    track->note_times = NULL;
+}
+
+// Returns the index of the first note that starts at or after tick, or the note count if none
+
+static uint32_t find_note(track_t *track, uint32_t tick)
+{
+    return ysw_notes_find_start(track->clip.notes, tick);
+}
+
+// Starts playback at tick, restarting notes that started before tick and are still sounding
+// at it (e.g. a held chord). Only notes that start within the longest note duration before
+// tick can still be sounding, so both ends of the range are found by binary search.
+
+static void seek_to(track_t *track, uint32_t tick)
+{
+    release_notes(track);
+
+    tempo_walker_t walker = {
+        .tempos = track->clip.tempos,
+        .bpm = track->clip.bpm,
+    };
+    uint64_t time = track->clip_start_time + walk_to_tick(&walker, tick);
+    set_anchor(track, time, ysw_get_millis(), get_anchor_frame(track->sequencer));
+    track->is_playing = true;
+    track->is_seek_pending = false;
+    track->is_loop_done_pending = false;
+
+    uint32_t first_sounding = find_note(track, tick > track->max_duration ? tick - track->max_duration : 0);
+    track->next_note = find_note(track, tick);
+
+    for (uint32_t i = first_sounding; i < track->next_note; i++) {
+        uint64_t end_time = track->clip_start_time + track->note_times[i].end;
+        if (end_time > time) {
+            ysw_note_t *note = ysw_notes_get(track->clip.notes, i);
+            int active_index = *get_active_index(track, get_channel(track, note), note->midi_note) - 1;
+            play_note(track, note, time, end_time, active_index);
+        }
     }
-    sequencer->start_millis = 0;
 }
 
-static void stop_clip(ysw_sequencer_t *sequencer)
+// Starts (or resumes) playback at the next note, or at tick zero at the beginning of the clip
+
+static void anchor_at_next_note(track_t *track)
 {
-    ESP_LOGD(TAG, "stop_clip start_millis=%d", sequencer->start_millis);
-    if (is_clip_playing(sequencer)) {
-        release_notes(sequencer);
+    if (track->is_seek_pending) {
+        seek_to(track, track->seek_tick);
+        return;
     }
-    if (is_clip_present(sequencer)) {
-        free_clip(sequencer);
+
+    uint64_t time = track->clip_start_time;
+    if (track->next_note && track->next_note < ysw_notes_get_count(track->clip.notes)) {
+        time += track->note_times[track->next_note].start;
     }
-    sequencer->next_note = 0;
-    sequencer->start_millis = 0;
+    set_anchor(track, time, ysw_get_millis(), get_anchor_frame(track->sequencer));
+    track->is_playing = true;
 }
 
-static void resume_clip(ysw_sequencer_t *sequencer)
+static uint8_t send_preload(ysw_sequencer_t *sequencer, ysw_event_preload_t *preload)
 {
-    ESP_LOGD(TAG, "resume_clip next_note=%d", sequencer->next_note);
-    if (is_clip_present(sequencer)) {
-        adjust_playback_start_millis(sequencer);
+    ysw_event_fire_preload(sequencer->bus, YSW_ORIGIN_SEQUENCER, preload);
+    preload->count = 0;
+    return 1;
+}
+
+// Sends each distinct channel and program in the notes to the synthesizers, so that presets
+// are loaded before the notes are played rather than when their first note is played.
+// Returns the number of preload events sent.
+
+static uint8_t send_preloads(track_t *track, ysw_notes_t *notes, uint16_t token)
+{
+    uint8_t preload_count = 0;
+    uint32_t requested[YSW_MIDI_MAX_CHANNELS][YSW_MIDI_MAX_COUNT / 32] = {};
+    ysw_event_preload_t preload = {
+        .token = token,
+    };
+
+    uint32_t note_count = ysw_notes_get_count(notes);
+    for (uint32_t i = 0; i < note_count; i++) {
+        ysw_note_t *note = ysw_notes_get(notes, i);
+        assert(note->channel < YSW_MIDI_MAX_CHANNELS);
+        assert(note->program < YSW_MIDI_MAX_COUNT);
+        uint8_t channel = get_channel(track, note);
+        uint32_t *word = &requested[channel][note->program / 32];
+        uint32_t mask = 1u << (note->program % 32);
+        if (!(*word & mask)) {
+            *word |= mask;
+            preload.programs[preload.count++] = (ysw_event_channel_program_t ) {
+                .channel = channel,
+                .program = note->program,
+            };
+            if (preload.count == YSW_EVENT_MAX_PRELOAD) {
+                preload_count += send_preload(track->sequencer, &preload);
+            }
+        }
+    }
+
+    if (preload.count) {
+        preload_count += send_preload(track->sequencer, &preload);
     }
+
+    return preload_count;
 }
 
-static void set_tempo(ysw_sequencer_t *sequencer, uint8_t bpm)
+// Token zero is reserved for preloads that the sequencer does not wait for. Tokens are
+// allocated by the sequencer, rather than by the track, so that a reply identifies the track.
+// Every responder replies to every preload, so the replies are counted per responder, and
+// the clip does not start until the slowest of them is ready. The second piece of a
+// streamed clip is preloaded with the first, because it is requested before the first ends.
+
+static void preload_clip(track_t *track)
 {
-    ESP_LOGW(TAG, "set_tempo bpm=%d", bpm);
-    sequencer->clip.bpm = bpm;
+    ysw_sequencer_t *sequencer = track->sequencer;
+    if (!++sequencer->preload_token) {
+        sequencer->preload_token++;
+    }
+    track->preload_token = sequencer->preload_token;
+    uint16_t sent = send_preloads(track, track->clip.notes, track->preload_token);
+    if (track->next_piece) {
+        sent += send_preloads(track, track->next_piece, track->preload_token);
+    }
+    track->preload_count = sent * sequencer->config.preload_responders;
+    track->preload_deadline = ysw_get_millis() + sequencer->config.preload_timeout_millis;
+    ESP_LOGD(TAG, "preload_clip track=%d, token=%d, preload_count=%d", track->index, track->preload_token,
+            track->preload_count);
 }
 
-static void set_loop(ysw_sequencer_t *sequencer, bool new_value)
+static void start_clip(track_t *track)
 {
-    sequencer->loop = new_value;
+    track->preload_count = 0;
+    anchor_at_next_note(track);
 }
 
-static void set_playback_speed(ysw_sequencer_t *sequencer, uint8_t percent)
+static void play_clip(track_t *track, ysw_event_play_t *event)
 {
-    sequencer->playback_speed = percent;
-    if (is_clip_playing(sequencer)) {
-        adjust_playback_start_millis(sequencer);
+    ESP_LOGD(TAG, "play_clip track=%d, bpm=%d", track->index, event->clip.bpm);
+    if (is_clip_playing(track)) {
+        release_notes(track);
+    }
+    if (is_clip_present(track)) {
+        free_clip(track);
+    }
+    set_clip(track, &event->clip);
+    track->channel_offset = event->channel_offset;
+    track->clip_start_time = 0;
+    track->next_note = 0;
+    track->is_seek_pending = false;
+    track->is_loop_done_pending = false;
+    track->is_playing = false;
+    track->preload_count = 0;
+    if (track->sequencer->config.preload_timeout_millis) {
+        preload_clip(track);
+    }
+    if (!is_preloading(track)) {
+        start_clip(track);
     }
 }
 
-static bool is_play_list_available(ysw_sequencer_t *sequencer)
+static void on_preload_done(ysw_sequencer_t *sequencer, ysw_event_preload_done_t *event)
 {
-    return ysw_array_get_count(sequencer->play_list);
+    for (uint8_t i = 0; i < sequencer->config.track_count; i++) {
+        track_t *track = &sequencer->tracks[i];
+        if (is_preloading(track) && event->token == track->preload_token) {
+            if (!--track->preload_count) {
+                ESP_LOGD(TAG, "on_preload_done track=%d, token=%d, starting clip", i, event->token);
+                start_clip(track);
+            }
+        }
+    }
 }
 
-static void add_clip_to_play_list(ysw_sequencer_t *sequencer, ysw_event_clip_t *clip)
+// Returns the number of ticks to wait for the preload to finish, or zero if the clip has
+// been started because it took too long
+
+static TickType_t check_preload_timeout(track_t *track)
 {
-    ysw_event_clip_t *play_list_clip = ysw_heap_allocate(sizeof(ysw_event_clip_t));
-    *play_list_clip = *clip;
-    ysw_array_push(sequencer->play_list, play_list_clip);
+    int32_t remaining_millis = track->preload_deadline - ysw_get_millis();
+    if (remaining_millis > 0) {
+        return ysw_millis_to_rtos_ticks(remaining_millis);
+    }
+    ESP_LOGW(TAG, "preload token=%d timed out, starting clip", track->preload_token);
+    start_clip(track);
+    return 0;
 }
 
-static void play_clip_from_play_list(ysw_sequencer_t *sequencer)
+static void pause_clip(track_t *track)
 {
-    ysw_event_clip_t *clip = ysw_array_remove(sequencer->play_list, 0);
-    play_clip(sequencer, clip);
-    ysw_heap_free(clip); // just the clip wrapper
+    ESP_LOGD(TAG, "pause_clip track=%d, is_playing=%d", track->index, track->is_playing);
+    if (is_clip_playing(track)) {
+        release_notes(track);
+    } else {
+        // Hitting PAUSE twice is like STOP -- you restart at beginning
+        track->next_note = 0;
+        track->is_seek_pending = false;
+    }
+    track->is_playing = false;
+    track->preload_count = 0;
 }
 
-static void clear_play_list(ysw_sequencer_t *sequencer)
+static void stop_clip(track_t *track)
 {
-    while (ysw_array_get_count(sequencer->play_list)) {
-        ysw_event_clip_t *clip = ysw_array_pop(sequencer->play_list);
-        ysw_array_free(clip->notes);
-        ysw_heap_free(clip);
+    ESP_LOGD(TAG, "stop_clip track=%d, is_playing=%d", track->index, track->is_playing);
+    if (is_clip_playing(track)) {
+        release_notes(track);
     }
+    if (is_clip_present(track)) {
+        free_clip(track);
+    }
+    track->next_note = 0;
+    track->is_seek_pending = false;
+    track->is_loop_done_pending = false;
+    track->is_playing = false;
+    track->preload_count = 0;
 }
 
-static void on_play(ysw_sequencer_t *sequencer, ysw_event_play_t *event)
+static void resume_clip(track_t *track)
 {
-    if (event->type == YSW_EVENT_PLAY_NOW || !is_clip_playing(sequencer)) {
-        play_clip(sequencer, &event->clip);
+    ESP_LOGD(TAG, "resume_clip track=%d, next_note=%d", track->index, track->next_note);
+    if (is_clip_present(track) && !is_preloading(track)) {
+        anchor_at_next_note(track);
+    }
+}
+
+// A seek while stopped, paused or preloading takes effect when playback starts or resumes
+
+static void seek_clip(track_t *track, uint32_t tick)
+{
+    ESP_LOGD(TAG, "seek_clip track=%d, tick=%d", track->index, tick);
+    if (!is_clip_present(track)) {
+        return;
+    }
+    if (track->clip.source) {
+        ESP_LOGW(TAG, "seek_clip track=%d, streamed clips do not support seek", track->index);
+        return;
+    }
+    if (is_clip_playing(track)) {
+        seek_to(track, tick);
     } else {
-        if (event->type == YSW_EVENT_PLAY_STAGE) {
-            clear_play_list(sequencer);
+        track->next_note = find_note(track, tick);
+        track->seek_tick = tick;
+        track->is_seek_pending = true;
+    }
+}
+
+// A tempo change scales the clip's tempo map, so that its tempo at tick zero becomes bpm
+
+static void set_tempo(track_t *track, uint8_t bpm)
+{
+    ESP_LOGD(TAG, "set_tempo track=%d, bpm=%d", track->index, bpm);
+    assert(bpm);
+    if (is_clip_present(track)) {
+        if (is_clip_playing(track)) {
+            reanchor(track);
         }
-        add_clip_to_play_list(sequencer, &event->clip);
+        track->bpm = bpm;
     }
 }
 
-static void play_note(ysw_sequencer_t *sequencer, ysw_note_t *note, int next_note_index)
+static void set_loop(track_t *track, bool new_value)
 {
-    if (note->program != sequencer->programs[note->channel]) {
-        ysw_event_program_change_t program_change = {
-            .channel = note->channel,
-            .program = note->program,
-            .preload = false, // TODO: before starting playback, scan song and preload all programs
-        };
-        ysw_event_fire_program_change(sequencer->bus, YSW_ORIGIN_EDITOR, &program_change);
-        sequencer->programs[note->channel] = note->program;
+    track->loop = new_value;
+}
+
+static void set_playback_speed(track_t *track, uint8_t percent)
+{
+    assert(percent);
+    if (is_clip_playing(track)) {
+        reanchor(track);
     }
+    track->playback_speed = percent;
+}
 
-    if (next_note_index != -1) {
-        ysw_event_note_off_t note_off = {
-            .channel = note->channel,
-            .midi_note = note->midi_note,
-        };
-        ysw_event_fire_note_off(sequencer->bus, YSW_ORIGIN_SEQUENCER, &note_off);
-    } else {
-        if (sequencer->active_count < MAX_POLYPHONY) {
-            next_note_index = sequencer->active_count++;
+static bool is_play_list_available(track_t *track)
+{
+    return ysw_array_get_count(track->play_list);
+}
+
+// Clips on the play list are preloaded when they are added, without waiting, so they are
+// ready to follow the current clip without a gap
+
+static void add_clip_to_play_list(track_t *track, ysw_event_clip_t *clip)
+{
+    ysw_event_clip_t *play_list_clip = ysw_heap_allocate(sizeof(ysw_event_clip_t));
+    *play_list_clip = *clip;
+    ysw_array_push(track->play_list, play_list_clip);
+    if (track->sequencer->config.preload_timeout_millis && play_list_clip->notes) {
+        send_preloads(track, play_list_clip->notes, 0);
+    }
+}
+
+// Once every note in the current iteration has been started, the next iteration (or the
+// next clip on the play list) is scheduled to start where this one ends, while its last
+// notes are still sounding, so there is no gap or change of tempo between them
+
+static void advance_clip_start(track_t *track)
+{
+    track->clip_start_time += track->clip_end;
+    track->next_note = 0;
+}
+
+// A streamed clip holds its current piece and the one after it. Once every note in the
+// current piece has been started, the next piece becomes current, and the piece after it
+// is requested and preloaded, a whole piece ahead of its first note. Returns false at the
+// end of the stream.
+
+static bool continue_with_source(track_t *track)
+{
+    if (!track->next_piece) {
+        return false;
+    }
+    advance_clip_start(track);
+    ysw_heap_free(track->note_times);
+    track->clip.notes = track->next_piece;
+    index_notes(track);
+    track->clip_end = ticks_to_micros(track->next_length, track->clip.bpm);
+    track->next_piece = track->clip.source->next(track->clip.source, &track->next_length);
+    if (track->next_piece && track->sequencer->config.preload_timeout_millis) {
+        send_preloads(track, track->next_piece, 0);
+    }
+    return true;
+}
+
+// A tempo change does not carry over to the next clip, which plays at its own tempo
+
+static void continue_with_play_list(track_t *track)
+{
+    advance_clip_start(track);
+    if (track->bpm != track->clip.bpm) {
+        reanchor(track);
+    }
+    free_clip(track);
+    ysw_event_clip_t *clip = ysw_array_remove(track->play_list, 0);
+    set_clip(track, clip);
+    ysw_heap_free(clip); // just the clip wrapper
+}
+
+static void clear_play_list(track_t *track)
+{
+    while (ysw_array_get_count(track->play_list)) {
+        ysw_event_clip_t *clip = ysw_array_pop(track->play_list);
+        if (clip->source) {
+            clip->source->free(clip->source);
+        } else {
+            ysw_notes_free(clip->notes);
+        }
+        if (clip->tempos) {
+            ysw_array_free_all(clip->tempos);
         }
+        ysw_heap_free(clip);
     }
+}
 
-    if (next_note_index != -1) {
-        ysw_event_note_on_t note_on = {
-            .channel = note->channel,
-            .midi_note = note->midi_note,
-            .velocity = note->velocity,
-        };
-        ysw_event_fire_note_on(sequencer->bus, YSW_ORIGIN_SEQUENCER, &note_on);
-        sequencer->active_notes[next_note_index].channel = note->channel;
-        sequencer->active_notes[next_note_index].midi_note = note->midi_note;
-        sequencer->active_notes[next_note_index].end_time =
-            t2ms(sequencer, note->start) + t2ms(sequencer, note->duration);
-        ysw_event_fire_note_status(sequencer->bus, note);
+static void on_play(track_t *track, ysw_event_play_t *event)
+{
+    if (event->type == YSW_EVENT_PLAY_NOW || (!is_clip_playing(track) && !is_preloading(track))) {
+        play_clip(track, event);
     } else {
-        ESP_LOGE(TAG, "Maximum polyphony exceeded, active_count=%d", sequencer->active_count);
+        if (event->type == YSW_EVENT_PLAY_STAGE) {
+            clear_play_list(track);
+        }
+        add_clip_to_play_list(track, &event->clip);
     }
 }
 
-static TickType_t process_notes(ysw_sequencer_t *sequencer)
+static TickType_t process_notes(track_t *track)
 {
+    ysw_sequencer_t *sequencer = track->sequencer;
     TickType_t ticks_to_wait = portMAX_DELAY;
-    uint32_t playback_millis = get_current_playback_millis(sequencer);
+    uint64_t playback_time = get_playback_time(track);
 
     ysw_note_t *note;
-    if (sequencer->next_note < ysw_array_get_count(sequencer->clip.notes)) {
-        note = ysw_array_get(sequencer->clip.notes, sequencer->next_note);
+    note_time_t *note_time;
+    if (track->next_note < ysw_notes_get_count(track->clip.notes)) {
+        note = ysw_notes_get(track->clip.notes, track->next_note);
+        note_time = &track->note_times[track->next_note];
     } else {
         note = NULL;
+        note_time = NULL;
     }
 
-    int next_note_index = -1;
-    active_note_t *next_note_to_end = NULL;
+    while (track->active_count && track->active_notes[0].end_time <= playback_time) {
+        active_note_t *active_note = &track->active_notes[0];
+        uint32_t frame = get_note_frame(track, active_note->end_time);
+        add_to_batch(sequencer, active_note->channel, active_note->midi_note, 0, frame);
+        remove_first_active_note(track);
+    }
 
-    uint8_t index = 0;
-    while (index < sequencer->active_count) {
-        active_note_t *active_note = &sequencer->active_notes[index];
-        if (active_note->end_time <= playback_millis) {
-            ysw_event_note_off_t note_off = {
-                .channel = active_note->channel,
-                .midi_note = active_note->midi_note,
-            };
-            ysw_event_fire_note_off(sequencer->bus, YSW_ORIGIN_SEQUENCER, &note_off);
-            if (index + 1 < sequencer->active_count) {
-                // replaced expired note with last one in array
-                sequencer->active_notes[index] = sequencer->active_notes[sequencer->active_count - 1];
-            }
-            // free last member of array
-            sequencer->active_count--;
-        } else {
-            if (next_note_to_end) {
-                if (active_note->end_time < next_note_to_end->end_time) {
-                    next_note_to_end = active_note;
-                }
-            } else {
-                next_note_to_end = active_note;
-            }
-            if (note) {
-                if (note->channel == active_note->channel &&
-                        // TODO: consider if active_note is transposed by play_note
-                        note->midi_note == active_note->midi_note) {
-                    next_note_index = index;
-                }
-            }
-            // only increment if we didn't replace an expired note
-            index++;
-        }
+    if (track->is_loop_done_pending && track->clip_start_time <= playback_time) {
+        track->is_loop_done_pending = false;
+        send_batch(sequencer);
+        ysw_event_fire_loop_done(sequencer->bus, track->index);
     }
 
+    active_note_t *next_note_to_end = track->active_count ? &track->active_notes[0] : NULL;
+
+    int next_note_index = note ? *get_active_index(track, get_channel(track, note), note->midi_note) - 1 : -1;
+
     if (note) {
-        uint32_t note_start_time = t2ms(sequencer, note->start);
-        if (note_start_time <= playback_millis) {
-            play_note(sequencer, note, next_note_index);
-            sequencer->next_note++;
+        uint64_t note_start_time = track->clip_start_time + note_time->start;
+        if (note_start_time <= playback_time) {
+            uint64_t note_end_time = track->clip_start_time + note_time->end;
+            play_note(track, note, note_start_time, note_end_time, next_note_index);
+            track->next_note++;
             ticks_to_wait = 0;
         } else {
-            long time_of_next_event;
+            uint64_t time_of_next_event;
             if (next_note_to_end && (next_note_to_end->end_time < note_start_time)) {
                 time_of_next_event = next_note_to_end->end_time;
             } else {
                 time_of_next_event = note_start_time;
             }
-            uint32_t delay_millis = time_of_next_event - playback_millis;
-            ticks_to_wait = ysw_millis_to_rtos_ticks(delay_millis);
+            if (track->is_loop_done_pending && track->clip_start_time < time_of_next_event) {
+                time_of_next_event = track->clip_start_time;
+            }
+            ticks_to_wait = get_ticks_to_wait(track, time_of_next_event - playback_time);
         }
+    } else if (track->clip.source && continue_with_source(track)) {
+        ESP_LOGD(TAG, "track %d piece complete, continuing with next piece", track->index);
+        ticks_to_wait = 0;
+    } else if (track->loop && track->clip_end && !track->clip.source) {
+        ESP_LOGD(TAG, "track %d loop complete, scheduling next iteration", track->index);
+        advance_clip_start(track);
+        track->is_loop_done_pending = true;
+        ticks_to_wait = 0;
+    } else if (is_play_list_available(track)) {
+        ESP_LOGD(TAG, "track %d clip complete, scheduling next from play_list", track->index);
+        continue_with_play_list(track);
+        ticks_to_wait = 0;
+    } else if (next_note_to_end) {
+        ESP_LOGD(TAG, "track %d song complete, waiting for notes to end", track->index);
+        ticks_to_wait = get_ticks_to_wait(track, next_note_to_end->end_time - playback_time);
     } else {
-        if (next_note_to_end) {
-            ESP_LOGD(TAG, "song complete, waiting for notes to end");
-            uint32_t delay_millis = next_note_to_end->end_time - playback_millis;
-            ticks_to_wait = ysw_millis_to_rtos_ticks(delay_millis);
-        } else if (sequencer->loop) {
-            ESP_LOGD(TAG, "loop complete, looping to start");
-            ysw_event_fire_loop_done(sequencer->bus);
-            sequencer->next_note = 0;
-            resume_clip(sequencer);
-            ticks_to_wait = 0;
-        } else if (is_play_list_available(sequencer)) {
-            ESP_LOGD(TAG, "playback complete, playing next from play_list");
-            play_clip_from_play_list(sequencer);
-            ticks_to_wait = 0;
-        } else {
-            ESP_LOGD(TAG, "playback complete, nothing more to do");
-            sequencer->next_note = 0;
-            sequencer->start_millis = 0;
-            ysw_event_fire_play_done(sequencer->bus);
-        }
+        ESP_LOGD(TAG, "track %d playback complete, nothing more to do", track->index);
+        track->next_note = 0;
+        track->is_playing = false;
+        send_batch(sequencer);
+        ysw_event_fire_play_done(sequencer->bus, track->index);
     }
 
     return ticks_to_wait;
 }
 
+// Returns the track that a playback event applies to, or -1 if it does not apply to a track
+
+static int get_event_track(ysw_event_t *event)
+{
+    switch (event->header.type) {
+        case YSW_EVENT_PLAY:
+            return event->play.track;
+        case YSW_EVENT_PAUSE:
+        case YSW_EVENT_RESUME:
+        case YSW_EVENT_STOP:
+            return event->transport.track;
+        case YSW_EVENT_TEMPO:
+            return event->tempo.track;
+        case YSW_EVENT_LOOP:
+            return event->loop.track;
+        case YSW_EVENT_SPEED:
+            return event->speed.track;
+        case YSW_EVENT_SEEK:
+            return event->seek.track;
+        default:
+            return -1;
+    }
+}
+
+static void process_track_event(track_t *track, ysw_event_t *event)
+{
+    switch (event->header.type) {
+        case YSW_EVENT_PLAY:
+            on_play(track, &event->play);
+            break;
+        case YSW_EVENT_PAUSE:
+            pause_clip(track);
+            break;
+        case YSW_EVENT_RESUME:
+            resume_clip(track);
+            break;
+        case YSW_EVENT_STOP:
+            stop_clip(track);
+            break;
+        case YSW_EVENT_TEMPO:
+            set_tempo(track, event->tempo.bpm);
+            break;
+        case YSW_EVENT_LOOP:
+            set_loop(track, event->loop.loop);
+            break;
+        case YSW_EVENT_SPEED:
+            set_playback_speed(track, event->speed.percent);
+            break;
+        case YSW_EVENT_SEEK:
+            seek_clip(track, event->seek.tick);
+            break;
+        default:
+            break;
+    }
+}
+
 static void process_event(void *context, ysw_event_t *event)
 {
     ysw_sequencer_t *sequencer = context;
     if (event) {
-        switch (event->header.type) {
-            case YSW_EVENT_PLAY:
-                on_play(sequencer, &event->play);
-                break;
-            case YSW_EVENT_PAUSE:
-                pause_clip(sequencer);
-                break;
-            case YSW_EVENT_RESUME:
-                resume_clip(sequencer);
-                break;
-            case YSW_EVENT_STOP:
-                stop_clip(sequencer);
-                break;
-            case YSW_EVENT_TEMPO:
-                set_tempo(sequencer, event->tempo.bpm);
-                break;
-            case YSW_EVENT_LOOP:
-                set_loop(sequencer, event->loop.loop);
-                break;
-            case YSW_EVENT_SPEED:
-                set_playback_speed(sequencer, event->speed.percent);
-                break;
-            default:
-                break;
+        int track_index = get_event_track(event);
+        if (track_index >= sequencer->config.track_count) {
+            ESP_LOGW(TAG, "event type=%d for invalid track=%d", event->header.type, track_index);
+        } else if (track_index != -1) {
+            process_track_event(&sequencer->tracks[track_index], event);
+        } else if (event->header.type == YSW_EVENT_PRELOAD_DONE) {
+            on_preload_done(sequencer, &event->preload_done);
         }
     }
+
+    // The sequencer waits until the earliest time that any track has something to do
+
+    bool is_active = false;
     TickType_t ticks_to_wait = portMAX_DELAY;
-    if (is_clip_playing(sequencer)) {
-        ticks_to_wait = process_notes(sequencer);
+    for (uint8_t i = 0; i < sequencer->config.track_count; i++) {
+        track_t *track = &sequencer->tracks[i];
+        if (is_preloading(track)) {
+            ticks_to_wait = ysw_uint32_min(ticks_to_wait, check_preload_timeout(track));
+        }
+        if (is_clip_playing(track)) {
+            is_active = true;
+            ticks_to_wait = ysw_uint32_min(ticks_to_wait, process_notes(track));
+        }
+    }
+    if (is_active) {
+        if (ticks_to_wait) {
+            send_batch(sequencer);
+        }
         if (ticks_to_wait == portMAX_DELAY) {
             ESP_LOGD(TAG, "sequencer idle");
             ysw_event_fire_idle(sequencer->bus);
@@ -380,23 +1020,46 @@ static void process_event(void *context, ysw_event_t *event)
     ysw_task_set_wait_millis(sequencer->task, ticks_to_wait);
 }
 
-void ysw_sequencer_create_task(ysw_bus_t *bus)
+const ysw_sequencer_config_t ysw_sequencer_default_config = {
+    .lookahead_millis = YSW_SEQUENCER_LOOKAHEAD_DEFAULT,
+    .preload_timeout_millis = YSW_SEQUENCER_PRELOAD_TIMEOUT_DEFAULT,
+    .preload_responders = YSW_SEQUENCER_PRELOAD_RESPONDERS_DEFAULT,
+    .track_count = YSW_SEQUENCER_TRACKS_DEFAULT,
+};
+
+void ysw_sequencer_create_task(ysw_bus_t *bus, const ysw_sequencer_config_t *config)
 {
+    assert(config);
+    assert(!config->get_frame || config->sample_rate);
+    assert(config->track_count);
+    assert(!config->preload_timeout_millis || config->preload_responders);
+
     ysw_sequencer_t *sequencer = ysw_heap_allocate(sizeof(ysw_sequencer_t));
 
     sequencer->bus = bus;
-    sequencer->play_list = ysw_array_create(4);
-    sequencer->playback_speed = YSW_SEQUENCER_SPEED_DEFAULT;
+    sequencer->config = *config;
+    sequencer->tracks = ysw_heap_allocate(config->track_count * sizeof(track_t));
+
+    for (uint8_t i = 0; i < config->track_count; i++) {
+        track_t *track = &sequencer->tracks[i];
+        track->sequencer = sequencer;
+        track->index = i;
+        track->play_list = ysw_array_create(4);
+        track->active_size = INITIAL_ACTIVE_SIZE;
+        track->active_notes = ysw_heap_allocate(INITIAL_ACTIVE_SIZE * sizeof(active_note_t));
+        track->active_indexes = ysw_heap_allocate(YSW_MIDI_MAX_CHANNELS * YSW_MIDI_MAX_COUNT * sizeof(uint16_t));
+        track->playback_speed = YSW_SEQUENCER_SPEED_DEFAULT;
+    }
 
-    ysw_task_config_t config = ysw_task_default_config;
+    ysw_task_config_t task_config = ysw_task_default_config;
 
-    config.name = TAG;
-    config.bus = bus;
-    config.task = &sequencer->task;
-    config.event_handler = process_event;
-    config.context = sequencer;
+    task_config.name = TAG;
+    task_config.bus = bus;
+    task_config.task = &sequencer->task;
+    task_config.event_handler = process_event;
+    task_config.context = sequencer;
 
-    ysw_task_create(&config);
+    ysw_task_create(&task_config);
     ysw_task_subscribe(sequencer->task, YSW_ORIGIN_COMMAND);
+    ysw_task_subscribe(sequencer->task, YSW_ORIGIN_SYNTH);
 }
-
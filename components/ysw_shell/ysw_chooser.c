@@ -100,7 +100,7 @@ static int32_t update_sections(ysw_chooser_t *chooser, zm_section_t *target)
     for (zm_section_x i = 0, data_row = 1; i < section_count; i++, data_row++) {
         char buffer[32];
         zm_section_t *section = ysw_array_get(chooser->music->sections, i);
-        zm_step_x step_count = ysw_array_get_count(section->steps);
+        zm_step_x step_count = zm_get_step_count(section);
         zm_time_x age = chooser->music->settings.clock - section->tlm;
         lv_table_set_cell_align(chooser->table, data_row, 0, LV_LABEL_ALIGN_CENTER);
         lv_table_set_cell_align(chooser->table, data_row, 1, LV_LABEL_ALIGN_CENTER);
@@ -126,8 +126,8 @@ static int compare_sections_by_size(const void *left, const void *right)
 {
     const zm_section_t *left_section = *(zm_section_t * const *)left;
     const zm_section_t *right_section = *(zm_section_t * const *)right;
-    zm_section_x left_size = ysw_array_get_count(left_section->steps);
-    zm_section_x right_size = ysw_array_get_count(right_section->steps);
+    zm_section_x left_size = zm_get_step_count(left_section);
+    zm_section_x right_size = zm_get_step_count(right_section);
     return left_size - right_size;
 }
 
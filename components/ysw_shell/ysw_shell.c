@@ -104,6 +104,7 @@ static void copy_section(ysw_shell_t *shell, zm_section_t *section)
     ysw_name_create_new_version(section->name, new_name, sizeof(new_name),
             100, shell->music, check_duplicate_section_name);
 
+    zm_load_section(shell->music, section);
     zm_section_t *new_section = zm_create_duplicate_section(section);
     zm_rename_section(new_section, new_name);
     zm_section_x section_x = ysw_array_find(shell->music->sections, section);
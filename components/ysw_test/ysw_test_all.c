@@ -24,5 +24,19 @@ void ysw_test_all()
 
     void ysw_test_ysw_make_label(void);
     ysw_test_ysw_make_label();
-}
 
+    void ysw_test_zm_recalculate_section_from(void);
+    ysw_test_zm_recalculate_section_from();
+
+    void ysw_test_ysw_array_search(void);
+    ysw_test_ysw_array_search();
+
+    void ysw_test_ysw_notes_merge(void);
+    ysw_test_ysw_notes_merge();
+
+    void ysw_test_zm_image_round_trip(void);
+    ysw_test_zm_image_round_trip();
+
+    void ysw_test_ysw_sequencer_tempo_change(void);
+    ysw_test_ysw_sequencer_tempo_change();
+}
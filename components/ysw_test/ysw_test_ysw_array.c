@@ -0,0 +1,66 @@
+// Copyright 2020 Anthony F. Stuart - All rights reserved.
+//
+// This program and the accompanying materials are made available
+// under the terms of the GNU General Public License. For other license
+// options please contact the copyright owner.
+//
+// This program is made available on an "as is" basis, without
+// warranties or conditions of any kind, either express or implied.
+
+#include "ysw_array.h"
+#include "esp_log.h"
+#include "assert.h"
+#include "stdint.h"
+
+#define TAG "YSW_TEST_ARRAY"
+
+static int compare_values(const void *left, const void *right)
+{
+    intptr_t left_value = (intptr_t)*(void * const *)left;
+    intptr_t right_value = (intptr_t)*(void * const *)right;
+    return left_value < right_value ? -1 : left_value > right_value ? 1 : 0;
+}
+
+static int32_t search(ysw_array_t *array, intptr_t value, ysw_array_match_t match_type)
+{
+    int32_t index = ysw_array_search(array, (void *)value, compare_values, match_type);
+    ESP_LOGD(TAG, "value=%d, match_type=%d, index=%d", (int)value, match_type, index);
+    return index;
+}
+
+void ysw_test_ysw_array_search(void)
+{
+    // 10 20 20 20 30
+    ysw_array_t *array = ysw_array_create(8);
+    ysw_array_push(array, (void *)10);
+    ysw_array_push(array, (void *)20);
+    ysw_array_push(array, (void *)20);
+    ysw_array_push(array, (void *)20);
+    ysw_array_push(array, (void *)30);
+
+    assert(search(array, 10, YSW_ARRAY_MATCH_EXACT) == 0);
+    assert(search(array, 30, YSW_ARRAY_MATCH_EXACT) == 4);
+    assert(search(array, 20, YSW_ARRAY_MATCH_LOWEST_INDEX) == 1);
+    assert(search(array, 20, YSW_ARRAY_MATCH_HIGHEST_INDEX) == 3);
+    assert(search(array, 25, YSW_ARRAY_MATCH_EXACT) == -1);
+
+    // FLOOR is the last element less than the needle, CEIL is the first element greater
+    assert(search(array, 25, YSW_ARRAY_MATCH_FLOOR) == 3);
+    assert(search(array, 25, YSW_ARRAY_MATCH_CEIL) == 4);
+    assert(search(array, 15, YSW_ARRAY_MATCH_FLOOR) == 0);
+    assert(search(array, 15, YSW_ARRAY_MATCH_CEIL) == 1);
+    assert(search(array, 5, YSW_ARRAY_MATCH_FLOOR) == -1);
+    assert(search(array, 5, YSW_ARRAY_MATCH_CEIL) == 0);
+    assert(search(array, 35, YSW_ARRAY_MATCH_FLOOR) == 4);
+    assert(search(array, 35, YSW_ARRAY_MATCH_CEIL) == -1);
+
+    // An exact match takes precedence over FLOOR and CEIL
+    assert(search(array, 20, YSW_ARRAY_MATCH_FLOOR | YSW_ARRAY_MATCH_LOWEST_INDEX) == 1);
+    assert(search(array, 20, YSW_ARRAY_MATCH_CEIL | YSW_ARRAY_MATCH_HIGHEST_INDEX) == 3);
+
+    ysw_array_set_count(array, 0);
+    assert(search(array, 20, YSW_ARRAY_MATCH_FLOOR) == -1);
+    assert(search(array, 20, YSW_ARRAY_MATCH_CEIL) == -1);
+
+    ysw_array_free(array);
+}
@@ -0,0 +1,79 @@
+// Copyright 2020 Anthony F. Stuart - All rights reserved.
+//
+// This program and the accompanying materials are made available
+// under the terms of the GNU General Public License. For other license
+// options please contact the copyright owner.
+//
+// This program is made available on an "as is" basis, without
+// warranties or conditions of any kind, either express or implied.
+
+#include "ysw_note.h"
+#include "esp_log.h"
+#include "assert.h"
+#include "stdint.h"
+
+#define TAG "YSW_TEST_NOTE"
+
+static int compare_starts(const void *left, const void *right)
+{
+    const ysw_note_t *left_note = left;
+    const ysw_note_t *right_note = right;
+    return (int)left_note->start - (int)right_note->start;
+}
+
+static void add_note(ysw_notes_t *notes, uint32_t start)
+{
+    ysw_note_t *note = ysw_notes_add(notes);
+    note->start = start;
+    note->duration = 1;
+    note->midi_note = 60;
+    note->velocity = 80;
+}
+
+void ysw_test_ysw_notes_merge(void)
+{
+    // Runs: [0, 100, 200], [50, 150], [] (empty), [300, 120, 10] (final run, unsorted)
+    static const uint32_t starts[] = { 0, 100, 200, 50, 150, 300, 120, 10 };
+    static const uint32_t expected[] = { 0, 10, 50, 100, 120, 150, 200, 300 };
+
+    ysw_notes_t *notes = ysw_notes_create(4);
+    for (int i = 0; i < sizeof(starts) / sizeof(starts[0]); i++) {
+        add_note(notes, starts[i]);
+    }
+
+    ysw_array_t *run_ends = ysw_array_create(4);
+    ysw_array_push(run_ends, (void *)3);
+    ysw_array_push(run_ends, (void *)5);
+    ysw_array_push(run_ends, (void *)5);
+
+    ysw_notes_merge(notes, run_ends, compare_starts);
+    assert(ysw_notes_get_count(notes) == sizeof(expected) / sizeof(expected[0]));
+    for (int i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+        ESP_LOGD(TAG, "i=%d, start=%d", i, ysw_notes_get(notes, i)->start);
+        assert(ysw_notes_get(notes, i)->start == expected[i]);
+    }
+
+    // Many runs, compared with a full sort
+    ysw_notes_t *sorted = ysw_notes_create(4);
+    ysw_notes_clear(notes);
+    ysw_array_set_count(run_ends, 0);
+    for (uint32_t i = 0; i < 500; i++) {
+        if (i % 37 == 0) {
+            ysw_array_push(run_ends, (void *)(intptr_t)ysw_notes_get_count(notes));
+        }
+        uint32_t start = (i * 7919) % 1000;
+        add_note(notes, start);
+        add_note(sorted, start);
+    }
+
+    ysw_notes_merge(notes, run_ends, compare_starts);
+    ysw_notes_sort(sorted, compare_starts);
+    assert(ysw_notes_get_count(notes) == ysw_notes_get_count(sorted));
+    for (uint32_t i = 0; i < ysw_notes_get_count(sorted); i++) {
+        assert(ysw_notes_get(notes, i)->start == ysw_notes_get(sorted, i)->start);
+    }
+
+    ysw_array_free(run_ends);
+    ysw_notes_free(notes);
+    ysw_notes_free(sorted);
+}
@@ -0,0 +1,157 @@
+// Copyright 2020 Anthony F. Stuart - All rights reserved.
+//
+// This program and the accompanying materials are made available
+// under the terms of the GNU General Public License. For other license
+// options please contact the copyright owner.
+//
+// This program is made available on an "as is" basis, without
+// warranties or conditions of any kind, either express or implied.
+
+#include "ysw_sequencer.h"
+#include "ysw_event.h"
+#include "ysw_heap.h"
+#include "ysw_task.h"
+#include "ysw_tempo.h"
+#include "ysw_ticks.h"
+#include "zm_music.h"
+#include "esp_log.h"
+#include "assert.h"
+#include "stdlib.h"
+#include "unistd.h"
+
+#define TAG "YSW_TEST_SEQUENCER"
+
+#define SAMPLE_RATE 48000
+#define MAX_NOTE_ONS 32
+
+static uint32_t note_on_frames[MAX_NOTE_ONS];
+static volatile uint32_t note_on_count;
+static volatile bool is_done;
+
+static uint32_t get_frame(void *context)
+{
+    return ysw_get_millis() * (SAMPLE_RATE / 1000);
+}
+
+static void on_sequencer_event(void *context, ysw_event_t *event)
+{
+    if (!event) {
+        return;
+    }
+    if (event->header.type == YSW_EVENT_NOTE_BATCH) {
+        for (uint8_t i = 0; i < event->note_batch.count; i++) {
+            if (event->note_batch.notes[i].velocity && note_on_count < MAX_NOTE_ONS) {
+                note_on_frames[note_on_count++] = event->note_batch.frame;
+            }
+        }
+    } else if (event->header.type == YSW_EVENT_PLAY_DONE) {
+        is_done = true;
+    }
+}
+
+static zm_section_t *create_section(zm_tempo_x tempo, zm_note_t first_note)
+{
+    zm_section_t *section = zm_create_section(NULL);
+    section->tempo = tempo;
+    for (zm_step_x i = 0; i < 4; i++) {
+        zm_step_t *step = ysw_heap_allocate(sizeof(zm_step_t));
+        step->melody.note = first_note + i;
+        step->melody.duration = ZM_QUARTER;
+        ysw_array_push(section->steps, step);
+    }
+    zm_recalculate_section(section);
+    return section;
+}
+
+static void add_part(zm_composition_t *composition, zm_section_t *section, zm_when_type_t type,
+        zm_medium_t part_index)
+{
+    zm_part_t *part = ysw_heap_allocate(sizeof(zm_part_t));
+    part->section = section;
+    part->percent_volume = 100;
+    part->when.type = type;
+    part->when.part_index = part_index;
+    part->fit = ZM_FIT_ONCE;
+    ysw_array_push(composition->parts, part);
+}
+
+// Returns the frames from tick zero to tick, following a single tempo change
+
+static uint32_t get_expected_frames(uint32_t tick, uint8_t bpm, ysw_tempo_t *tempo)
+{
+    uint64_t micros = 0;
+    if (tick > tempo->start) {
+        micros += ((uint64_t)tempo->start * 60000000) / (bpm * YSW_TICKS_PER_QUARTER_NOTE);
+        micros += ((uint64_t)(tick - tempo->start) * 60000000) / (tempo->bpm * YSW_TICKS_PER_QUARTER_NOTE);
+    } else {
+        micros += ((uint64_t)tick * 60000000) / (bpm * YSW_TICKS_PER_QUARTER_NOTE);
+    }
+    return (micros * SAMPLE_RATE) / 1000000;
+}
+
+// Plays a composition whose second section is twice as fast as its first, and checks that
+// each note starts at the frame given by the composition's tempo map
+
+void ysw_test_ysw_sequencer_tempo_change(void)
+{
+    zm_section_t *slow = create_section(60, 60);
+    zm_section_t *fast = create_section(120, 72);
+    zm_composition_t *composition = ysw_heap_allocate(sizeof(zm_composition_t));
+    composition->bpm = 120;
+    composition->parts = ysw_array_create(2);
+    add_part(composition, slow, ZM_WHEN_TYPE_AFTER, 0);
+    add_part(composition, fast, ZM_WHEN_TYPE_AFTER, 0);
+
+    ysw_array_t *tempos = zm_get_composition_tempos(NULL, composition);
+    assert(tempos);
+    assert(ysw_array_get_count(tempos) == 1);
+    ysw_tempo_t tempo = *(ysw_tempo_t *)ysw_array_get(tempos, 0);
+    assert(tempo.start == 4 * ZM_QUARTER);
+    assert(tempo.bpm == 240);
+
+    ysw_notes_t *notes = zm_render_composition(NULL, composition, 0);
+    uint32_t note_count = ysw_notes_get_count(notes);
+    assert(note_count == 8);
+    uint32_t starts[8];
+    for (uint32_t i = 0; i < note_count; i++) {
+        starts[i] = ysw_notes_get(notes, i)->start;
+    }
+
+    ysw_bus_t *bus = ysw_event_create_bus();
+    ysw_sequencer_config_t config = ysw_sequencer_default_config;
+    config.get_frame = get_frame;
+    config.sample_rate = SAMPLE_RATE;
+    config.preload_timeout_millis = 0;
+    ysw_sequencer_create_task(bus, &config);
+
+    ysw_task_config_t task_config = ysw_task_default_config;
+    task_config.name = TAG;
+    task_config.bus = bus;
+    task_config.event_handler = on_sequencer_event;
+    ysw_task_t *task = ysw_task_create(&task_config);
+    ysw_task_subscribe(task, YSW_ORIGIN_SEQUENCER);
+
+    ysw_event_clip_t clip = {
+        .notes = notes,
+        .tempos = tempos,
+        .bpm = composition->bpm,
+    };
+    ysw_event_fire_play_clip(bus, 0, &clip);
+    for (uint32_t i = 0; i < 100 && !is_done; i++) {
+        usleep(100000);
+    }
+
+    assert(is_done);
+    assert(note_on_count == note_count);
+    for (uint32_t i = 0; i < note_count; i++) {
+        int32_t expected = get_expected_frames(starts[i], composition->bpm, &tempo);
+        int32_t actual = note_on_frames[i] - note_on_frames[0];
+        ESP_LOGD(TAG, "note=%d, start=%d, expected=%d, actual=%d", i, starts[i], expected, actual);
+        assert(abs(actual - expected) <= 1);
+    }
+
+    ysw_array_free_all(composition->parts);
+    ysw_heap_free(composition);
+    zm_section_free(slow);
+    zm_section_free(fast);
+}
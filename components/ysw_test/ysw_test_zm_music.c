@@ -8,6 +8,12 @@
 // warranties or conditions of any kind, either express or implied.
 
 #include "zm_music.h"
+#include "zm_image.h"
+#include "ysw_heap.h"
+#include "esp_log.h"
+#include "assert.h"
+#include "string.h"
+#include "unistd.h"
 
 #define TAG "YSW_TEST_ZM"
 
@@ -15,3 +21,155 @@ void ysw_test_zm_generate_scales(void)
 {
     zm_generate_scales();
 }
+
+static void insert_step(zm_section_t *section, zm_step_x index, uint32_t seed)
+{
+    static const zm_duration_t durations[] = {
+        ZM_SIXTEENTH, ZM_EIGHTH, ZM_QUARTER, ZM_DOTTED_QUARTER, ZM_HALF, ZM_DOTTED_HALF, ZM_WHOLE,
+    };
+    zm_step_t *step = ysw_heap_allocate(sizeof(zm_step_t));
+    if (seed % 7 == 3) {
+        step->chord.root = 60;
+        step->chord.frequency = ZM_ONE_PER_MEASURE + (seed % 4);
+    } else {
+        step->melody.note = 60 + (seed % 12);
+        step->melody.duration = durations[seed % (sizeof(durations) / sizeof(durations[0]))];
+    }
+    ysw_array_insert(section->steps, index, step);
+}
+
+// Applies the same edits to two copies of a section, recalculating one from the edit and
+// the other in full, and checks that they agree
+
+void ysw_test_zm_recalculate_section_from(void)
+{
+    zm_section_t *section = zm_create_section(NULL);
+    for (zm_step_x i = 0; i < 40; i++) {
+        insert_step(section, i, i);
+    }
+    zm_recalculate_section(section);
+    zm_section_t *expected = zm_create_duplicate_section(section);
+
+    for (uint32_t seed = 0; seed < 300; seed++) {
+        zm_step_x step_count = ysw_array_get_count(section->steps);
+        switch (seed % 3) {
+            case 0: {
+                zm_step_x index = (seed * 31) % (step_count + 1);
+                insert_step(section, index, seed);
+                insert_step(expected, index, seed);
+                zm_recalculate_section_from(section, index, index + 1);
+                break;
+            }
+            case 1: {
+                zm_step_x index = (seed * 17) % step_count;
+                ysw_heap_free(ysw_array_remove(section->steps, index));
+                ysw_heap_free(ysw_array_remove(expected->steps, index));
+                zm_recalculate_section_from(section, index, index);
+                break;
+            }
+            case 2: {
+                zm_step_x index = (seed * 13) % step_count;
+                zm_step_t *step = ysw_array_get(section->steps, index);
+                zm_step_t *expected_step = ysw_array_get(expected->steps, index);
+                if (step->melody.duration) {
+                    step->melody.duration = step->melody.duration == ZM_QUARTER ? ZM_DOTTED_HALF : ZM_QUARTER;
+                    expected_step->melody.duration = step->melody.duration;
+                } else {
+                    step->chord.frequency = (step->chord.frequency % ZM_FOUR_PER_MEASURE) + 1;
+                    expected_step->chord.frequency = step->chord.frequency;
+                }
+                zm_recalculate_section_from(section, index, index + 1);
+                break;
+            }
+        }
+        zm_recalculate_section(expected);
+        ESP_LOGD(TAG, "seed=%d, step_count=%d", seed, ysw_array_get_count(section->steps));
+        assert(zm_sections_equal(section, expected));
+    }
+
+    zm_section_free(section);
+    zm_section_free(expected);
+}
+
+// Saves the music to an image, loads it back and checks that it is unchanged. References
+// are compared by index, because the copy has its own chord types, chord styles and beats.
+
+#define TEST_IMAGE ZM_MF_PARTITION "/test.bin"
+
+static void assert_steps_equal(zm_music_t *music, zm_step_t *step, zm_music_t *copy, zm_step_t *copy_step)
+{
+    assert(step->start == copy_step->start);
+    assert(step->measure == copy_step->measure);
+    assert(step->flags == copy_step->flags);
+    assert(step->melody.note == copy_step->melody.note);
+    assert(step->melody.duration == copy_step->melody.duration);
+    assert(step->melody.tie == copy_step->melody.tie);
+    assert(step->chord.root == copy_step->chord.root);
+    assert(ysw_array_find(music->chord_types, step->chord.type) ==
+            ysw_array_find(copy->chord_types, copy_step->chord.type));
+    assert(ysw_array_find(music->chord_styles, step->chord.style) ==
+            ysw_array_find(copy->chord_styles, copy_step->chord.style));
+    assert(step->chord.duration == copy_step->chord.duration);
+    assert(step->chord.frequency == copy_step->chord.frequency);
+    assert(ysw_array_find(music->beats, step->rhythm.beat) ==
+            ysw_array_find(copy->beats, copy_step->rhythm.beat));
+    assert(step->rhythm.surface == copy_step->rhythm.surface);
+    assert(step->rhythm.cadence == copy_step->rhythm.cadence);
+}
+
+void ysw_test_zm_image_round_trip(void)
+{
+    zm_music_t *music = zm_load_music();
+    zm_image_save(music, TEST_IMAGE);
+    zm_music_t *copy = zm_image_load(TEST_IMAGE);
+    assert(copy);
+
+    assert(ysw_array_get_count(copy->chord_types) == ysw_array_get_count(music->chord_types));
+    assert(ysw_array_get_count(copy->chord_styles) == ysw_array_get_count(music->chord_styles));
+    assert(ysw_array_get_count(copy->beats) == ysw_array_get_count(music->beats));
+
+    zm_section_x section_count = ysw_array_get_count(music->sections);
+    assert(ysw_array_get_count(copy->sections) == section_count);
+    for (zm_section_x i = 0; i < section_count; i++) {
+        zm_section_t *section = ysw_array_get(music->sections, i);
+        zm_section_t *copy_section = ysw_array_get(copy->sections, i);
+        assert(zm_load_section(music, section));
+        assert(zm_load_section(copy, copy_section));
+        ESP_LOGD(TAG, "section=%s, step_count=%d", section->name, ysw_array_get_count(section->steps));
+        assert(strcmp(section->name, copy_section->name) == 0);
+        assert(section->tempo == copy_section->tempo);
+        assert(section->key == copy_section->key);
+        assert(section->time == copy_section->time);
+        assert(section->tlm == copy_section->tlm);
+        assert(section->melody_program == copy_section->melody_program);
+        assert(section->chord_program == copy_section->chord_program);
+        zm_step_x step_count = ysw_array_get_count(section->steps);
+        assert(ysw_array_get_count(copy_section->steps) == step_count);
+        for (zm_step_x j = 0; j < step_count; j++) {
+            assert_steps_equal(music, ysw_array_get(section->steps, j), copy, ysw_array_get(copy_section->steps, j));
+        }
+    }
+
+    zm_composition_x composition_count = ysw_array_get_count(music->compositions);
+    assert(ysw_array_get_count(copy->compositions) == composition_count);
+    for (zm_composition_x i = 0; i < composition_count; i++) {
+        zm_composition_t *composition = ysw_array_get(music->compositions, i);
+        zm_composition_t *copy_composition = ysw_array_get(copy->compositions, i);
+        assert(strcmp(composition->name, copy_composition->name) == 0);
+        assert(composition->bpm == copy_composition->bpm);
+        zm_part_x part_count = ysw_array_get_count(composition->parts);
+        assert(ysw_array_get_count(copy_composition->parts) == part_count);
+        for (zm_part_x j = 0; j < part_count; j++) {
+            zm_part_t *part = ysw_array_get(composition->parts, j);
+            zm_part_t *copy_part = ysw_array_get(copy_composition->parts, j);
+            assert(ysw_array_find(music->sections, part->section) ==
+                    ysw_array_find(copy->sections, copy_part->section));
+            assert(part->percent_volume == copy_part->percent_volume);
+            assert(part->when.type == copy_part->when.type);
+            assert(part->when.part_index == copy_part->when.part_index);
+            assert(part->fit == copy_part->fit);
+        }
+    }
+
+    unlink(TEST_IMAGE);
+}
@@ -21,6 +21,7 @@
 #define TAG "YSW_VS_SYNTH"
 
 typedef struct {
+    ysw_bus_t *bus;
     ysw_vs1053_config_t config;
 } ysw_vs_synth_t;
 
@@ -36,11 +37,30 @@ static inline void on_note_off(ysw_vs_synth_t *vs_synth, ysw_event_note_off_t *m
     ysw_vs1053_set_note_off(m->channel, m->midi_note);
 }
 
+static void on_note_batch(ysw_vs_synth_t *vs_synth, ysw_event_note_batch_t *m)
+{
+    for (uint8_t i = 0; i < m->count; i++) {
+        ysw_event_batch_note_t *note = &m->notes[i];
+        if (note->velocity) {
+            ysw_vs1053_set_note_on(note->channel, note->midi_note, note->velocity);
+        } else {
+            ysw_vs1053_set_note_off(note->channel, note->midi_note);
+        }
+    }
+}
+
 static inline void on_program_change(ysw_vs_synth_t *vs_synth, ysw_event_program_change_t *m)
 {
     ysw_vs1053_select_program(m->channel, m->program);
 }
 
+// Programs are loaded when they are selected, so there is nothing to wait for
+
+static inline void on_preload(ysw_vs_synth_t *vs_synth, ysw_event_preload_t *m)
+{
+    ysw_event_fire_preload_done(vs_synth->bus, m->token);
+}
+
 static void process_event(void *context, ysw_event_t *event)
 {
     ysw_vs_synth_t *vs_synth = context;
@@ -51,9 +71,15 @@ static void process_event(void *context, ysw_event_t *event)
         case YSW_EVENT_NOTE_OFF:
             on_note_off(vs_synth, &event->note_off);
             break;
+        case YSW_EVENT_NOTE_BATCH:
+            on_note_batch(vs_synth, &event->note_batch);
+            break;
         case YSW_EVENT_PROGRAM_CHANGE:
             on_program_change(vs_synth, &event->program_change);
             break;
+        case YSW_EVENT_PRELOAD:
+            on_preload(vs_synth, &event->preload);
+            break;
         default:
             break;
     }
@@ -63,6 +89,7 @@ void ysw_vs_synth_create_task(ysw_bus_t *bus, ysw_vs1053_config_t *vs1053_config
 {
     assert(portTICK_PERIOD_MS == 1);
     ysw_vs_synth_t *vs_synth = ysw_heap_allocate(sizeof(ysw_vs_synth_t));
+    vs_synth->bus = bus;
     vs_synth->config = *vs1053_config;
     ysw_vs1053_initialize(&vs_synth->config);
 
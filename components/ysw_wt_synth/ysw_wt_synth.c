@@ -42,6 +42,7 @@
 static SemaphoreHandle_t synth_semaphore;
 
 typedef struct {
+    ysw_bus_t *bus;
 } ysw_wt_synth_t;
 
 static const i2s_config_t i2s_config = {
@@ -234,10 +235,29 @@ static inline void on_note_off(ysw_wt_synth_t *wt_synth, ysw_event_note_off_t *m
     release_midi_key(m->channel, m->midi_note);
 }
 
+static void on_note_batch(ysw_wt_synth_t *wt_synth, ysw_event_note_batch_t *m)
+{
+    for (uint8_t i = 0; i < m->count; i++) {
+        ysw_event_batch_note_t *note = &m->notes[i];
+        if (note->velocity) {
+            press_midi_key(note->channel, note->midi_note, note->velocity);
+        } else {
+            release_midi_key(note->channel, note->midi_note);
+        }
+    }
+}
+
 static inline void on_program_change(ysw_wt_synth_t *wt_synth, ysw_event_program_change_t *m)
 {
 }
 
+// All programs are built in, so there is nothing to wait for
+
+static inline void on_preload(ysw_wt_synth_t *wt_synth, ysw_event_preload_t *m)
+{
+    ysw_event_fire_preload_done(wt_synth->bus, m->token);
+}
+
 static void process_event(void *context, ysw_event_t *event)
 {
     ysw_wt_synth_t *wt_synth = context;
@@ -248,9 +268,15 @@ static void process_event(void *context, ysw_event_t *event)
         case YSW_EVENT_NOTE_OFF:
             on_note_off(wt_synth, &event->note_off);
             break;
+        case YSW_EVENT_NOTE_BATCH:
+            on_note_batch(wt_synth, &event->note_batch);
+            break;
         case YSW_EVENT_PROGRAM_CHANGE:
             on_program_change(wt_synth, &event->program_change);
             break;
+        case YSW_EVENT_PRELOAD:
+            on_preload(wt_synth, &event->preload);
+            break;
         default:
             break;
     }
@@ -260,6 +286,7 @@ void ysw_wt_synth_create_task(ysw_bus_t *bus, uint8_t dac_left_gpio, uint8_t dac
 {
     create_synth_task(dac_left_gpio, dac_right_gpio);
     ysw_wt_synth_t *wt_synth = ysw_heap_allocate(sizeof(ysw_wt_synth_t));
+    wt_synth->bus = bus;
 
     ysw_task_config_t config = ysw_task_default_config;
 
@@ -9,7 +9,9 @@
 
 #pragma once
 
+#include "ysw_array.h"
 #include "ysw_common.h"
+#include "assert.h"
 #include "stdint.h"
 
 typedef struct PACKED note {
@@ -21,3 +23,52 @@ typedef struct PACKED note {
     uint8_t program;
 } ysw_note_t;
 
+// Rendered notes are stored by value in a single growable block, rather than as separately
+// allocated notes in a ysw_array_t, and are freed all at once. A pointer to a note is only
+// valid until the next note is added.
+
+typedef struct {
+    ysw_note_t *notes;
+    uint32_t count;
+    uint32_t size;
+} ysw_notes_t;
+
+typedef int (*ysw_notes_comparator_t)(const void *left, const void *right);
+
+ysw_notes_t *ysw_notes_create(uint32_t initial_size);
+ysw_note_t *ysw_notes_add(ysw_notes_t *notes);
+void ysw_notes_append(ysw_notes_t *notes, const ysw_note_t *from, uint32_t count);
+void ysw_notes_remove_first(ysw_notes_t *notes, uint32_t count);
+void ysw_notes_sort(ysw_notes_t *notes, ysw_notes_comparator_t comparator);
+void ysw_notes_merge(ysw_notes_t *notes, ysw_array_t *run_ends, ysw_notes_comparator_t comparator);
+uint32_t ysw_notes_find_start(ysw_notes_t *notes, uint32_t start);
+void ysw_notes_free(ysw_notes_t *notes);
+
+static inline uint32_t ysw_notes_get_count(ysw_notes_t *notes)
+{
+    return notes->count;
+}
+
+static inline ysw_note_t *ysw_notes_get(ysw_notes_t *notes, uint32_t index)
+{
+    assert(index < notes->count);
+    return &notes->notes[index];
+}
+
+static inline void ysw_notes_clear(ysw_notes_t *notes)
+{
+    notes->count = 0;
+}
+
+// A note source supplies a long sequence of notes a piece at a time, so that the whole
+// sequence need not be in memory at once. Each call to next returns the notes in the next
+// piece, sorted by start, relative to the start of the piece, and sets length to the ticks
+// from the start of the piece to the start of the following piece. The source owns each
+// piece until the second call to next after the one that returned it, or free, so that
+// the caller can hold the next piece while playing the current one. The first call
+// returns a (possibly empty) piece, later calls return NULL when there are no more notes.
+
+typedef struct ysw_note_source_s {
+    ysw_notes_t *(*next)(struct ysw_note_source_s *source, uint32_t *length);
+    void (*free)(struct ysw_note_source_s *source);
+} ysw_note_source_t;
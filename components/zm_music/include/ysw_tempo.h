@@ -0,0 +1,20 @@
+// Copyright 2020 Anthony F. Stuart - All rights reserved.
+//
+// This program and the accompanying materials are made available
+// under the terms of the GNU General Public License. For other license
+// options please contact the copyright owner.
+//
+// This program is made available on an "as is" basis, without
+// warranties or conditions of any kind, either express or implied.
+
+#pragma once
+
+#include "ysw_common.h"
+#include "stdint.h"
+
+// A tempo change takes effect at its start tick and lasts until the next tempo change
+
+typedef struct PACKED tempo {
+    uint32_t start;
+    uint8_t bpm;
+} ysw_tempo_t;
@@ -0,0 +1,158 @@
+// Copyright 2020 Anthony F. Stuart - All rights reserved.
+//
+// This program and the accompanying materials are made available
+// under the terms of the GNU General Public License. For other license
+// options please contact the copyright owner.
+//
+// This program is made available on an "as is" basis, without
+// warranties or conditions of any kind, either express or implied.
+
+#pragma once
+
+#include "zm_music.h"
+#include "stdint.h"
+
+// A music image holds a zm_music_t as tables of fixed size records that refer to each
+// other by index, so that it can be loaded without parsing. Names are offsets into a
+// table of null terminated strings at the end. Each table starts at a ZM_IMAGE_ALIGNMENT
+// boundary. All multi-byte values are little endian.
+//
+//   zm_image_header_t
+//   zm_image_chord_type_t[chord_type_count]
+//   int8_t[distance_count] (chord type distances)
+//   zm_image_chord_style_t[chord_style_count]
+//   zm_image_sound_t[sound_count]
+//   zm_image_beat_t[beat_count]
+//   zm_image_stroke_t[stroke_count]
+//   zm_image_section_t[section_count]
+//   zm_image_step_t[step_count]
+//   zm_image_composition_t[composition_count]
+//   zm_image_part_t[part_count]
+//   char[string_size]
+
+#define ZM_IMAGE_MAGIC 0x4d575359 // YSWM
+#define ZM_IMAGE_VERSION 1
+#define ZM_IMAGE_ALIGNMENT 4
+#define ZM_IMAGE_NONE 0xffff // no chord type, chord style or beat
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t clock;
+    uint16_t chord_type_count;
+    uint16_t chord_style_count;
+    uint16_t beat_count;
+    uint16_t section_count;
+    uint16_t composition_count;
+    uint16_t reserved2;
+    uint32_t distance_count;
+    uint32_t sound_count;
+    uint32_t stroke_count;
+    uint32_t step_count;
+    uint32_t part_count;
+    uint32_t string_size;
+    uint32_t chord_types_offset;
+    uint32_t distances_offset;
+    uint32_t chord_styles_offset;
+    uint32_t sounds_offset;
+    uint32_t beats_offset;
+    uint32_t strokes_offset;
+    uint32_t sections_offset;
+    uint32_t steps_offset;
+    uint32_t compositions_offset;
+    uint32_t parts_offset;
+    uint32_t strings_offset;
+} zm_image_header_t;
+
+typedef struct {
+    uint32_t name;
+    uint32_t label;
+    uint32_t first_distance;
+    uint16_t distance_count;
+    uint16_t reserved;
+} zm_image_chord_type_t;
+
+typedef struct {
+    uint32_t name;
+    uint32_t label;
+    uint32_t first_sound;
+    uint16_t sound_count;
+    uint8_t distance_count;
+    uint8_t reserved;
+} zm_image_chord_style_t;
+
+typedef struct {
+    uint16_t start;
+    uint16_t duration;
+    uint8_t distance_index;
+    uint8_t velocity;
+    uint16_t reserved;
+} zm_image_sound_t;
+
+typedef struct {
+    uint32_t name;
+    uint32_t label;
+    uint32_t first_stroke;
+    uint32_t stroke_count;
+} zm_image_beat_t;
+
+typedef struct {
+    uint32_t start;
+    uint8_t surface;
+    uint8_t velocity;
+    uint16_t reserved;
+} zm_image_stroke_t;
+
+typedef struct {
+    uint32_t name;
+    uint32_t tlm;
+    uint32_t first_step;
+    uint32_t step_count;
+    uint8_t tempo;
+    uint8_t key;
+    uint8_t time;
+    uint8_t melody_program;
+    uint8_t chord_program;
+    uint8_t reserved[3];
+} zm_image_section_t;
+
+typedef struct {
+    uint32_t start;
+    uint16_t measure;
+    uint16_t flags;
+    uint16_t melody_duration;
+    uint16_t chord_duration;
+    uint16_t chord_type;
+    uint16_t chord_style;
+    uint16_t beat;
+    uint16_t cadence;
+    uint8_t melody_note;
+    uint8_t tie;
+    uint8_t chord_root;
+    uint8_t chord_frequency;
+    uint8_t surface;
+    uint8_t reserved[3];
+} zm_image_step_t;
+
+typedef struct {
+    uint32_t name;
+    uint32_t first_part;
+    uint16_t part_count;
+    uint8_t bpm;
+    uint8_t reserved;
+} zm_image_composition_t;
+
+typedef struct {
+    uint16_t section;
+    uint16_t when_part_index;
+    uint8_t percent_volume;
+    uint8_t when_type;
+    uint8_t fit;
+    uint8_t reserved;
+} zm_image_part_t;
+
+zm_music_t *zm_image_load(const char *path);
+bool zm_image_load_steps(zm_music_t *music, zm_section_t *section);
+void zm_image_save(zm_music_t *music, const char *path);
+void zm_image_rename(zm_music_t *music, const char *old_path, const char *new_path);
@@ -12,6 +12,7 @@
 #include "ysw_array.h"
 #include "ysw_common.h"
 #include "ysw_heap.h"
+#include "ysw_note.h"
 #include "stdbool.h"
 #include "stdint.h"
 #include "stdio.h"
@@ -19,6 +20,8 @@
 #define ZM_MF_PARTITION "/spiffs"
 #define ZM_MF_CSV ZM_MF_PARTITION "/music.csv"
 #define ZM_MF_TEMP ZM_MF_PARTITION "/music.tmp"
+#define ZM_MF_IMAGE ZM_MF_PARTITION "/music.bin"
+#define ZM_MF_IMAGE_TEMP ZM_MF_PARTITION "/music.new"
 #define ZM_NAME_SZ 32
 
 typedef uint8_t zm_small_t;
@@ -188,6 +191,11 @@ typedef struct {
     ysw_array_t *steps;
     zm_program_x melody_program;
     zm_program_x chord_program;
+    uint32_t revision; // changed by each edit that affects the rendered notes
+    uint32_t cache_revision; // revision when cache was rendered
+    ysw_notes_t *cache; // notes rendered at time 0 on channel 0, or NULL
+    zm_step_x image_first_step; // index of first step in music image, while steps is NULL
+    zm_step_x image_step_count; // number of steps in music image, while steps is NULL
 } zm_section_t;
 
 typedef enum {
@@ -225,6 +233,15 @@ typedef struct {
     zm_fit_t fit;
 } zm_part_t;
 
+// Sections loaded from a music image have steps set to NULL until they are needed, and
+// zm_load_section reads them from the image on demand
+
+typedef struct {
+    FILE *file;
+    zm_large_t steps_offset;
+    zm_large_t step_count;
+} zm_image_steps_t;
+
 typedef struct {
     zm_settings_t settings;
     ysw_array_t *chord_types;
@@ -232,6 +249,7 @@ typedef struct {
     ysw_array_t *beats;
     ysw_array_t *sections;
     ysw_array_t *compositions;
+    zm_image_steps_t *image_steps; // source of steps that are not loaded yet, or NULL
 } zm_music_t;
 
 typedef struct {
@@ -245,6 +263,10 @@ void zm_music_free(zm_music_t *music);
 zm_music_t *zm_parse_file(FILE *file);
 zm_music_t *zm_load_music(void);
 void zm_save_music(zm_music_t *music);
+void zm_export_music(zm_music_t *music, const char *path);
+
+bool zm_load_section(zm_music_t *music, zm_section_t *section);
+zm_step_x zm_get_step_count(const zm_section_t *section);
 
 void *zm_load_sample(const char* name, uint16_t *byte_count);
 
@@ -252,18 +274,36 @@ int zm_note_compare(const void *left, const void *right);
 
 zm_time_x zm_get_step_duration(zm_step_t *step, zm_time_x ticks_per_measure);
 void zm_recalculate_section(zm_section_t *section);
+void zm_recalculate_section_from(zm_section_t *section, zm_step_x first_step, zm_step_x unchanged_step);
+void zm_invalidate_section(zm_section_t *section);
+
+void zm_render_melody(ysw_notes_t *notes, zm_melody_t *melody, zm_time_x melody_start, zm_channel_x channel, zm_program_x program_index, zm_tie_x tie);
+void zm_render_chord(ysw_notes_t *notes, zm_chord_t *chord, zm_time_x chord_start, zm_channel_x channel, zm_program_x program_index);
+void zm_render_beat(ysw_notes_t *notes, zm_beat_t *beat, zm_time_x beat_start, zm_channel_x channel, zm_program_x program_index);
+ysw_notes_t *zm_render_step(zm_music_t *m, zm_section_t *p, zm_step_t *d, zm_channel_x bc);
+zm_time_x zm_render_section_notes(ysw_notes_t *notes, ysw_array_t *run_ends, zm_music_t *music, zm_section_t *section, zm_time_x start_time, zm_channel_x base_channel);
+ysw_notes_t *zm_render_section(zm_music_t *music, zm_section_t *section, zm_channel_x base_channel);
+ysw_notes_t *zm_render_composition(zm_music_t *music, zm_composition_t *composition, zm_channel_x base_channel);
+
+// Returns the composition's tempo changes after tick zero, as ysw_tempo_t, sorted by start,
+// or NULL if the whole composition plays at its bpm
+
+ysw_array_t *zm_get_composition_tempos(zm_music_t *music, zm_composition_t *composition);
+
+// Renders a composition a piece at a time, as it is played, rather than all at once. Each
+// section is rendered when the stream first reaches it, so the sections must not be freed
+// while the stream is in use.
+
+#define ZM_STREAM_PIECE_TICKS (4 * ZM_WHOLE)
 
-void zm_render_melody(ysw_array_t *notes, zm_melody_t *melody, zm_time_x melody_start, zm_channel_x channel, zm_program_x program_index, zm_tie_x tie);
-void zm_render_chord(ysw_array_t *notes, zm_chord_t *chord, zm_time_x chord_start, zm_channel_x channel, zm_program_x program_index);
-ysw_array_t *zm_render_step(zm_music_t *m, zm_section_t *p, zm_step_t *d, zm_channel_x bc);
-zm_time_x zm_render_section_notes(ysw_array_t *notes, zm_music_t *music, zm_section_t *section, zm_time_x start_time, zm_channel_x base_channel);
-ysw_array_t *zm_render_section(zm_music_t *music, zm_section_t *section, zm_channel_x base_channel);
-ysw_array_t *zm_render_composition(zm_music_t *music, zm_composition_t *composition, zm_channel_x base_channel);
+ysw_note_source_t *zm_stream_composition(zm_music_t *music, zm_composition_t *composition, zm_channel_x base_channel);
 
 const zm_key_signature_t *zm_get_key_signature(zm_key_signature_x key_index);
 zm_key_signature_x zm_get_next_key_index(zm_key_signature_x key_index);
+zm_key_signature_x zm_get_key_signature_count(void);
 
 const zm_time_signature_t *zm_get_time_signature(zm_time_signature_x time_index);
+zm_time_signature_x zm_get_time_signature_count(void);
 
 zm_duration_t zm_round_duration(zm_duration_t duration, uint8_t *index, bool *is_dotted);
 zm_duration_t zm_get_next_dotted_duration(zm_duration_t duration, int direction);
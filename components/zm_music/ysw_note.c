@@ -0,0 +1,170 @@
+// Copyright 2020 Anthony F. Stuart - All rights reserved.
+//
+// This program and the accompanying materials are made available
+// under the terms of the GNU General Public License. For other license
+// options please contact the copyright owner.
+//
+// This program is made available on an "as is" basis, without
+// warranties or conditions of any kind, either express or implied.
+
+#include "ysw_note.h"
+
+#include "ysw_heap.h"
+#include "assert.h"
+#include "stdlib.h"
+#include "string.h"
+
+static void ensure_capacity(ysw_notes_t *notes, uint32_t required_size)
+{
+    if (required_size > notes->size) {
+        notes->size = ysw_uint32_max(required_size, notes->size * 2);
+        notes->notes = ysw_heap_reallocate(notes->notes, notes->size * sizeof(ysw_note_t));
+    }
+}
+
+ysw_notes_t *ysw_notes_create(uint32_t initial_size)
+{
+    ysw_notes_t *notes = ysw_heap_allocate(sizeof(ysw_notes_t));
+    notes->size = ysw_uint32_max(initial_size, 1);
+    notes->notes = ysw_heap_allocate_uninitialized(notes->size * sizeof(ysw_note_t));
+    return notes;
+}
+
+// Returns a new zeroed note at the end of the notes
+
+ysw_note_t *ysw_notes_add(ysw_notes_t *notes)
+{
+    assert(notes);
+    ensure_capacity(notes, notes->count + 1);
+    ysw_note_t *note = &notes->notes[notes->count++];
+    memset(note, 0, sizeof(ysw_note_t));
+    return note;
+}
+
+void ysw_notes_append(ysw_notes_t *notes, const ysw_note_t *from, uint32_t count)
+{
+    assert(notes);
+    ensure_capacity(notes, notes->count + count);
+    memcpy(&notes->notes[notes->count], from, count * sizeof(ysw_note_t));
+    notes->count += count;
+}
+
+void ysw_notes_remove_first(ysw_notes_t *notes, uint32_t count)
+{
+    assert(notes);
+    assert(count <= notes->count);
+    notes->count -= count;
+    memmove(notes->notes, &notes->notes[count], notes->count * sizeof(ysw_note_t));
+}
+
+// The comparator is passed pointers to the notes themselves
+
+void ysw_notes_sort(ysw_notes_t *notes, ysw_notes_comparator_t comparator)
+{
+    assert(notes);
+    assert(comparator);
+    qsort(notes->notes, notes->count, sizeof(ysw_note_t), comparator);
+}
+
+typedef struct {
+    uint32_t next;
+    uint32_t end;
+} cursor_t;
+
+static void sort_run(ysw_notes_t *notes, uint32_t start, uint32_t end, ysw_notes_comparator_t comparator)
+{
+    for (uint32_t i = start + 1; i < end; i++) {
+        if (comparator(&notes->notes[i - 1], &notes->notes[i]) > 0) {
+            qsort(&notes->notes[start], end - start, sizeof(ysw_note_t), comparator);
+            return;
+        }
+    }
+}
+
+static void sift_down(ysw_notes_t *notes, cursor_t *cursors, uint32_t cursor_count, uint32_t index,
+        ysw_notes_comparator_t comparator)
+{
+    cursor_t cursor = cursors[index];
+    uint32_t child;
+    while ((child = (2 * index) + 1) < cursor_count) {
+        if (child + 1 < cursor_count && comparator(&notes->notes[cursors[child + 1].next],
+                &notes->notes[cursors[child].next]) < 0) {
+            child++;
+        }
+        if (comparator(&notes->notes[cursors[child].next], &notes->notes[cursor.next]) >= 0) {
+            break;
+        }
+        cursors[index] = cursors[child];
+        index = child;
+    }
+    cursors[index] = cursor;
+}
+
+// Sorts notes that were added as a series of runs, each of which ends at the corresponding
+// index in run_ends (notes after the last run end form a final run). Each run is typically
+// already sorted, so it is only checked, and the runs are then combined with a k-way merge
+// that keeps the next note of each run in a heap.
+
+void ysw_notes_merge(ysw_notes_t *notes, ysw_array_t *run_ends, ysw_notes_comparator_t comparator)
+{
+    assert(notes);
+    assert(run_ends);
+    assert(comparator);
+    uint32_t run_count = ysw_array_get_count(run_ends);
+    cursor_t *cursors = ysw_heap_allocate_uninitialized((run_count + 1) * sizeof(cursor_t));
+    uint32_t cursor_count = 0;
+    uint32_t run_start = 0;
+    for (uint32_t i = 0; i <= run_count; i++) {
+        uint32_t run_end = i < run_count ? (intptr_t)ysw_array_get(run_ends, i) : notes->count;
+        assert(run_start <= run_end && run_end <= notes->count);
+        if (run_start < run_end) {
+            sort_run(notes, run_start, run_end, comparator);
+            cursors[cursor_count].next = run_start;
+            cursors[cursor_count].end = run_end;
+            cursor_count++;
+        }
+        run_start = run_end;
+    }
+    if (cursor_count > 1) {
+        for (uint32_t i = cursor_count / 2; i-- > 0; ) {
+            sift_down(notes, cursors, cursor_count, i, comparator);
+        }
+        ysw_note_t *merged = ysw_heap_allocate_uninitialized(notes->size * sizeof(ysw_note_t));
+        for (uint32_t i = 0; i < notes->count; i++) {
+            merged[i] = notes->notes[cursors[0].next++];
+            if (cursors[0].next == cursors[0].end) {
+                cursors[0] = cursors[--cursor_count];
+            }
+            sift_down(notes, cursors, cursor_count, 0, comparator);
+        }
+        ysw_heap_free(notes->notes);
+        notes->notes = merged;
+    }
+    ysw_heap_free(cursors);
+}
+
+// Returns the index of the first note that starts at or after start, or the count if none.
+// The notes must be sorted by start.
+
+uint32_t ysw_notes_find_start(ysw_notes_t *notes, uint32_t start)
+{
+    assert(notes);
+    uint32_t bottom = 0;
+    uint32_t top = notes->count;
+    while (bottom < top) {
+        uint32_t middle = bottom + ((top - bottom) / 2);
+        if (notes->notes[middle].start < start) {
+            bottom = middle + 1;
+        } else {
+            top = middle;
+        }
+    }
+    return bottom;
+}
+
+void ysw_notes_free(ysw_notes_t *notes)
+{
+    assert(notes);
+    ysw_heap_free(notes->notes);
+    ysw_heap_free(notes);
+}
@@ -0,0 +1,910 @@
+// Copyright 2020 Anthony F. Stuart - All rights reserved.
+//
+// This program and the accompanying materials are made available
+// under the terms of the GNU General Public License. For other license
+// options please contact the copyright owner.
+//
+// This program is made available on an "as is" basis, without
+// warranties or conditions of any kind, either express or implied.
+
+#include "zm_image.h"
+
+#include "ysw_array.h"
+#include "ysw_heap.h"
+
+#include "esp_log.h"
+#include "hash.h"
+
+#include "assert.h"
+#include "errno.h"
+#include "fcntl.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+
+#include "sys/types.h"
+#include "sys/stat.h"
+
+#ifndef IDF_VER
+#include "sys/mman.h"
+#endif
+
+#define TAG "ZM_IMAGE"
+
+typedef struct {
+    const uint8_t *base;
+    uint32_t size;
+    uint32_t skip_offset; // offset of the bytes that weren't read into base
+    uint32_t skip_size; // number of bytes that weren't read into base
+    const zm_image_header_t *header;
+    const zm_image_chord_type_t *chord_types;
+    const int8_t *distances;
+    const zm_image_chord_style_t *chord_styles;
+    const zm_image_sound_t *sounds;
+    const zm_image_beat_t *beats;
+    const zm_image_stroke_t *strokes;
+    const zm_image_section_t *sections;
+    const zm_image_composition_t *compositions;
+    const zm_image_part_t *parts;
+    const char *strings;
+} image_t;
+
+// The image is mapped on Linux. On the ESP32, where spiffs files can't be mapped, it is
+// read into a single buffer, apart from the step table, which is read a section at a time
+// by zm_image_load_steps.
+
+static bool map_image(image_t *image, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) == -1 || sb.st_size < sizeof(zm_image_header_t)) {
+        ESP_LOGE(TAG, "invalid image, path=%s", path);
+        close(fd);
+        return false;
+    }
+    image->size = sb.st_size;
+#ifdef IDF_VER
+    zm_image_header_t header;
+    if (read(fd, &header, sizeof(header)) != sizeof(header) || header.steps_offset < sizeof(header) ||
+            header.steps_offset > header.compositions_offset || header.compositions_offset > image->size) {
+        ESP_LOGE(TAG, "invalid image, path=%s", path);
+        close(fd);
+        return false;
+    }
+    image->skip_offset = header.steps_offset;
+    image->skip_size = header.compositions_offset - header.steps_offset;
+    uint32_t tail_size = image->size - header.compositions_offset;
+    uint8_t *buffer = ysw_heap_allocate_uninitialized(image->size - image->skip_size);
+    if (lseek(fd, 0, SEEK_SET) == -1 ||
+            read(fd, buffer, image->skip_offset) != image->skip_offset ||
+            lseek(fd, header.compositions_offset, SEEK_SET) == -1 ||
+            read(fd, buffer + image->skip_offset, tail_size) != tail_size) {
+        ESP_LOGE(TAG, "read failed, path=%s", path);
+        abort();
+    }
+    image->base = buffer;
+#else
+    image->skip_offset = image->size;
+    void *address = mmap(NULL, image->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address == MAP_FAILED) {
+        ESP_LOGE(TAG, "mmap failed, path=%s", path);
+        abort();
+    }
+    image->base = address;
+#endif
+    close(fd);
+    return true;
+}
+
+static void unmap_image(image_t *image)
+{
+#ifdef IDF_VER
+    ysw_heap_free((void *)image->base);
+#else
+    munmap((void *)image->base, image->size);
+#endif
+}
+
+static bool has_table(image_t *image, uint32_t offset, uint32_t count, uint32_t record_size)
+{
+    return !(offset % ZM_IMAGE_ALIGNMENT) && offset <= image->size &&
+            count <= (image->size - offset) / record_size;
+}
+
+// Returns NULL if the table isn't in the image, or overlaps the bytes that weren't read
+
+static const void *get_table(image_t *image, uint32_t offset, uint32_t count, uint32_t record_size)
+{
+    if (!has_table(image, offset, count, record_size)) {
+        return NULL;
+    }
+    if (offset >= image->skip_offset + image->skip_size) {
+        return image->base + (offset - image->skip_size);
+    }
+    if (offset <= image->skip_offset && count <= (image->skip_offset - offset) / record_size) {
+        return image->base + offset;
+    }
+    return NULL;
+}
+
+static bool is_string(image_t *image, uint32_t offset)
+{
+    return offset < image->header->string_size;
+}
+
+static bool is_range(uint32_t first, uint32_t count, uint32_t total)
+{
+    return first <= total && count <= total - first;
+}
+
+static bool is_reference(uint16_t index, uint32_t count)
+{
+    return index == ZM_IMAGE_NONE || index < count;
+}
+
+static bool locate_tables(image_t *image)
+{
+    const zm_image_header_t *h = image->header;
+    image->chord_types = get_table(image, h->chord_types_offset, h->chord_type_count, sizeof(zm_image_chord_type_t));
+    image->distances = get_table(image, h->distances_offset, h->distance_count, sizeof(int8_t));
+    image->chord_styles = get_table(image, h->chord_styles_offset, h->chord_style_count, sizeof(zm_image_chord_style_t));
+    image->sounds = get_table(image, h->sounds_offset, h->sound_count, sizeof(zm_image_sound_t));
+    image->beats = get_table(image, h->beats_offset, h->beat_count, sizeof(zm_image_beat_t));
+    image->strokes = get_table(image, h->strokes_offset, h->stroke_count, sizeof(zm_image_stroke_t));
+    image->sections = get_table(image, h->sections_offset, h->section_count, sizeof(zm_image_section_t));
+    image->compositions = get_table(image, h->compositions_offset, h->composition_count, sizeof(zm_image_composition_t));
+    image->parts = get_table(image, h->parts_offset, h->part_count, sizeof(zm_image_part_t));
+    image->strings = get_table(image, h->strings_offset, h->string_size, sizeof(char));
+    return image->chord_types && image->distances && image->chord_styles && image->sounds &&
+            image->beats && image->strokes && image->sections &&
+            has_table(image, h->steps_offset, h->step_count, sizeof(zm_image_step_t)) &&
+            image->compositions && image->parts && image->strings &&
+            (!h->string_size || !image->strings[h->string_size - 1]);
+}
+
+// Checks every reference in the image before anything is allocated, so that a damaged
+// image is rejected rather than partially loaded. Steps are checked as they are loaded.
+
+static bool validate_records(image_t *image)
+{
+    const zm_image_header_t *h = image->header;
+    for (uint32_t i = 0; i < h->chord_type_count; i++) {
+        const zm_image_chord_type_t *r = &image->chord_types[i];
+        if (!is_string(image, r->name) || !is_string(image, r->label) ||
+                !is_range(r->first_distance, r->distance_count, h->distance_count)) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < h->chord_style_count; i++) {
+        const zm_image_chord_style_t *r = &image->chord_styles[i];
+        if (!is_string(image, r->name) || !is_string(image, r->label) ||
+                !is_range(r->first_sound, r->sound_count, h->sound_count)) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < h->beat_count; i++) {
+        const zm_image_beat_t *r = &image->beats[i];
+        if (!is_string(image, r->name) || !is_string(image, r->label) ||
+                !is_range(r->first_stroke, r->stroke_count, h->stroke_count)) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < h->section_count; i++) {
+        const zm_image_section_t *r = &image->sections[i];
+        if (!is_string(image, r->name) || !is_range(r->first_step, r->step_count, h->step_count) ||
+                r->key >= zm_get_key_signature_count() || r->time >= zm_get_time_signature_count()) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < h->composition_count; i++) {
+        const zm_image_composition_t *r = &image->compositions[i];
+        if (!is_string(image, r->name) || !is_range(r->first_part, r->part_count, h->part_count)) {
+            return false;
+        }
+        // a part plays by itself, or with or after an earlier part in the same composition
+        for (uint32_t j = 0; j < r->part_count; j++) {
+            const zm_image_part_t *p = &image->parts[r->first_part + j];
+            if (p->section >= h->section_count || p->when_part_index > j ||
+                    p->when_type > ZM_WHEN_TYPE_AFTER || p->fit > ZM_FIT_LOOP) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void *get_reference(ysw_array_t *array, uint16_t index)
+{
+    return index == ZM_IMAGE_NONE ? NULL : ysw_array_get(array, index);
+}
+
+static void load_chord_types(image_t *image, zm_music_t *music)
+{
+    uint32_t chord_type_count = image->header->chord_type_count;
+    music->chord_types = ysw_array_create(chord_type_count);
+    for (uint32_t i = 0; i < chord_type_count; i++) {
+        const zm_image_chord_type_t *r = &image->chord_types[i];
+        zm_chord_type_t *type = ysw_heap_allocate(sizeof(zm_chord_type_t));
+        type->name = ysw_heap_strdup(image->strings + r->name);
+        type->label = ysw_heap_strdup(image->strings + r->label);
+        type->distances = ysw_array_create(r->distance_count);
+        for (uint32_t j = 0; j < r->distance_count; j++) {
+            zm_distance_t distance = image->distances[r->first_distance + j];
+            ysw_array_push(type->distances, (void*)(intptr_t)distance);
+        }
+        ysw_array_push(music->chord_types, type);
+    }
+}
+
+static void load_chord_styles(image_t *image, zm_music_t *music)
+{
+    uint32_t chord_style_count = image->header->chord_style_count;
+    music->chord_styles = ysw_array_create(chord_style_count);
+    for (uint32_t i = 0; i < chord_style_count; i++) {
+        const zm_image_chord_style_t *r = &image->chord_styles[i];
+        zm_chord_style_t *style = ysw_heap_allocate(sizeof(zm_chord_style_t));
+        style->name = ysw_heap_strdup(image->strings + r->name);
+        style->label = ysw_heap_strdup(image->strings + r->label);
+        style->distance_count = r->distance_count;
+        style->sounds = ysw_array_create(r->sound_count);
+        for (uint32_t j = 0; j < r->sound_count; j++) {
+            const zm_image_sound_t *s = &image->sounds[r->first_sound + j];
+            zm_sound_t *sound = ysw_heap_allocate(sizeof(zm_sound_t));
+            sound->distance_index = s->distance_index;
+            sound->velocity = s->velocity;
+            sound->start = s->start;
+            sound->duration = s->duration;
+            ysw_array_push(style->sounds, sound);
+        }
+        ysw_array_push(music->chord_styles, style);
+    }
+}
+
+static void load_beats(image_t *image, zm_music_t *music)
+{
+    uint32_t beat_count = image->header->beat_count;
+    music->beats = ysw_array_create(beat_count);
+    for (uint32_t i = 0; i < beat_count; i++) {
+        const zm_image_beat_t *r = &image->beats[i];
+        zm_beat_t *beat = ysw_heap_allocate(sizeof(zm_beat_t));
+        beat->name = ysw_heap_strdup(image->strings + r->name);
+        beat->label = ysw_heap_strdup(image->strings + r->label);
+        beat->strokes = ysw_array_create(r->stroke_count);
+        for (uint32_t j = 0; j < r->stroke_count; j++) {
+            const zm_image_stroke_t *s = &image->strokes[r->first_stroke + j];
+            zm_stroke_t *stroke = ysw_heap_allocate(sizeof(zm_stroke_t));
+            stroke->start = s->start;
+            stroke->surface = s->surface;
+            stroke->velocity = s->velocity;
+            ysw_array_push(beat->strokes, stroke);
+        }
+        ysw_array_push(music->beats, beat);
+    }
+}
+
+static void load_step(zm_music_t *music, const zm_image_step_t *r, zm_step_t *step)
+{
+    step->start = r->start;
+    step->measure = r->measure;
+    step->flags = r->flags;
+    step->melody.note = r->melody_note;
+    step->melody.duration = r->melody_duration;
+    step->melody.tie = r->tie;
+    step->chord.root = r->chord_root;
+    step->chord.type = get_reference(music->chord_types, r->chord_type);
+    step->chord.style = get_reference(music->chord_styles, r->chord_style);
+    step->chord.duration = r->chord_duration;
+    step->chord.frequency = r->chord_frequency;
+    step->rhythm.beat = get_reference(music->beats, r->beat);
+    step->rhythm.surface = r->surface;
+    step->rhythm.cadence = r->cadence;
+}
+
+static void load_sections(image_t *image, zm_music_t *music)
+{
+    uint32_t section_count = image->header->section_count;
+    music->sections = ysw_array_create(section_count);
+    for (uint32_t i = 0; i < section_count; i++) {
+        const zm_image_section_t *r = &image->sections[i];
+        zm_section_t *section = ysw_heap_allocate(sizeof(zm_section_t));
+        section->name = ysw_heap_strdup(image->strings + r->name);
+        section->tempo = r->tempo;
+        section->key = r->key;
+        section->time = r->time;
+        section->tlm = r->tlm;
+        section->melody_program = r->melody_program;
+        section->chord_program = r->chord_program;
+        section->image_first_step = r->first_step;
+        section->image_step_count = r->step_count;
+        ysw_array_push(music->sections, section);
+    }
+}
+
+static FILE *open_steps(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        ESP_LOGE(TAG, "fopen failed, file=%s", path);
+        abort();
+    }
+    return file;
+}
+
+static bool seek_step(zm_image_steps_t *image_steps, zm_step_x step_index)
+{
+    uint32_t offset = image_steps->steps_offset + step_index * sizeof(zm_image_step_t);
+    return fseek(image_steps->file, offset, SEEK_SET) == 0;
+}
+
+static bool read_step(zm_image_steps_t *image_steps, zm_image_step_t *r)
+{
+    return fread(r, sizeof(*r), 1, image_steps->file) == 1;
+}
+
+static bool is_step(zm_music_t *music, const zm_image_step_t *r)
+{
+    return is_reference(r->chord_type, ysw_array_get_count(music->chord_types)) &&
+            is_reference(r->chord_style, ysw_array_get_count(music->chord_styles)) &&
+            is_reference(r->beat, ysw_array_get_count(music->beats)) &&
+            (!r->chord_root || (r->chord_frequency >= ZM_ONE_PER_MEASURE &&
+                    r->chord_frequency <= ZM_FOUR_PER_MEASURE));
+}
+
+// Steps are validated as they are read, rather than when the image is loaded, so that
+// loading doesn't read every step. A section with damaged steps is left empty.
+
+bool zm_image_load_steps(zm_music_t *music, zm_section_t *section)
+{
+    assert(music->image_steps);
+    assert(!section->steps);
+    zm_image_steps_t *image_steps = music->image_steps;
+    assert(section->image_first_step + section->image_step_count <= image_steps->step_count);
+    section->steps = ysw_array_create(section->image_step_count);
+    bool is_valid = seek_step(image_steps, section->image_first_step);
+    for (zm_step_x i = 0; i < section->image_step_count && is_valid; i++) {
+        zm_image_step_t r;
+        is_valid = read_step(image_steps, &r) && is_step(music, &r);
+        if (is_valid) {
+            zm_step_t *step = ysw_heap_allocate(sizeof(zm_step_t));
+            load_step(music, &r, step);
+            ysw_array_push(section->steps, step);
+        }
+    }
+    if (!is_valid) {
+        ESP_LOGE(TAG, "damaged steps, section=%s", section->name);
+        ysw_array_free_all(section->steps);
+        section->steps = ysw_array_create(1);
+        return false;
+    }
+    ESP_LOGD(TAG, "load steps section=%s, steps=%d", section->name, section->image_step_count);
+    return true;
+}
+
+static void load_compositions(image_t *image, zm_music_t *music)
+{
+    uint32_t composition_count = image->header->composition_count;
+    music->compositions = ysw_array_create(composition_count);
+    for (uint32_t i = 0; i < composition_count; i++) {
+        const zm_image_composition_t *r = &image->compositions[i];
+        zm_composition_t *composition = ysw_heap_allocate(sizeof(zm_composition_t));
+        composition->name = ysw_heap_strdup(image->strings + r->name);
+        composition->bpm = r->bpm;
+        composition->parts = ysw_array_create(r->part_count);
+        for (uint32_t j = 0; j < r->part_count; j++) {
+            const zm_image_part_t *p = &image->parts[r->first_part + j];
+            zm_part_t *part = ysw_heap_allocate(sizeof(zm_part_t));
+            part->section = ysw_array_get(music->sections, p->section);
+            part->percent_volume = p->percent_volume;
+            part->when.type = p->when_type;
+            part->when.part_index = p->when_part_index;
+            part->fit = p->fit;
+            ysw_array_push(composition->parts, part);
+        }
+        ysw_array_push(music->compositions, composition);
+    }
+}
+
+// Returns NULL if there is no valid image at path, so that callers can fall back to CSV.
+// Only the section headers are loaded; the image stays open so that each section's steps
+// can be read when it is first used (see zm_load_section).
+
+zm_music_t *zm_image_load(const char *path)
+{
+    image_t image = {};
+    if (!map_image(&image, path)) {
+        return NULL;
+    }
+
+    image.header = (const zm_image_header_t *)image.base;
+    if (image.header->magic != ZM_IMAGE_MAGIC || image.header->version != ZM_IMAGE_VERSION) {
+        ESP_LOGE(TAG, "invalid image, path=%s, magic=%#x, version=%d", path,
+                image.header->magic, image.header->version);
+        unmap_image(&image);
+        return NULL;
+    }
+
+    if (!locate_tables(&image) || !validate_records(&image)) {
+        ESP_LOGE(TAG, "damaged image, path=%s, size=%d", path, image.size);
+        unmap_image(&image);
+        return NULL;
+    }
+
+    zm_music_t *music = ysw_heap_allocate(sizeof(zm_music_t));
+    music->settings.clock = image.header->clock;
+    load_chord_types(&image, music);
+    load_chord_styles(&image, music);
+    load_beats(&image, music);
+    load_sections(&image, music);
+    load_compositions(&image, music);
+
+    music->image_steps = ysw_heap_allocate(sizeof(zm_image_steps_t));
+    music->image_steps->file = open_steps(path);
+    music->image_steps->steps_offset = image.header->steps_offset;
+    music->image_steps->step_count = image.header->step_count;
+
+    ESP_LOGD(TAG, "load path=%s, sections=%d, steps=%d, compositions=%d", path,
+            image.header->section_count, image.header->step_count, image.header->composition_count);
+
+    unmap_image(&image);
+    return music;
+}
+
+typedef struct {
+    FILE *file;
+    zm_music_t *music;
+    const zm_image_header_t *header;
+    hash_t *chord_type_map;
+    hash_t *style_map;
+    hash_t *beat_map;
+    hash_t *section_map;
+    uint32_t string_size;
+} writer_t;
+
+static void write_bytes(FILE *file, const void *buffer, uint32_t length)
+{
+    if (length && fwrite(buffer, length, 1, file) != 1) {
+        ESP_LOGE(TAG, "fwrite failed, length=%d", length);
+        abort();
+    }
+}
+
+static inline uint32_t align(uint32_t offset)
+{
+    return (offset + ZM_IMAGE_ALIGNMENT - 1) & ~(ZM_IMAGE_ALIGNMENT - 1);
+}
+
+static void write_padding(FILE *file, uint32_t offset)
+{
+    static const uint8_t padding[ZM_IMAGE_ALIGNMENT];
+    write_bytes(file, padding, offset - ftell(file));
+}
+
+static hash_t *create_map(ysw_array_t *array)
+{
+    hash_t *map = hash_create(HASHCOUNT_T_MAX, NULL, NULL);
+    if (!map) {
+        ESP_LOGE(TAG, "hash_create failed");
+        abort();
+    }
+    uint32_t count = ysw_array_get_count(array);
+    for (uint32_t i = 0; i < count; i++) {
+        if (!hash_alloc_insert(map, ysw_array_get(array, i), (void *)(uintptr_t)i)) {
+            ESP_LOGE(TAG, "hash_alloc_insert failed");
+            abort();
+        }
+    }
+    return map;
+}
+
+static uint16_t get_index(hash_t *map, void *key)
+{
+    if (!key) {
+        return ZM_IMAGE_NONE;
+    }
+    hnode_t *node = hash_lookup(map, key);
+    if (!node) {
+        ESP_LOGE(TAG, "hash_lookup failed");
+        abort();
+    }
+    return (uintptr_t)hnode_get(node);
+}
+
+static void free_map(hash_t *map)
+{
+    hash_free_nodes(map);
+    hash_destroy(map);
+}
+
+// Strings are assigned offsets as the records are written, and written in the same order
+// by write_strings
+
+static uint32_t add_string(writer_t *writer, const char *value)
+{
+    uint32_t offset = writer->string_size;
+    writer->string_size += strlen(value) + 1;
+    return offset;
+}
+
+static void write_chord_types(writer_t *writer)
+{
+    write_padding(writer->file, writer->header->chord_types_offset);
+    uint32_t first_distance = 0;
+    uint32_t chord_type_count = ysw_array_get_count(writer->music->chord_types);
+    for (uint32_t i = 0; i < chord_type_count; i++) {
+        zm_chord_type_t *type = ysw_array_get(writer->music->chord_types, i);
+        zm_image_chord_type_t r = {
+            .name = add_string(writer, type->name),
+            .label = add_string(writer, type->label),
+            .first_distance = first_distance,
+            .distance_count = ysw_array_get_count(type->distances),
+        };
+        write_bytes(writer->file, &r, sizeof(r));
+        first_distance += r.distance_count;
+    }
+    write_padding(writer->file, writer->header->distances_offset);
+    for (uint32_t i = 0; i < chord_type_count; i++) {
+        zm_chord_type_t *type = ysw_array_get(writer->music->chord_types, i);
+        uint32_t distance_count = ysw_array_get_count(type->distances);
+        for (uint32_t j = 0; j < distance_count; j++) {
+            int8_t distance = (intptr_t)ysw_array_get(type->distances, j);
+            write_bytes(writer->file, &distance, sizeof(distance));
+        }
+    }
+}
+
+static void write_chord_styles(writer_t *writer)
+{
+    write_padding(writer->file, writer->header->chord_styles_offset);
+    uint32_t first_sound = 0;
+    uint32_t style_count = ysw_array_get_count(writer->music->chord_styles);
+    for (uint32_t i = 0; i < style_count; i++) {
+        zm_chord_style_t *style = ysw_array_get(writer->music->chord_styles, i);
+        zm_image_chord_style_t r = {
+            .name = add_string(writer, style->name),
+            .label = add_string(writer, style->label),
+            .first_sound = first_sound,
+            .sound_count = ysw_array_get_count(style->sounds),
+            .distance_count = style->distance_count,
+        };
+        write_bytes(writer->file, &r, sizeof(r));
+        first_sound += r.sound_count;
+    }
+    write_padding(writer->file, writer->header->sounds_offset);
+    for (uint32_t i = 0; i < style_count; i++) {
+        zm_chord_style_t *style = ysw_array_get(writer->music->chord_styles, i);
+        uint32_t sound_count = ysw_array_get_count(style->sounds);
+        for (uint32_t j = 0; j < sound_count; j++) {
+            zm_sound_t *sound = ysw_array_get(style->sounds, j);
+            zm_image_sound_t r = {
+                .start = sound->start,
+                .duration = sound->duration,
+                .distance_index = sound->distance_index,
+                .velocity = sound->velocity,
+            };
+            write_bytes(writer->file, &r, sizeof(r));
+        }
+    }
+}
+
+static void write_beats(writer_t *writer)
+{
+    write_padding(writer->file, writer->header->beats_offset);
+    uint32_t first_stroke = 0;
+    uint32_t beat_count = ysw_array_get_count(writer->music->beats);
+    for (uint32_t i = 0; i < beat_count; i++) {
+        zm_beat_t *beat = ysw_array_get(writer->music->beats, i);
+        zm_image_beat_t r = {
+            .name = add_string(writer, beat->name),
+            .label = add_string(writer, beat->label),
+            .first_stroke = first_stroke,
+            .stroke_count = ysw_array_get_count(beat->strokes),
+        };
+        write_bytes(writer->file, &r, sizeof(r));
+        first_stroke += r.stroke_count;
+    }
+    write_padding(writer->file, writer->header->strokes_offset);
+    for (uint32_t i = 0; i < beat_count; i++) {
+        zm_beat_t *beat = ysw_array_get(writer->music->beats, i);
+        uint32_t stroke_count = ysw_array_get_count(beat->strokes);
+        for (uint32_t j = 0; j < stroke_count; j++) {
+            zm_stroke_t *stroke = ysw_array_get(beat->strokes, j);
+            zm_image_stroke_t r = {
+                .start = stroke->start,
+                .surface = stroke->surface,
+                .velocity = stroke->velocity,
+            };
+            write_bytes(writer->file, &r, sizeof(r));
+        }
+    }
+}
+
+static void write_steps(writer_t *writer, zm_section_t *section)
+{
+    uint32_t step_count = ysw_array_get_count(section->steps);
+    for (uint32_t i = 0; i < step_count; i++) {
+        zm_step_t *step = ysw_array_get(section->steps, i);
+        zm_image_step_t r = {
+            .start = step->start,
+            .measure = step->measure,
+            .flags = step->flags,
+            .melody_duration = step->melody.duration,
+            .chord_duration = step->chord.duration,
+            .chord_type = get_index(writer->chord_type_map, step->chord.type),
+            .chord_style = get_index(writer->style_map, step->chord.style),
+            .beat = get_index(writer->beat_map, step->rhythm.beat),
+            .cadence = step->rhythm.cadence,
+            .melody_note = step->melody.note,
+            .tie = step->melody.tie,
+            .chord_root = step->chord.root,
+            .chord_frequency = step->chord.frequency,
+            .surface = step->rhythm.surface,
+        };
+        write_bytes(writer->file, &r, sizeof(r));
+    }
+}
+
+// Steps that haven't been loaded are copied from the current image, as they are, so that
+// they are checked when they are loaded. Their chord type, chord style and beat indexes stay
+// valid because those arrays aren't changed after loading.
+
+static void copy_steps(writer_t *writer, zm_section_t *section)
+{
+    zm_image_steps_t *image_steps = writer->music->image_steps;
+    if (!seek_step(image_steps, section->image_first_step)) {
+        ESP_LOGE(TAG, "fseek failed, step=%d", section->image_first_step);
+        abort();
+    }
+    for (zm_step_x i = 0; i < section->image_step_count; i++) {
+        zm_image_step_t r;
+        if (!read_step(image_steps, &r)) {
+            ESP_LOGE(TAG, "fread failed, step=%d", section->image_first_step + i);
+            abort();
+        }
+        write_bytes(writer->file, &r, sizeof(r));
+    }
+}
+
+static void write_sections(writer_t *writer)
+{
+    write_padding(writer->file, writer->header->sections_offset);
+    uint32_t first_step = 0;
+    uint32_t section_count = ysw_array_get_count(writer->music->sections);
+    for (uint32_t i = 0; i < section_count; i++) {
+        zm_section_t *section = ysw_array_get(writer->music->sections, i);
+        zm_image_section_t r = {
+            .name = add_string(writer, section->name),
+            .tlm = section->tlm,
+            .first_step = first_step,
+            .step_count = zm_get_step_count(section),
+            .tempo = section->tempo,
+            .key = section->key,
+            .time = section->time,
+            .melody_program = section->melody_program,
+            .chord_program = section->chord_program,
+        };
+        write_bytes(writer->file, &r, sizeof(r));
+        first_step += r.step_count;
+    }
+    write_padding(writer->file, writer->header->steps_offset);
+    first_step = 0;
+    for (uint32_t i = 0; i < section_count; i++) {
+        zm_section_t *section = ysw_array_get(writer->music->sections, i);
+        if (section->steps) {
+            write_steps(writer, section);
+        } else {
+            copy_steps(writer, section);
+            section->image_first_step = first_step;
+        }
+        first_step += zm_get_step_count(section);
+    }
+}
+
+static void write_compositions(writer_t *writer)
+{
+    write_padding(writer->file, writer->header->compositions_offset);
+    uint32_t first_part = 0;
+    uint32_t composition_count = ysw_array_get_count(writer->music->compositions);
+    for (uint32_t i = 0; i < composition_count; i++) {
+        zm_composition_t *composition = ysw_array_get(writer->music->compositions, i);
+        zm_image_composition_t r = {
+            .name = add_string(writer, composition->name),
+            .first_part = first_part,
+            .part_count = ysw_array_get_count(composition->parts),
+            .bpm = composition->bpm,
+        };
+        write_bytes(writer->file, &r, sizeof(r));
+        first_part += r.part_count;
+    }
+    write_padding(writer->file, writer->header->parts_offset);
+    for (uint32_t i = 0; i < composition_count; i++) {
+        zm_composition_t *composition = ysw_array_get(writer->music->compositions, i);
+        uint32_t part_count = ysw_array_get_count(composition->parts);
+        for (uint32_t j = 0; j < part_count; j++) {
+            zm_part_t *part = ysw_array_get(composition->parts, j);
+            zm_image_part_t r = {
+                .section = get_index(writer->section_map, part->section),
+                .when_part_index = part->when.part_index,
+                .percent_volume = part->percent_volume,
+                .when_type = part->when.type,
+                .fit = part->fit,
+            };
+            write_bytes(writer->file, &r, sizeof(r));
+        }
+    }
+}
+
+static void write_string(writer_t *writer, const char *value)
+{
+    write_bytes(writer->file, value, strlen(value) + 1);
+}
+
+static void write_strings(writer_t *writer)
+{
+    zm_music_t *music = writer->music;
+    uint32_t chord_type_count = ysw_array_get_count(music->chord_types);
+    for (uint32_t i = 0; i < chord_type_count; i++) {
+        zm_chord_type_t *type = ysw_array_get(music->chord_types, i);
+        write_string(writer, type->name);
+        write_string(writer, type->label);
+    }
+    uint32_t style_count = ysw_array_get_count(music->chord_styles);
+    for (uint32_t i = 0; i < style_count; i++) {
+        zm_chord_style_t *style = ysw_array_get(music->chord_styles, i);
+        write_string(writer, style->name);
+        write_string(writer, style->label);
+    }
+    uint32_t beat_count = ysw_array_get_count(music->beats);
+    for (uint32_t i = 0; i < beat_count; i++) {
+        zm_beat_t *beat = ysw_array_get(music->beats, i);
+        write_string(writer, beat->name);
+        write_string(writer, beat->label);
+    }
+    uint32_t section_count = ysw_array_get_count(music->sections);
+    for (uint32_t i = 0; i < section_count; i++) {
+        zm_section_t *section = ysw_array_get(music->sections, i);
+        write_string(writer, section->name);
+    }
+    uint32_t composition_count = ysw_array_get_count(music->compositions);
+    for (uint32_t i = 0; i < composition_count; i++) {
+        zm_composition_t *composition = ysw_array_get(music->compositions, i);
+        write_string(writer, composition->name);
+    }
+}
+
+static void count_records(zm_music_t *music, zm_image_header_t *header)
+{
+    header->chord_type_count = ysw_array_get_count(music->chord_types);
+    for (uint32_t i = 0; i < header->chord_type_count; i++) {
+        zm_chord_type_t *type = ysw_array_get(music->chord_types, i);
+        header->distance_count += ysw_array_get_count(type->distances);
+    }
+    header->chord_style_count = ysw_array_get_count(music->chord_styles);
+    for (uint32_t i = 0; i < header->chord_style_count; i++) {
+        zm_chord_style_t *style = ysw_array_get(music->chord_styles, i);
+        header->sound_count += ysw_array_get_count(style->sounds);
+    }
+    header->beat_count = ysw_array_get_count(music->beats);
+    for (uint32_t i = 0; i < header->beat_count; i++) {
+        zm_beat_t *beat = ysw_array_get(music->beats, i);
+        header->stroke_count += ysw_array_get_count(beat->strokes);
+    }
+    header->section_count = ysw_array_get_count(music->sections);
+    for (uint32_t i = 0; i < header->section_count; i++) {
+        zm_section_t *section = ysw_array_get(music->sections, i);
+        header->step_count += zm_get_step_count(section);
+    }
+    header->composition_count = ysw_array_get_count(music->compositions);
+    for (uint32_t i = 0; i < header->composition_count; i++) {
+        zm_composition_t *composition = ysw_array_get(music->compositions, i);
+        header->part_count += ysw_array_get_count(composition->parts);
+    }
+}
+
+// Steps that haven't been loaded are read from the new image once it is saved, so path
+// must not be the image they are currently read from
+
+void zm_image_save(zm_music_t *music, const char *path)
+{
+    extern void hash_ensure_assert_off();
+    hash_ensure_assert_off();
+
+    zm_image_header_t header = {
+        .magic = ZM_IMAGE_MAGIC,
+        .version = ZM_IMAGE_VERSION,
+        .clock = music->settings.clock,
+    };
+
+    count_records(music, &header);
+
+    header.chord_types_offset = align(sizeof(zm_image_header_t));
+    header.distances_offset = align(header.chord_types_offset + header.chord_type_count * sizeof(zm_image_chord_type_t));
+    header.chord_styles_offset = align(header.distances_offset + header.distance_count * sizeof(int8_t));
+    header.sounds_offset = align(header.chord_styles_offset + header.chord_style_count * sizeof(zm_image_chord_style_t));
+    header.beats_offset = align(header.sounds_offset + header.sound_count * sizeof(zm_image_sound_t));
+    header.strokes_offset = align(header.beats_offset + header.beat_count * sizeof(zm_image_beat_t));
+    header.sections_offset = align(header.strokes_offset + header.stroke_count * sizeof(zm_image_stroke_t));
+    header.steps_offset = align(header.sections_offset + header.section_count * sizeof(zm_image_section_t));
+    header.compositions_offset = align(header.steps_offset + header.step_count * sizeof(zm_image_step_t));
+    header.parts_offset = align(header.compositions_offset + header.composition_count * sizeof(zm_image_composition_t));
+    header.strings_offset = align(header.parts_offset + header.part_count * sizeof(zm_image_part_t));
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        ESP_LOGE(TAG, "fopen failed, file=%s", path);
+        abort();
+    }
+
+    writer_t writer = {
+        .file = file,
+        .music = music,
+        .chord_type_map = create_map(music->chord_types),
+        .style_map = create_map(music->chord_styles),
+        .beat_map = create_map(music->beats),
+        .section_map = create_map(music->sections),
+        .header = &header,
+    };
+
+    // The header is written again once the size of the string table is known
+
+    write_bytes(file, &header, sizeof(header));
+    write_chord_types(&writer);
+    write_chord_styles(&writer);
+    write_beats(&writer);
+    write_sections(&writer);
+    write_compositions(&writer);
+    write_padding(file, header.strings_offset);
+    write_strings(&writer);
+
+    header.string_size = writer.string_size;
+    if (fseek(file, 0, SEEK_SET) == -1) {
+        ESP_LOGE(TAG, "fseek failed, file=%s", path);
+        abort();
+    }
+    write_bytes(file, &header, sizeof(header));
+    fclose(file);
+
+    if (music->image_steps) {
+        fclose(music->image_steps->file);
+        music->image_steps->file = open_steps(path);
+        music->image_steps->steps_offset = header.steps_offset;
+        music->image_steps->step_count = header.step_count;
+    }
+
+    free_map(writer.chord_type_map);
+    free_map(writer.style_map);
+    free_map(writer.beat_map);
+    free_map(writer.section_map);
+
+    ESP_LOGD(TAG, "save path=%s, sections=%d, steps=%d, bytes=%d", path,
+            header.section_count, header.step_count, header.strings_offset + header.string_size);
+}
+
+// Moves the image from old_path to new_path, replacing any existing image. The image is
+// closed while it is renamed, for file systems that don't allow renaming an open file.
+
+void zm_image_rename(zm_music_t *music, const char *old_path, const char *new_path)
+{
+    if (music->image_steps) {
+        fclose(music->image_steps->file);
+    }
+
+    int rc = unlink(new_path);
+    if (rc == -1 && errno != ENOENT) {
+        ESP_LOGE(TAG, "unlink file=%s failed, errno=%d", new_path, errno);
+        abort();
+    }
+
+    rc = rename(old_path, new_path);
+    if (rc == -1) {
+        ESP_LOGE(TAG, "rename old=%s, new=%s failed, errno=%d", old_path, new_path, errno);
+        abort();
+    }
+
+    if (music->image_steps) {
+        music->image_steps->file = open_steps(new_path);
+    }
+}
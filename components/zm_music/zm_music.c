@@ -8,6 +8,7 @@
 // warranties or conditions of any kind, either express or implied.
 
 #include "zm_music.h"
+#include "zm_image.h"
 
 #include "ysw_common.h"
 #include "ysw_csv.h"
@@ -367,6 +368,7 @@ static void emit_sections(zm_mfw_t *zm_mfw)
     for (uint32_t i = 0; i < section_count; i++) {
         char name[NAME_SIZE];
         zm_section_t *section = ysw_array_get(zm_mfw->music->sections, i);
+        zm_load_section(zm_mfw->music, section);
         put_map(zm_mfw->section_map, section, i);
         ysw_csv_escape(section->name, name, sizeof(name));
         fprintf(zm_mfw->file, "%d,%d,%s,%d,%d,%d,%d,%d,%d\n",
@@ -492,7 +494,12 @@ static zm_music_t *create_music()
 void zm_section_free(zm_section_t *section)
 {
     ysw_heap_free(section->name);
-    ysw_array_free_all(section->steps);
+    if (section->steps) {
+        ysw_array_free_all(section->steps);
+    }
+    if (section->cache) {
+        ysw_notes_free(section->cache);
+    }
     ysw_heap_free(section);
 }
 
@@ -549,6 +556,10 @@ void zm_music_free(zm_music_t *music)
         ysw_array_free_all(composition->parts);
     }
     ysw_array_free(music->compositions);
+    if (music->image_steps) {
+        fclose(music->image_steps->file);
+        ysw_heap_free(music->image_steps);
+    }
 }
 
 zm_music_t *zm_parse_file(FILE *file)
@@ -617,9 +628,26 @@ void zm_emit_file(FILE *file, zm_music_t *music)
     free_map(zm_mfw->composition_map);
 }
 
+// Loads the music image if there is one, otherwise imports the CSV file. zm_save_music
+// only writes the image, so the CSV file holds the music as of the last zm_export_music,
+// and changes saved since then are lost if the image has to be replaced by the CSV file.
+
 zm_music_t *zm_load_music(void)
 {
-    zm_music_t *music = NULL;
+    zm_music_t *music = zm_image_load(ZM_MF_IMAGE);
+    if (!music && rename(ZM_MF_IMAGE_TEMP, ZM_MF_IMAGE) == 0) {
+        // spiffs doesn't provide atomic rename, so recover from partial rename in zm_save_music
+        music = zm_image_load(ZM_MF_IMAGE);
+    }
+    if (music) {
+        return music;
+    }
+
+    struct stat sb;
+    if (stat(ZM_MF_IMAGE, &sb) == 0) {
+        ESP_LOGE(TAG, "image file=%s is damaged, importing file=%s instead", ZM_MF_IMAGE, ZM_MF_CSV);
+    }
+
     FILE *file = fopen(ZM_MF_CSV, "r");
     if (!file) {
         // spiffs doesn't provide atomic rename, so check for temp file
@@ -642,27 +670,41 @@ zm_music_t *zm_load_music(void)
 
 void zm_save_music(zm_music_t *music)
 {
-    FILE *file = fopen(ZM_MF_TEMP, "w");
-    if (!file) {
-        ESP_LOGE(TAG, "fopen file=%s failed, errno=%d", ZM_MF_TEMP, errno);
-        abort();
-    }
+    zm_image_save(music, ZM_MF_IMAGE_TEMP);
 
-    zm_emit_file(file, music);
-    fclose(file);
+    // spiffs doesn't provide atomic rename, zm_load_music handles recovery of partial rename
+    zm_image_rename(music, ZM_MF_IMAGE_TEMP, ZM_MF_IMAGE);
+}
 
-    // spiffs doesn't provide atomic rename, zm_mfr_read handles recovery of partial rename
-    int rc = unlink(ZM_MF_CSV);
-    if (rc == -1) {
-        ESP_LOGE(TAG, "unlink file=%s failed, errno=%d", ZM_MF_CSV, errno);
-        abort();
+// Reads the steps of a section loaded from the music image, the first time they're needed.
+// Returns false, leaving the section empty, if the steps are damaged.
+
+bool zm_load_section(zm_music_t *music, zm_section_t *section)
+{
+    if (!section->steps) {
+        return zm_image_load_steps(music, section);
     }
+    return true;
+}
 
-    rc = rename(ZM_MF_TEMP, ZM_MF_CSV);
-    if (rc == -1) {
-        ESP_LOGE(TAG, "rename old=%s, new=%s failed, errno=%d", ZM_MF_TEMP, ZM_MF_CSV, errno);
+// Returns the number of steps without loading them
+
+zm_step_x zm_get_step_count(const zm_section_t *section)
+{
+    return section->steps ? ysw_array_get_count(section->steps) : section->image_step_count;
+}
+
+// Writes the music in the CSV format read by zm_load_music when there is no image
+
+void zm_export_music(zm_music_t *music, const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        ESP_LOGE(TAG, "fopen file=%s failed, errno=%d", path, errno);
         abort();
     }
+    zm_emit_file(file, music);
+    fclose(file);
 }
 
 #include "ysw_midi.h"
@@ -671,8 +713,8 @@ void zm_save_music(zm_music_t *music)
 
 int zm_note_compare(const void *left, const void *right)
 {
-    const ysw_note_t *left_note = *(ysw_note_t * const *)left;
-    const ysw_note_t *right_note = *(ysw_note_t * const *)right;
+    const ysw_note_t *left_note = left;
+    const ysw_note_t *right_note = right;
     int delta = left_note->start - right_note->start;
     if (!delta) {
         delta = left_note->channel - right_note->channel;
@@ -751,21 +793,64 @@ zm_time_x zm_get_step_duration(zm_step_t *step, zm_time_x ticks_per_measure)
 }
 #endif
 
-// TODO: pass starting step_x as a small optimization
-
 void zm_recalculate_section(zm_section_t *section)
+{
+    zm_step_x step_count = ysw_array_get_count(section->steps);
+    zm_recalculate_section_from(section, 0, step_count);
+}
+
+// Recalculates the steps from first_step on, after steps were changed, inserted or removed.
+// Steps before first_step must be unchanged, as must steps from unchanged_step on, apart from
+// having moved. When a measure starts at an unchanged step that also started a measure before
+// the edit, the rest of the steps keep their flags and are just shifted.
+
+void zm_recalculate_section_from(zm_section_t *section, zm_step_x first_step, zm_step_x unchanged_step)
 {
     zm_time_x start = 0;
     zm_measure_x measure = 1;
     uint32_t ticks_in_measure = 0;
 
-    zm_step_t *step = NULL;
-
     zm_time_x ticks_per_measure = zm_get_ticks_per_measure(section->time);
     zm_step_x step_count = ysw_array_get_count(section->steps);
+    assert(first_step <= unchanged_step && unchanged_step <= step_count);
 
-    for (zm_step_x i = 0; i < step_count; i++) {
-        step = ysw_array_get(section->steps, i);
+    if (first_step) {
+        zm_step_t *previous = ysw_array_get(section->steps, first_step - 1);
+        start = previous->start + zm_get_step_duration(previous, ticks_per_measure);
+        measure = previous->measure;
+        if (previous->flags & ZM_STEP_END_OF_MEASURE) {
+            measure++;
+        } else {
+            zm_step_x measure_step = first_step - 1;
+            while (measure_step > 0) {
+                zm_step_t *step = ysw_array_get(section->steps, measure_step - 1);
+                if (step->flags & ZM_STEP_END_OF_MEASURE) {
+                    break;
+                }
+                measure_step--;
+            }
+            zm_step_t *step = ysw_array_get(section->steps, measure_step);
+            ticks_in_measure = start - step->start;
+        }
+    }
+
+    bool was_end_of_measure = false;
+
+    for (zm_step_x i = first_step; i < step_count; i++) {
+        zm_step_t *step = ysw_array_get(section->steps, i);
+
+        if (i > unchanged_step && was_end_of_measure && !ticks_in_measure) {
+            zm_time_x start_delta = start - step->start;
+            zm_measure_x measure_delta = measure - step->measure;
+            for (zm_step_x j = i; j < step_count && (start_delta || measure_delta); j++) {
+                zm_step_t *moved_step = ysw_array_get(section->steps, j);
+                moved_step->start += start_delta;
+                moved_step->measure += measure_delta;
+            }
+            break;
+        }
+
+        was_end_of_measure = step->flags & ZM_STEP_END_OF_MEASURE;
         step->start = start;
         step->flags = 0;
         step->measure = measure;
@@ -783,26 +868,35 @@ void zm_recalculate_section(zm_section_t *section)
         }
         start += step_duration;
     }
+    zm_invalidate_section(section);
+}
+
+// Discards the section's cached notes the next time they are requested. Edits that don't go
+// through zm_recalculate_section must call this.
+
+void zm_invalidate_section(zm_section_t *section)
+{
+    section->revision++;
 }
 
-void zm_render_note(ysw_array_t *notes, zm_channel_x channel, zm_note_t midi_note,
+void zm_render_note(ysw_notes_t *notes, zm_channel_x channel, zm_note_t midi_note,
         zm_time_x start, zm_duration_t duration, zm_program_x program_index)
 {
-    ysw_note_t *note = ysw_heap_allocate(sizeof(ysw_note_t));
+    ysw_note_t *note = ysw_notes_add(notes);
     note->channel = channel;
     note->midi_note = midi_note;
     note->start = start;
     note->duration = duration;
     note->velocity = 100;
     note->program = program_index;
-    ysw_array_push(notes, note);
 }
 
-void zm_render_melody(ysw_array_t *notes, zm_melody_t *melody, zm_time_x melody_start,
+void zm_render_melody(ysw_notes_t *notes, zm_melody_t *melody, zm_time_x melody_start,
         zm_channel_x channel, zm_program_x program_index, zm_tie_x tie)
 {
-    if (tie && ysw_array_get_count(notes)) {
-        ysw_note_t *tied_previous = ysw_array_get_top(notes);
+    uint32_t note_count = ysw_notes_get_count(notes);
+    if (tie && note_count) {
+        ysw_note_t *tied_previous = ysw_notes_get(notes, note_count - 1);
         if (tied_previous->midi_note == melody->note) {
             tied_previous->duration += melody->duration;
             return;
@@ -819,7 +913,7 @@ void zm_render_melody(ysw_array_t *notes, zm_melody_t *melody, zm_time_x melody_
 // The chord duration is the number of ticks to fit those 1024 style ticks into.
 // For example, the chord duration would be 768 for a full measure chord in 3/4 time.
 
-void zm_render_chord(ysw_array_t *notes, zm_chord_t *chord, zm_time_x chord_start,
+void zm_render_chord(ysw_notes_t *notes, zm_chord_t *chord, zm_time_x chord_start,
         zm_channel_x channel, zm_program_x program_index)
 {
     zm_medium_t distance_count = ysw_array_get_count(chord->type->distances);
@@ -831,35 +925,33 @@ void zm_render_chord(ysw_array_t *notes, zm_chord_t *chord, zm_time_x chord_star
             continue;
         } 
         zm_distance_t distance = (intptr_t)ysw_array_get(chord->type->distances, sound->distance_index);
-        ysw_note_t *note = ysw_heap_allocate(sizeof(ysw_note_t));
+        ysw_note_t *note = ysw_notes_add(notes);
         note->channel = channel;
         note->midi_note = chord->root + distance;
         note->start = chord_start + (sound->start * chord->duration) / STYLE_DURATION;
         note->duration = (sound->duration * chord->duration) / STYLE_DURATION;
         note->velocity = sound->velocity;
         note->program = program_index;
-        ysw_array_push(notes, note);
     }
 }
 
-void zm_render_beat(ysw_array_t *notes, zm_beat_t *beat, zm_time_x beat_start,
+void zm_render_beat(ysw_notes_t *notes, zm_beat_t *beat, zm_time_x beat_start,
         zm_channel_x channel, zm_program_x program_index)
 {
     zm_stroke_x stroke_count = ysw_array_get_count(beat->strokes);
     for (zm_stroke_x i = 0; i < stroke_count; i++) {
         zm_stroke_t *stroke = ysw_array_get(beat->strokes, i);
-        ysw_note_t *note = ysw_heap_allocate(sizeof(ysw_note_t));
+        ysw_note_t *note = ysw_notes_add(notes);
         note->channel = channel;
         note->midi_note = stroke->surface;
         note->start = beat_start + stroke->start;
         note->duration = 128;
         note->velocity = stroke->velocity;
         note->program = program_index;
-        ysw_array_push(notes, note);
     }
 }
 
-void zm_render_rhythm(ysw_array_t *notes, zm_rhythm_t *rhythm, zm_time_x rhythm_start,
+void zm_render_rhythm(ysw_notes_t *notes, zm_rhythm_t *rhythm, zm_time_x rhythm_start,
         zm_channel_x channel, zm_program_x program_index)
 {
     if (rhythm->beat) {
@@ -870,9 +962,9 @@ void zm_render_rhythm(ysw_array_t *notes, zm_rhythm_t *rhythm, zm_time_x rhythm_
     }
 }
 
-ysw_array_t *zm_render_step(zm_music_t *m, zm_section_t *p, zm_step_t *d, zm_channel_x bc)
+ysw_notes_t *zm_render_step(zm_music_t *m, zm_section_t *p, zm_step_t *d, zm_channel_x bc)
 {
-    ysw_array_t *notes = ysw_array_create(16);
+    ysw_notes_t *notes = ysw_notes_create(16);
     if (d->melody.note) {
         zm_render_melody(notes, &d->melody, 0, bc, p->melody_program, 0);
     }
@@ -882,16 +974,20 @@ ysw_array_t *zm_render_step(zm_music_t *m, zm_section_t *p, zm_step_t *d, zm_cha
     if (d->rhythm.beat || d->rhythm.surface) {
         zm_render_rhythm(notes, &d->rhythm, 0, bc + 2, YSW_MIDI_DRUM_PROGRAM);
     }
-    ysw_array_sort(notes, zm_note_compare);
+    ysw_notes_sort(notes, zm_note_compare);
     return notes;
 }
 
-zm_time_x zm_render_section_notes(ysw_array_t *notes, zm_music_t *music, zm_section_t *section,
-        zm_time_x start_time, zm_channel_x base_channel)
+// Renders the section in three passes, for melody, chords and rhythms, each of which adds
+// a run of notes that is (usually) in time order, and pushes the end of each run onto
+// run_ends for ysw_notes_merge.
+
+zm_time_x zm_render_section_notes(ysw_notes_t *notes, ysw_array_t *run_ends, zm_music_t *music,
+        zm_section_t *section, zm_time_x start_time, zm_channel_x base_channel)
 {
+    assert(section->steps);
     zm_tie_x tie = 0;
     zm_step_x step_count = ysw_array_get_count(section->steps);
-    // two passes: one to do melody note ties, the other for chords and rhythms
     for (zm_step_x i = 0; i < step_count; i++) {
         zm_step_t *step = ysw_array_get(section->steps, i);
         if (step->melody.note) {
@@ -904,75 +1000,166 @@ zm_time_x zm_render_section_notes(ysw_array_t *notes, zm_music_t *music, zm_sect
             }
         }
     }
-    zm_time_x step_end = 0;
-    zm_time_x ticks_per_measure = zm_get_ticks_per_measure(section->time);
+    ysw_array_push(run_ends, (void *)(intptr_t)ysw_notes_get_count(notes));
     for (zm_step_x i = 0; i < step_count; i++) {
         zm_step_t *step = ysw_array_get(section->steps, i);
-        zm_time_x step_start = start_time + step->start;
         if (step->chord.root) {
+            zm_time_x step_start = start_time + step->start;
             zm_render_chord(notes, &step->chord, step_start, base_channel + 1, section->chord_program);
         }
+    }
+    ysw_array_push(run_ends, (void *)(intptr_t)ysw_notes_get_count(notes));
+    zm_time_x step_end = 0;
+    zm_time_x ticks_per_measure = zm_get_ticks_per_measure(section->time);
+    for (zm_step_x i = 0; i < step_count; i++) {
+        zm_step_t *step = ysw_array_get(section->steps, i);
+        zm_time_x step_start = start_time + step->start;
         if (step->rhythm.beat || step->rhythm.surface) {
             zm_render_rhythm(notes, &step->rhythm, step_start, base_channel + 2, YSW_MIDI_DRUM_PROGRAM);
         }
         zm_time_x step_duration = zm_get_step_duration(step, ticks_per_measure);
         step_end = step_start + step_duration;
     }
+    ysw_array_push(run_ends, (void *)(intptr_t)ysw_notes_get_count(notes));
     return step_end;
 }
 
-ysw_array_t *zm_render_section(zm_music_t *music, zm_section_t *section, zm_channel_x base_channel)
+// Returns the section's notes, sorted, from the cache, rendering them first if the section
+// has changed since they were cached. The cache is owned by the section and must only be
+// used by the task that edits the section.
+
+static ysw_notes_t *get_section_notes(zm_music_t *music, zm_section_t *section)
+{
+    zm_load_section(music, section);
+    if (!section->cache) {
+        section->cache = ysw_notes_create(64);
+    } else if (section->cache_revision == section->revision) {
+        return section->cache;
+    }
+    ysw_notes_clear(section->cache);
+    ysw_array_t *run_ends = ysw_array_create(3);
+    zm_render_section_notes(section->cache, run_ends, music, section, 0, 0);
+    ysw_notes_merge(section->cache, run_ends, zm_note_compare);
+    ysw_array_free(run_ends);
+    section->cache_revision = section->revision;
+    return section->cache;
+}
+
+// Appends a copy of the section notes, moved to start_time and base_channel and scaled to
+// percent_volume
+
+static void splice_notes(ysw_notes_t *notes, ysw_notes_t *section_notes,
+        zm_time_x start_time, zm_channel_x base_channel, zm_percent_x percent_volume)
+{
+    uint32_t first_note = ysw_notes_get_count(notes);
+    ysw_notes_append(notes, section_notes->notes, ysw_notes_get_count(section_notes));
+    if (start_time || base_channel || percent_volume != 100) {
+        uint32_t note_count = ysw_notes_get_count(notes);
+        for (uint32_t i = first_note; i < note_count; i++) {
+            ysw_note_t *note = ysw_notes_get(notes, i);
+            note->start += start_time;
+            note->channel += base_channel;
+            note->velocity = (percent_volume * note->velocity) / 100;
+        }
+    }
+}
+
+static void splice_section(ysw_notes_t *notes, zm_music_t *music, zm_section_t *section,
+        zm_time_x start_time, zm_channel_x base_channel, zm_percent_x percent_volume)
+{
+    splice_notes(notes, get_section_notes(music, section), start_time, base_channel, percent_volume);
+}
+
+ysw_notes_t *zm_render_section(zm_music_t *music, zm_section_t *section, zm_channel_x base_channel)
 {
-    ysw_array_t *notes = ysw_array_create(512);
-    zm_render_section_notes(notes, music, section, 0, base_channel);
-    ysw_array_sort(notes, zm_note_compare);
+    ysw_notes_t *notes = ysw_notes_create(ysw_notes_get_count(get_section_notes(music, section)));
+    splice_section(notes, music, section, 0, base_channel, 100);
     return notes;
 }
 
-static void adjust_volume(ysw_array_t *notes, zm_note_x first_note, zm_percent_x percent_volume)
+// A segment is one rendering of a section in a composition. A part that is fit to another
+// part by looping has a segment for each iteration.
+
+typedef struct {
+    zm_section_t *section;
+    zm_time_x start_time;
+    zm_channel_x channel;
+    zm_percent_x percent_volume;
+    uint32_t revision; // section's revision when the segment was scheduled
+    ysw_notes_t *notes; // copy of the section's notes, made when the composition stream reaches the segment
+} segment_t;
+
+static int compare_segments(const void *left, const void *right)
+{
+    const segment_t *left_segment = *(segment_t * const *)left;
+    const segment_t *right_segment = *(segment_t * const *)right;
+    return (left_segment->start_time > right_segment->start_time) -
+            (left_segment->start_time < right_segment->start_time);
+}
+
+// Returns the same end time as zm_render_section_notes, without rendering the notes
+
+static zm_time_x get_section_end(zm_section_t *section, zm_time_x start_time)
 {
-    zm_note_x note_count = ysw_array_get_count(notes);
-    for (zm_note_x i = first_note; i < note_count; i++) {
-        ysw_note_t *note = ysw_array_get(notes, i);
-        note->velocity = (percent_volume * note->velocity) / 100;
+    zm_step_x step_count = ysw_array_get_count(section->steps);
+    if (!step_count) {
+        return 0;
     }
+    zm_step_t *step = ysw_array_get(section->steps, step_count - 1);
+    zm_time_x ticks_per_measure = zm_get_ticks_per_measure(section->time);
+    return start_time + step->start + zm_get_step_duration(step, ticks_per_measure);
+}
+
+static zm_time_x add_segment(ysw_array_t *segments, zm_part_t *part, zm_time_x start_time, zm_channel_x channel)
+{
+    segment_t *segment = ysw_heap_allocate(sizeof(segment_t));
+    segment->section = part->section;
+    segment->start_time = start_time;
+    segment->channel = channel;
+    segment->percent_volume = part->percent_volume;
+    segment->revision = part->section->revision;
+    ysw_array_push(segments, segment);
+    return get_section_end(part->section, start_time);
 }
 
-ysw_array_t *zm_render_composition(zm_music_t *music, zm_composition_t *composition,
+// Works out when each part of the composition plays, and returns the resulting segments,
+// sorted by start time. Loads the steps of each section that hasn't been loaded yet.
+
+static ysw_array_t *schedule_composition(zm_music_t *music, zm_composition_t *composition,
         zm_channel_x base_channel)
 {
     zm_time_x max_time = 0;
-    ysw_array_t *notes = ysw_array_create(512);
+    ysw_array_t *segments = ysw_array_create(8);
     ysw_array_t *part_times = ysw_array_create(8);
     zm_medium_t part_count = ysw_array_get_count(composition->parts);
     for (zm_medium_t i = 0; i < part_count; i++) {
-        zm_note_x first_note = ysw_array_get_count(notes);
         zm_time_x begin_time = 0;
         zm_time_x end_time = 0;
         zm_part_t *part = ysw_array_get(composition->parts, i);
+        zm_load_section(music, part->section);
         zm_channel_x channel = base_channel + (i * 3);
         if (i == part->when.part_index) {
             begin_time = max_time;
-            end_time = zm_render_section_notes(notes, music, part->section, begin_time, channel);
+            end_time = add_segment(segments, part, begin_time, channel);
         } else if (part->when.type == ZM_WHEN_TYPE_WITH) {
             zm_part_time_t *part_time = ysw_array_get(part_times, part->when.part_index);
             begin_time = part_time->begin_time;
             if (part->fit == ZM_FIT_LOOP) {
                 zm_time_x loop_time = begin_time;
                 while (end_time < part_time->end_time) {
-                    end_time = zm_render_section_notes(notes, music, part->section, loop_time, channel);
+                    end_time = add_segment(segments, part, loop_time, channel);
+                    if (end_time <= loop_time) {
+                        break; // empty section
+                    }
                     loop_time = end_time;
-                } 
+                }
             } else {
-                end_time = zm_render_section_notes(notes, music, part->section, begin_time, channel);
+                end_time = add_segment(segments, part, begin_time, channel);
             }
         } else if (part->when.type == ZM_WHEN_TYPE_AFTER) {
             zm_part_time_t *part_time = ysw_array_get(part_times, part->when.part_index);
             begin_time = part_time->end_time;
-            end_time = zm_render_section_notes(notes, music, part->section, begin_time, channel);
-        }
-        if (part->percent_volume != 100) {
-            adjust_volume(notes, first_note, part->percent_volume);
+            end_time = add_segment(segments, part, begin_time, channel);
         }
         zm_part_time_t *part_time = ysw_heap_allocate(sizeof(zm_part_time_t));
         part_time->begin_time = begin_time;
@@ -981,11 +1168,217 @@ ysw_array_t *zm_render_composition(zm_music_t *music, zm_composition_t *composit
         max_time = max(max_time, end_time);
     }
     ysw_array_free_all(part_times);
-    ysw_array_sort(notes, zm_note_compare);
-    ESP_LOGD(TAG, "composition note_count=%d", ysw_array_get_count(notes));
+    ysw_array_sort(segments, compare_segments);
+    return segments;
+}
+
+ysw_notes_t *zm_render_composition(zm_music_t *music, zm_composition_t *composition,
+        zm_channel_x base_channel)
+{
+    ysw_notes_t *notes = ysw_notes_create(512);
+    ysw_array_t *segments = schedule_composition(music, composition, base_channel);
+    uint32_t segment_count = ysw_array_get_count(segments);
+    ysw_array_t *run_ends = ysw_array_create(segment_count);
+    for (uint32_t i = 0; i < segment_count; i++) {
+        segment_t *segment = ysw_array_get(segments, i);
+        splice_section(notes, music, segment->section, segment->start_time, segment->channel,
+                segment->percent_volume);
+        ysw_array_push(run_ends, (void *)(intptr_t)ysw_notes_get_count(notes));
+    }
+    ysw_array_free_all(segments);
+    ysw_notes_merge(notes, run_ends, zm_note_compare);
+    ysw_array_free(run_ends);
+    ESP_LOGD(TAG, "composition note_count=%d", ysw_notes_get_count(notes));
     return notes;
 }
 
+#include "ysw_tempo.h"
+
+// Returns the tempo of the segment that starts at the given segment index, or at the same
+// time as it, from the earliest part (i.e. the lowest channel)
+
+static zm_tempo_x get_segment_tempo(ysw_array_t *segments, uint32_t index)
+{
+    segment_t *segment = ysw_array_get(segments, index);
+    uint32_t segment_count = ysw_array_get_count(segments);
+    for (uint32_t i = 0; i < segment_count; i++) {
+        segment_t *other = ysw_array_get(segments, i);
+        if (other->start_time == segment->start_time && other->channel < segment->channel) {
+            segment = other;
+        }
+    }
+    return segment->section->tempo;
+}
+
+// The composition's bpm is the tempo of its first section. Each later section plays at the
+// same ratio to bpm as its tempo is to the first section's, so the sequencer can scale the
+// whole composition with a single tempo change.
+
+ysw_array_t *zm_get_composition_tempos(zm_music_t *music, zm_composition_t *composition)
+{
+    ysw_array_t *tempos = NULL;
+    ysw_array_t *segments = schedule_composition(music, composition, 0);
+    uint32_t segment_count = ysw_array_get_count(segments);
+    if (segment_count) {
+        zm_tempo_x first_tempo = get_segment_tempo(segments, 0);
+        uint8_t current_bpm = composition->bpm;
+        for (uint32_t i = 1; i < segment_count && first_tempo; i++) {
+            segment_t *segment = ysw_array_get(segments, i);
+            uint32_t bpm = (composition->bpm * get_segment_tempo(segments, i)) / first_tempo;
+            bpm = min(max(bpm, 1), UINT8_MAX);
+            if (bpm != current_bpm) {
+                if (!tempos) {
+                    tempos = ysw_array_create(4);
+                }
+                ysw_tempo_t *tempo = ysw_heap_allocate(sizeof(ysw_tempo_t));
+                tempo->start = segment->start_time;
+                tempo->bpm = bpm;
+                ysw_array_push(tempos, tempo);
+                current_bpm = bpm;
+            }
+        }
+    }
+    ysw_array_free_all(segments);
+    return tempos;
+}
+
+// A composition stream renders each segment when the piece containing its start is
+// requested, and holds its notes until the pieces containing them are requested, so only
+// the segments that overlap the current piece are in memory at once. The stream runs on
+// the sequencer task, so it renders each section from its own copy of the section's notes,
+// made when the first segment that plays the section is reached.
+
+typedef struct {
+    ysw_note_source_t source; // must be first
+    zm_music_t *music;
+    ysw_array_t *snapshots; // notes for each section reached so far
+    ysw_array_t *segments;
+    uint32_t next_segment;
+    ysw_notes_t *pending; // notes that have been rendered, but not returned, sorted by start
+    ysw_notes_t *pieces[2]; // notes returned by the two most recent calls to next
+    uint32_t piece_count; // number of calls to next, selects the piece to reuse
+    ysw_array_t *run_ends; // runs added to pending while rendering the next piece
+    zm_time_x position; // start of next piece
+} composition_stream_t;
+
+// Sections that are played more than once share a single copy of their notes. The section's
+// cache is copied if it is current, otherwise the section is rendered into the copy, because
+// the cache belongs to the task that edits the section.
+
+static ysw_notes_t *snapshot_section(composition_stream_t *stream, segment_t *segment)
+{
+    for (uint32_t i = 0; i < stream->next_segment; i++) {
+        segment_t *previous = ysw_array_get(stream->segments, i);
+        if (previous->section == segment->section) {
+            return previous->notes;
+        }
+    }
+    zm_section_t *section = segment->section;
+    if (section->revision != segment->revision) {
+        ESP_LOGW(TAG, "snapshot_section section=%s changed while streaming", section->name);
+    }
+    ysw_notes_t *notes = NULL;
+    if (section->cache && section->cache_revision == section->revision) {
+        notes = ysw_notes_create(ysw_notes_get_count(section->cache));
+        ysw_notes_append(notes, section->cache->notes, ysw_notes_get_count(section->cache));
+    } else {
+        notes = ysw_notes_create(64);
+        ysw_array_t *run_ends = ysw_array_create(3);
+        zm_render_section_notes(notes, run_ends, stream->music, section, 0, 0);
+        ysw_notes_merge(notes, run_ends, zm_note_compare);
+        ysw_array_free(run_ends);
+    }
+    ysw_array_push(stream->snapshots, notes);
+    return notes;
+}
+
+static ysw_notes_t *next_piece(ysw_note_source_t *source, uint32_t *length)
+{
+    composition_stream_t *stream = (composition_stream_t *)source;
+    uint32_t segment_count = ysw_array_get_count(stream->segments);
+    uint32_t pending_count = ysw_notes_get_count(stream->pending);
+
+    if (stream->position && !pending_count && stream->next_segment == segment_count) {
+        return NULL;
+    }
+
+    // A gap with nothing to play is returned as a single empty piece
+
+    zm_time_x end = stream->position + ZM_STREAM_PIECE_TICKS;
+    if (!pending_count && stream->next_segment < segment_count) {
+        segment_t *segment = ysw_array_get(stream->segments, stream->next_segment);
+        end = max(end, segment->start_time);
+    }
+
+    // The pending notes are already sorted, so they form the first run
+
+    ysw_array_set_count(stream->run_ends, 0);
+    ysw_array_push(stream->run_ends, (void *)(intptr_t)pending_count);
+    while (stream->next_segment < segment_count) {
+        segment_t *segment = ysw_array_get(stream->segments, stream->next_segment);
+        if (segment->start_time >= end) {
+            break;
+        }
+        segment->notes = snapshot_section(stream, segment);
+        splice_notes(stream->pending, segment->notes, segment->start_time, segment->channel,
+                segment->percent_volume);
+        ysw_array_push(stream->run_ends, (void *)(intptr_t)ysw_notes_get_count(stream->pending));
+        stream->next_segment++;
+    }
+    if (ysw_notes_get_count(stream->pending) != pending_count) {
+        ysw_notes_merge(stream->pending, stream->run_ends, zm_note_compare);
+    }
+
+    // Notes never start before their segment, so every note that starts before end has
+    // been rendered
+
+    ysw_notes_t *piece = stream->pieces[stream->piece_count++ % 2];
+    uint32_t note_count = ysw_notes_find_start(stream->pending, end);
+    ysw_notes_clear(piece);
+    ysw_notes_append(piece, stream->pending->notes, note_count);
+    ysw_notes_remove_first(stream->pending, note_count);
+    for (uint32_t i = 0; i < note_count; i++) {
+        ysw_notes_get(piece, i)->start -= stream->position;
+    }
+
+    *length = end - stream->position;
+    stream->position = end;
+    return piece;
+}
+
+static void free_stream(ysw_note_source_t *source)
+{
+    composition_stream_t *stream = (composition_stream_t *)source;
+    ysw_notes_free(stream->pieces[0]);
+    ysw_notes_free(stream->pieces[1]);
+    ysw_notes_free(stream->pending);
+    ysw_array_free(stream->run_ends);
+    ysw_array_free_all(stream->segments);
+    uint32_t snapshot_count = ysw_array_get_count(stream->snapshots);
+    for (uint32_t i = 0; i < snapshot_count; i++) {
+        ysw_notes_free(ysw_array_get(stream->snapshots, i));
+    }
+    ysw_array_free(stream->snapshots);
+    ysw_heap_free(stream);
+}
+
+ysw_note_source_t *zm_stream_composition(zm_music_t *music, zm_composition_t *composition,
+        zm_channel_x base_channel)
+{
+    composition_stream_t *stream = ysw_heap_allocate(sizeof(composition_stream_t));
+    stream->source.next = next_piece;
+    stream->source.free = free_stream;
+    stream->music = music;
+    stream->segments = schedule_composition(music, composition, base_channel);
+    stream->snapshots = ysw_array_create(8);
+    stream->pending = ysw_notes_create(64);
+    stream->pieces[0] = ysw_notes_create(64);
+    stream->pieces[1] = ysw_notes_create(64);
+    stream->run_ends = ysw_array_create(8);
+    ESP_LOGD(TAG, "stream composition segment_count=%d", ysw_array_get_count(stream->segments));
+    return &stream->source;
+}
+
 // +-------+-------+-------+-------+-------+-------+-------+-----+
 // |     | 1 |   | 3 |     |     | 6 |   | 8 |   |10 |     |     |
 // |     |C# |   |D# |     |     |F# |   |G# |   |A# |     |     |
@@ -1117,6 +1510,11 @@ const zm_key_signature_t *zm_get_key_signature(zm_key_signature_x key_index)
     return &zm_key_signatures[key_index % ZM_KS_SZ];
 }
 
+zm_key_signature_x zm_get_key_signature_count(void)
+{
+    return ZM_KS_SZ;
+}
+
 // https://en.wikipedia.org/wiki/Time_signature
 
 static const zm_time_signature_t zm_time_signatures[] = {
@@ -1134,6 +1532,11 @@ const zm_time_signature_t *zm_get_time_signature(zm_time_signature_x time_index)
     return &zm_time_signatures[time_index % ZM_TIME_SIGNATURES];
 }
 
+zm_time_signature_x zm_get_time_signature_count(void)
+{
+    return ZM_TIME_SIGNATURES;
+}
+
 typedef struct {
     uint8_t index;
     zm_duration_t duration;
@@ -1317,6 +1720,8 @@ void zm_copy_section(zm_section_t *to_section, zm_section_t *from_section)
         }
         ysw_array_set_count(to_section->steps, from_count);
     }
+
+    zm_invalidate_section(to_section);
 }
 
 void zm_rename_section(zm_section_t *section, const char *name)
@@ -1413,6 +1818,7 @@ bool zm_transpose_section(zm_section_t *section, zm_range_t *range, uint8_t delt
         }
     }
 
+    zm_invalidate_section(section);
     return true;
 }
 